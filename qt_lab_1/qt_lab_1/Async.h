@@ -0,0 +1,286 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CostModel.h"
+#include "Filter.h"
+#include "Tuner.h"
+
+enum class JobPriority
+{
+	Interactive,	// previews, someone is waiting
+	Normal,
+	Batch
+};
+
+enum class JobStatus
+{
+	Done,
+	Cancelled,
+	Expired,	// deadline passed before the job finished
+	Rejected,	// estimated over the budget at submission, never run
+	Downgraded	// done, but with a scaled-down filter to fit the CPU budget
+};
+
+struct JobResult
+{
+	JobStatus status;
+	QImage image;		// null unless Done or Downgraded
+	std::string reason;	// why the job was Rejected or Downgraded, see admitJob
+	bool succeeded() const { return status == JobStatus::Done || status == JobStatus::Downgraded; }
+};
+
+struct JobOptions
+{
+	JobPriority priority = JobPriority::Normal;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	// Called on the worker thread after every strip with the finished fraction
+	std::function<void(float)> progress;
+	// Called on the worker thread once the result is set, whatever the status
+	std::function<void(const JobResult&)> completion;
+	int stripHeight = 64;
+	// Checked by submit() against the cost model; unlimited by default
+	CostBudget budget;
+	// Run the filter as configured by TuningProfile::instance(); see tunedFilter
+	bool tuned = true;
+};
+
+// Runs filters on a pool of worker threads. Local filters are computed in
+// strips of stripHeight rows; between strips a job checks for cancellation
+// and its deadline, and goes back to the queue if a more urgent job is
+// waiting, so an Interactive job never waits longer than one strip of a
+// Batch job per worker. Filters that need the whole image run in one piece.
+class JobScheduler
+{
+	struct Job
+	{
+		std::shared_ptr<const Filter> filter;
+		QImage source, result;
+		JobOptions options;
+		bool downgraded = false;
+		std::string reason;
+		std::uint64_t sequence = 0;
+		int nextRow = 0;
+		std::atomic<bool> cancelled{ false };
+		std::atomic<float> done{ 0.f };
+		std::promise<JobResult> promise;
+	};
+	typedef std::shared_ptr<Job> JobPtr;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<JobPtr> queue;	// heap, most urgent on top
+	std::vector<std::thread> workers;
+	std::uint64_t sequence = 0;
+	bool stopping = false;
+
+	// True when a should run after b
+	static bool later(const JobPtr& a, const JobPtr& b)
+	{
+		if (a->options.priority != b->options.priority)
+			return a->options.priority > b->options.priority;
+		if (a->options.deadline != b->options.deadline)
+			return a->options.deadline > b->options.deadline;
+		return a->sequence > b->sequence;
+	}
+	void push(JobPtr job)
+	{
+		queue.push_back(std::move(job));
+		std::push_heap(queue.begin(), queue.end(), later);
+	}
+	void worker();
+	// Returns false when the job was put back into the queue unfinished
+	bool run(Job& job, const JobPtr& self);
+	static void finish(Job& job, JobStatus status)
+	{
+		if (status != JobStatus::Done)
+			job.result = QImage();
+		else if (job.downgraded)
+			status = JobStatus::Downgraded;
+		bool explained = status == JobStatus::Rejected || status == JobStatus::Downgraded;
+		JobResult result{ status, job.result, explained ? job.reason : std::string() };
+		job.promise.set_value(result);
+		// The promise is already satisfied, so an exception from the callback
+		// has nowhere to go and must not reach the worker's set_exception
+		if (job.options.completion)
+		{
+			try
+			{
+				job.options.completion(result);
+			}
+			catch (...)
+			{
+			}
+		}
+	}
+public:
+	class Handle
+	{
+		friend class JobScheduler;
+		std::shared_ptr<Job> job;
+		std::shared_future<JobResult> future;
+	public:
+		bool valid() const { return job != nullptr; }
+		// Takes effect at the next strip boundary; queued jobs never start
+		void cancel() { job->cancelled = true; }
+		float progress() const { return job->done; }
+		const std::shared_future<JobResult>& result() const { return future; }
+		JobResult get() const { return future.get(); }
+	};
+
+	explicit JobScheduler(int threads = 0);
+	~JobScheduler();
+	JobScheduler(const JobScheduler&) = delete;
+	JobScheduler& operator=(const JobScheduler&) = delete;
+
+	Handle submit(const QImage& img, std::shared_ptr<const Filter> filter, const JobOptions& options = JobOptions());
+	std::size_t pending()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return queue.size();
+	}
+};
+
+inline JobScheduler::JobScheduler(int threads)
+{
+	if (threads <= 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(&JobScheduler::worker, this);
+}
+
+inline JobScheduler::~JobScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		for (const JobPtr& job : queue)
+			job->cancelled = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : workers)
+		thread.join();
+}
+
+inline JobScheduler::Handle JobScheduler::submit(const QImage& img, std::shared_ptr<const Filter> filter, const JobOptions& options)
+{
+	Handle handle;
+	handle.job = std::make_shared<Job>();
+	Job& job = *handle.job;
+	job.filter = options.tuned ? tunedFilter(filter) : std::move(filter);
+	job.source = img;
+	job.options = options;
+	job.options.stripHeight = std::max(1, options.stripHeight);
+	handle.future = job.promise.get_future().share();
+	if (options.budget.limited())
+	{
+		AdmissionDecision decision = admitJob(job.filter, img.size(), img.format(), options.budget);
+		job.reason = decision.reason;
+		if (decision.verdict == Admission::Rejected)
+		{
+			finish(job, JobStatus::Rejected);
+			return handle;
+		}
+		job.filter = decision.filter;
+		job.downgraded = decision.verdict == Admission::Downgraded;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job.sequence = sequence++;
+		if (stopping)
+			job.cancelled = true;
+		push(handle.job);
+	}
+	wake.notify_one();
+	return handle;
+}
+
+inline void JobScheduler::worker()
+{
+	for (;;)
+	{
+		JobPtr job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			std::pop_heap(queue.begin(), queue.end(), later);
+			job = std::move(queue.back());
+			queue.pop_back();
+		}
+		try
+		{
+			run(*job, job);
+		}
+		catch (...)
+		{
+			job->promise.set_exception(std::current_exception());
+		}
+	}
+}
+
+inline bool JobScheduler::run(Job& job, const JobPtr& self)
+{
+	const Filter& filter = *job.filter;
+	const QImage& img = job.source;
+	for (;;)
+	{
+		if (job.cancelled)
+		{
+			finish(job, JobStatus::Cancelled);
+			return true;
+		}
+		if (std::chrono::steady_clock::now() > job.options.deadline)
+		{
+			finish(job, JobStatus::Expired);
+			return true;
+		}
+		if (!filter.isLocal())
+		{
+			job.result = filter.process(img);
+			job.done = 1.f;
+			if (job.options.progress)
+				job.options.progress(1.f);
+			finish(job, JobStatus::Done);
+			return true;
+		}
+		if (job.result.isNull())
+		{
+			job.result = QImage(img.size(), filter.outputFormat(img));
+			Tracer::countAllocation(job.result.sizeInBytes());
+		}
+
+		int rows = std::min(job.options.stripHeight, img.height() - job.nextRow);
+		{
+			TraceScope scope("job", typeid(filter));
+			scope.addPixels(qint64(img.width()) * rows);
+			filter.processRegion(img, QRect(0, job.nextRow, img.width(), rows), job.result);
+		}
+		job.nextRow += rows;
+		job.done = img.height() > 0 ? float(job.nextRow) / img.height() : 1.f;
+		if (job.options.progress)
+			job.options.progress(job.done);
+		if (job.nextRow >= img.height())
+		{
+			finish(job, JobStatus::Done);
+			return true;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!queue.empty() && later(self, queue.front()))
+		{
+			push(self);
+			wake.notify_one();
+			return false;
+		}
+	}
+}
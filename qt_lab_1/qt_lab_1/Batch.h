@@ -0,0 +1,233 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "Pipeline.h"
+
+// Images of one size and format stacked in a single buffer: image i owns
+// rows [i * height, (i + 1) * height). Views into it are plain QImages
+// over the shared scanlines, so nothing is copied per image.
+class ImageBatch
+{
+	QImage buffer;
+	QSize imageSize;
+	int images = 0;
+public:
+	ImageBatch() = default;
+	ImageBatch(const QSize& size, int count, QImage::Format format)
+		: buffer(size.width(), size.height() * count, format), imageSize(size), images(count)
+	{
+		Tracer::countAllocation(buffer.sizeInBytes());
+	}
+	// Copies images into one batch, converted to the format of the first.
+	// They must have the same size; otherwise the batch is empty
+	static ImageBatch pack(const std::vector<QImage>& list);
+	std::vector<QImage> unpack() const;
+
+	int count() const { return images; }
+	QSize size() const { return imageSize; }
+	QImage::Format format() const { return buffer.format(); }
+	QImage& data() { return buffer; }
+	const QImage& data() const { return buffer; }
+	// Views; valid while the batch lives
+	QImage image(int i) const
+	{
+		return QImage(buffer.constScanLine(i * imageSize.height()), imageSize.width(), imageSize.height(), buffer.bytesPerLine(), buffer.format());
+	}
+	QImage image(int i)
+	{
+		return QImage(buffer.scanLine(i * imageSize.height()), imageSize.width(), imageSize.height(), buffer.bytesPerLine(), buffer.format());
+	}
+	QRect rect(int i) const { return QRect(QPoint(0, i * imageSize.height()), imageSize); }
+};
+
+inline ImageBatch ImageBatch::pack(const std::vector<QImage>& list)
+{
+	if (list.empty())
+		return ImageBatch();
+	for (const QImage& img : list)
+		if (img.size() != list[0].size())
+			return ImageBatch();
+	QImage::Format format = list[0].format() == QImage::Format_Grayscale8 ? QImage::Format_Grayscale8 : workingFormat(list[0]);
+	ImageBatch batch(list[0].size(), static_cast<int>(list.size()), format);
+	int rowBytes = batch.size().width() * batch.data().depth() / 8;
+	for (int i = 0; i < batch.count(); i++)
+	{
+		QImage src = list[i].format() == format ? list[i] : list[i].convertToFormat(format);
+		for (int y = 0; y < batch.size().height(); y++)
+			std::memcpy(batch.buffer.scanLine(i * batch.size().height() + y), src.constScanLine(y), rowBytes);
+	}
+	return batch;
+}
+
+inline std::vector<QImage> ImageBatch::unpack() const
+{
+	std::vector<QImage> list;
+	for (int i = 0; i < images; i++)
+		list.push_back(image(i).copy());
+	return list;
+}
+
+// Runs a filter over every image of a batch. Point filters, and pipelines
+// made only of them, see the whole buffer as one tall image and go through
+// in a single pass split into row bands. Everything else is parallel
+// across images rather than within them: each worker takes the next image
+// and filters its view straight into the output batch.
+class BatchProcessor
+{
+	int threads;
+
+	void pointPass(const Filter& filter, const ImageBatch& in, ImageBatch& out) const;
+	void perImage(const Filter& filter, const ImageBatch& in, ImageBatch& out) const;
+public:
+	explicit BatchProcessor(int threads = 0)
+		: threads(threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))) {}
+	ImageBatch run(const Filter& filter, const ImageBatch& batch) const
+	{
+		ImageBatch out;
+		run(filter, batch, out);
+		return out;
+	}
+	// Writes into out, reusing its buffer when size, count and format fit
+	void run(const Filter& filter, const ImageBatch& batch, ImageBatch& out) const;
+	static bool isPointwise(const Filter& filter);
+};
+
+inline bool BatchProcessor::isPointwise(const Filter& filter)
+{
+	if (dynamic_cast<const PointFilter*>(&filter))
+		return true;
+	const Pipeline* pipeline = dynamic_cast<const Pipeline*>(&filter);
+	if (!pipeline || pipeline->size() == 0)
+		return false;
+	for (std::size_t i = 0; i < pipeline->size(); i++)
+		if (!isPointwise(pipeline->stage(i)))
+			return false;
+	return true;
+}
+
+inline void BatchProcessor::run(const Filter& filter, const ImageBatch& batch, ImageBatch& out) const
+{
+	TraceScope scope("batch", typeid(filter));
+	scope.addPixels(qint64(batch.data().width()) * batch.data().height());
+	if (batch.count() == 0)
+	{
+		out = ImageBatch();
+		return;
+	}
+	// Colour filters get colour input, as in Filter::process
+	ImageBatch widened;
+	const ImageBatch* in = &batch;
+	if (batch.format() == QImage::Format_Grayscale8 && !filter.supportsGray())
+	{
+		widened = ImageBatch(batch.size(), batch.count(), QImage::Format_RGB32);
+		widened.data() = batch.data().convertToFormat(QImage::Format_RGB32);
+		in = &widened;
+	}
+	bool pointwise = isPointwise(filter);
+	QImage::Format format = filter.producesGray() && !pointwise ? QImage::Format_Grayscale8 : filter.outputFormat(in->data());
+	if (out.count() != in->count() || out.size() != in->size() || out.format() != format)
+		out = ImageBatch(in->size(), in->count(), format);
+	if (!pointwise)
+	{
+		perImage(filter, *in, out);
+		return;
+	}
+	pointPass(filter, *in, out);
+	if (filter.producesGray() && out.format() != QImage::Format_Grayscale8)
+		out.data() = narrowToGray(out.data());
+}
+
+inline void BatchProcessor::pointPass(const Filter& filter, const ImageBatch& in, ImageBatch& out) const
+{
+	int rows = in.data().height();
+	int workers = std::min(threads, std::max(1, rows / 64));
+	// Writable pointer taken once, so workers never detach the shared buffer
+	uchar* bits = out.data().bits();
+	int bytesPerLine = out.data().bytesPerLine();
+	std::vector<std::thread> pool;
+	for (int t = 0; t < workers; t++)
+	{
+		int first = rows * t / workers, height = rows * (t + 1) / workers - first;
+		// Band-sized views, so a pipeline sizes its intermediates to the band
+		auto work = [&filter, &in, &out, bits, bytesPerLine, first, height]
+		{
+			const QImage src(in.data().constScanLine(first), in.data().width(), height, in.data().bytesPerLine(), in.format());
+			QImage dst(bits + static_cast<std::size_t>(first) * bytesPerLine, out.size().width(), height, bytesPerLine, out.format());
+			filter.processRegion(src, src.rect(), dst);
+		};
+		if (t + 1 == workers)
+			work();
+		else
+			pool.emplace_back(work);
+	}
+	for (std::thread& thread : pool)
+		thread.join();
+}
+
+inline void BatchProcessor::perImage(const Filter& filter, const ImageBatch& in, ImageBatch& out) const
+{
+	std::atomic<int> next{ 0 };
+	uchar* bits = out.data().bits();
+	int bytesPerLine = out.data().bytesPerLine();
+	auto work = [&]
+	{
+		for (int i = next++; i < in.count(); i = next++)
+		{
+			const QImage src = in.image(i);
+			QImage dst(bits + static_cast<std::size_t>(out.rect(i).top()) * bytesPerLine, out.size().width(), out.size().height(), bytesPerLine, out.format());
+			if (filter.isLocal() && !filter.producesGray())
+			{
+				filter.processRegion(src, src.rect(), dst);
+				continue;
+			}
+			QImage result = filter.process(src);
+			if (out.format() == QImage::Format_Grayscale8)
+				result = narrowToGray(result);
+			else if (result.format() != out.format())
+				result = result.convertToFormat(out.format());
+			int rowBytes = result.width() * result.depth() / 8;
+			for (int y = 0; y < result.height(); y++)
+				std::memcpy(dst.scanLine(y), result.constScanLine(y), rowBytes);
+		}
+	};
+	int workers = std::min(threads, in.count());
+	std::vector<std::thread> pool;
+	for (int t = 1; t < workers; t++)
+		pool.emplace_back(work);
+	work();
+	for (std::thread& thread : pool)
+		thread.join();
+}
+
+// Thumbnails per second for batch sizes 1 to 1024, against calling
+// Filter::process on each image in turn. The batch output is allocated by
+// a warm-up run, as a service reusing its buffers would.
+inline void printBatchThroughput(const Filter& filter, const QImage& thumbnail, std::ostream& out = std::cout, int threads = 0)
+{
+	BatchProcessor processor(threads);
+	out << className(typeid(filter)) << " on " << thumbnail.width() << "x" << thumbnail.height() << "\n";
+	out << std::setw(8) << "batch" << std::setw(16) << "batch img/s" << std::setw(16) << "single img/s" << "\n";
+	for (int count = 1; count <= 1024; count *= 4)
+	{
+		std::vector<QImage> images(count, thumbnail.copy());
+		ImageBatch batch = ImageBatch::pack(images), result;
+		processor.run(filter, batch, result);
+		auto start = std::chrono::steady_clock::now();
+		processor.run(filter, batch, result);
+		double batched = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < count; i++)
+			filter.process(images[i]);
+		double single = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		out << std::setw(8) << count << std::setw(16) << std::fixed << std::setprecision(0)
+			<< count / std::max(batched, 1e-9) << std::setw(16) << count / std::max(single, 1e-9) << "\n";
+		out.unsetf(std::ios::fixed);
+	}
+}
@@ -0,0 +1,376 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "Filter.h"
+
+// Edge-preserving smoothing: every pixel becomes the average of its
+// neighbours weighted by a Gaussian of their distance (sigmaSpatial, in
+// pixels) times a Gaussian of their luma difference (sigmaRange, in 0..255
+// levels). All channels share the luma weights, so edges are kept in colour
+// as they are in brightness; neighbours outside the image do not count.
+//
+// Runs on a bilateral grid (Paris and Durand): pixels are summed into cells
+// sigmaSpatial pixels wide and sigmaRange levels deep, the grid is blurred
+// with the binomial kernel (1 4 6 4 1) / 16 along each axis, which is a
+// Gaussian of one cell, and the result is read back by trilinear
+// interpolation at each pixel's position and luma. The work per pixel does
+// not depend on sigmaSpatial; the grid shrinks as it grows.
+//
+// The grid has a cell per sigmaSpatial^2 pixels and sigmaRange levels, so
+// small sigmas make it much larger than the image. sigmaRange is at least
+// BilateralMinSigmaRange levels; below BilateralMinGridSigma, or when the
+// grid would still take more than BilateralMaxGridBytes per pixel, the
+// window of radius 3 sigmaSpatial is summed directly instead, which is
+// cheap for exactly those small windows.
+const float BilateralMinSigmaRange = 4.f;
+const float BilateralMinGridSigma = 3.f;
+const int BilateralMaxGridBytes = 64;
+
+class BilateralFilter : public Filter
+{
+	float sigmaSpatial, sigmaRange;
+	int threads;
+
+	// Cell layout: (gy * width + gx) * depth + gz, four floats (r, g, b, weight) each
+	struct Grid
+	{
+		int width, height, depth;
+		std::vector<float> cells;
+		float* cell(int gx, int gy, int gz) { return cells.data() + ((static_cast<std::size_t>(gy) * width + gx) * depth + gz) * 4; }
+	};
+	static const int Pad = 2;	// cells around the image, the reach of the blur
+
+	template <class F> void forBands(int count, F work) const;
+	void blur(Grid& grid) const;
+	bool useGrid(const QSize& size) const;
+	// Pixels of rect, written to dst shifted by -origin; src is already in
+	// the working format
+	void processDirect(const QImage& src, const QRect& rect, QImage& dst, const QPoint& origin = QPoint()) const;
+	static QImage workingCopy(const QImage& img)
+	{
+		return img.format() == QImage::Format_Grayscale8 || img.format() == workingFormat(img) ? img : img.convertToFormat(workingFormat(img));
+	}
+protected:
+	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	QImage processImage(const QImage& img) const override;
+public:
+	BilateralFilter(float sigmaSpatial = 8.f, float sigmaRange = 20.f, int threads = 0)
+		: sigmaSpatial(std::max(1.f, sigmaSpatial)), sigmaRange(std::max(BilateralMinSigmaRange, sigmaRange)),
+		threads(threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))) {}
+	// The grid spans the whole image, so a region is cut out of the full result
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	bool isLocal() const override { return false; }
+	bool supportsGray() const override { return true; }
+	void hashParams(ParamHash& hash) const override { hash.add(sigmaSpatial).add(sigmaRange); }
+	std::shared_ptr<const Filter> scaled(float factor) const override
+	{
+		return std::make_shared<BilateralFilter>(sigmaSpatial * factor, sigmaRange, threads);
+	}
+	float getSigmaSpatial() const { return sigmaSpatial; }
+	float getSigmaRange() const { return sigmaRange; }
+};
+
+template <class F>
+void BilateralFilter::forBands(int count, F work) const
+{
+	int bands = std::min(threads, std::max(1, count));
+	std::vector<std::thread> pool;
+	for (int band = 1; band < bands; band++)
+		pool.emplace_back(work, count * band / bands, count * (band + 1) / bands);
+	work(0, count / bands);
+	for (std::thread& thread : pool)
+		thread.join();
+}
+
+inline bool BilateralFilter::useGrid(const QSize& size) const
+{
+	if (sigmaSpatial < BilateralMinGridSigma)
+		return false;
+	double cells = (std::ceil((size.width() - 1) / sigmaSpatial) + 1 + 2 * Pad) * (std::ceil((size.height() - 1) / sigmaSpatial) + 1 + 2 * Pad)
+		* (std::ceil(255 / sigmaRange) + 1 + 2 * Pad);
+	return cells * 4 * sizeof(float) <= double(BilateralMaxGridBytes) * size.width() * size.height();
+}
+
+// The weights of bilateralReference, the spatial ones tabulated per window
+// offset and the range ones per quarter level of luma difference
+inline void BilateralFilter::processDirect(const QImage& src, const QRect& rect, QImage& dst, const QPoint& origin) const
+{
+	bool gray = src.format() == QImage::Format_Grayscale8;
+	int radius = static_cast<int>(std::ceil(3 * sigmaSpatial)), side = 2 * radius + 1;
+	std::vector<float> spatial(static_cast<std::size_t>(side) * side);
+	for (int j = -radius; j <= radius; j++)
+		for (int i = -radius; i <= radius; i++)
+			spatial[(j + radius) * side + i + radius] = std::exp(-(i * i + j * j) / (2 * sigmaSpatial * sigmaSpatial));
+	std::vector<float> range(256 * 4);
+	for (std::size_t d = 0; d < range.size(); d++)
+		range[d] = std::exp(-(d / 4.f) * (d / 4.f) / (2 * sigmaRange * sigmaRange));
+
+	// Luma of everything the windows reach
+	QRect area = rect.adjusted(-radius, -radius, radius, radius).intersected(src.rect());
+	std::vector<float> lumas(static_cast<std::size_t>(area.width()) * area.height());
+	Tracer::countAllocation(lumas.size() * sizeof(float));
+	for (int y = 0; y < area.height(); y++)
+	{
+		const uchar* line = src.constScanLine(area.top() + y);
+		float* l = lumas.data() + static_cast<std::size_t>(y) * area.width();
+		for (int x = 0; x < area.width(); x++)
+			l[x] = gray ? line[area.left() + x] : luma(reinterpret_cast<const QRgb*>(line)[area.left() + x]);
+	}
+
+	uchar* bits = dst.bits();
+	int bytesPerLine = dst.bytesPerLine();
+	forBands(rect.height(), [&](int y0, int y1)
+	{
+		for (int y = rect.top() + y0; y < rect.top() + y1; y++)
+		{
+			uchar* grayLine = bits + static_cast<std::size_t>(y - origin.y()) * bytesPerLine;
+			QRgb* line = reinterpret_cast<QRgb*>(grayLine);
+			for (int x = rect.left(); x <= rect.right(); x++)
+			{
+				float centre = lumas[static_cast<std::size_t>(y - area.top()) * area.width() + x - area.left()];
+				int left = std::max(area.left(), x - radius), right = std::min(area.right(), x + radius);
+				float sum[3] = { 0, 0, 0 }, norm = 0;
+				for (int j = std::max(area.top(), y - radius); j <= std::min(area.bottom(), y + radius); j++)
+				{
+					const float* l = lumas.data() + static_cast<std::size_t>(j - area.top()) * area.width() - area.left();
+					const float* s = spatial.data() + (j - y + radius) * side + radius - x;
+					const uchar* srcLine = src.constScanLine(j);
+					for (int i = left; i <= right; i++)
+					{
+						int d = std::min(static_cast<int>(range.size()) - 1, static_cast<int>(std::abs(l[i] - centre) * 4 + 0.5f));
+						float w = s[i] * range[d];
+						if (gray)
+							sum[0] += w * srcLine[i];
+						else
+						{
+							QRgb p = reinterpret_cast<const QRgb*>(srcLine)[i];
+							sum[0] += w * qRed(p);
+							sum[1] += w * qGreen(p);
+							sum[2] += w * qBlue(p);
+						}
+						norm += w;
+					}
+				}
+				// The centre pixel alone weighs 1
+				auto channel = [&](int c) { return static_cast<int>(tclamp(sum[c] / norm + 0.5f, 255.f, 0.f)); };
+				if (gray)
+					grayLine[x - origin.x()] = static_cast<uchar>(channel(0));
+				else
+					line[x - origin.x()] = qRgba(channel(0), channel(1), channel(2), qAlpha(reinterpret_cast<const QRgb*>(src.constScanLine(y))[x]));
+			}
+		}
+	});
+}
+
+// One axis at a time; lines along the axis are independent, so each pass
+// is split over the grid rows (or, for the vertical pass, the columns)
+void BilateralFilter::blur(Grid& grid) const
+{
+	auto pass = [](float* first, std::size_t stride, int length, std::vector<float>& line)
+	{
+		line.resize(static_cast<std::size_t>(length) * 4);
+		for (int i = 0; i < length; i++)
+			std::copy(first + i * stride, first + i * stride + 4, line.begin() + i * 4);
+		for (int i = 0; i < length; i++)
+			for (int c = 0; c < 4; c++)
+			{
+				auto at = [&](int j) { return j >= 0 && j < length ? line[j * 4 + c] : 0.f; };
+				first[i * stride + c] = (at(i - 2) + 4 * at(i - 1) + 6 * at(i) + 4 * at(i + 1) + at(i + 2)) / 16;
+			}
+	};
+	std::size_t depthStride = 4, rowStride = std::size_t(grid.depth) * 4, columnStride = std::size_t(grid.width) * grid.depth * 4;
+	forBands(grid.height, [&](int gy0, int gy1)
+	{
+		std::vector<float> line;
+		for (int gy = gy0; gy < gy1; gy++)
+			for (int gx = 0; gx < grid.width; gx++)
+				pass(grid.cell(gx, gy, 0), depthStride, grid.depth, line);
+		for (int gy = gy0; gy < gy1; gy++)
+			for (int gz = 0; gz < grid.depth; gz++)
+				pass(grid.cell(0, gy, gz), rowStride, grid.width, line);
+	});
+	forBands(grid.width, [&](int gx0, int gx1)
+	{
+		std::vector<float> line;
+		for (int gx = gx0; gx < gx1; gx++)
+			for (int gz = 0; gz < grid.depth; gz++)
+				pass(grid.cell(gx, 0, gz), columnStride, grid.height, line);
+	});
+}
+
+QImage BilateralFilter::processImage(const QImage& img) const
+{
+	bool gray = img.format() == QImage::Format_Grayscale8;
+	QImage src = workingCopy(img);
+	int width = src.width(), height = src.height();
+	QImage result(src.size(), gray ? QImage::Format_Grayscale8 : src.format());
+	if (width == 0 || height == 0)
+		return result;
+	if (!useGrid(src.size()))
+	{
+		processDirect(src, src.rect(), result);
+		return result;
+	}
+
+	Grid grid;
+	grid.width = static_cast<int>(std::ceil((width - 1) / sigmaSpatial)) + 1 + 2 * Pad;
+	grid.height = static_cast<int>(std::ceil((height - 1) / sigmaSpatial)) + 1 + 2 * Pad;
+	grid.depth = static_cast<int>(std::ceil(255 / sigmaRange)) + 1 + 2 * Pad;
+	grid.cells.assign(static_cast<std::size_t>(grid.width) * grid.height * grid.depth * 4, 0.f);
+	Tracer::countAllocation(grid.cells.size() * sizeof(float));
+
+	auto pixelAt = [&src, gray](int x, int y, float* rgb)
+	{
+		if (gray)
+		{
+			rgb[0] = rgb[1] = rgb[2] = src.constScanLine(y)[x];
+			return rgb[0];
+		}
+		QRgb c = reinterpret_cast<const QRgb*>(src.constScanLine(y))[x];
+		rgb[0] = static_cast<float>(qRed(c));
+		rgb[1] = static_cast<float>(qGreen(c));
+		rgb[2] = static_cast<float>(qBlue(c));
+		return luma(c);
+	};
+
+	// Splat to the nearest cell. Image rows are split by the grid row they
+	// land in, so no two threads ever add to the same cell.
+	forBands(grid.height, [&](int gy0, int gy1)
+	{
+		float rgb[3];
+		for (int y = 0; y < height; y++)
+		{
+			int gy = static_cast<int>(y / sigmaSpatial + 0.5f) + Pad;
+			if (gy < gy0 || gy >= gy1)
+				continue;
+			for (int x = 0; x < width; x++)
+			{
+				float l = pixelAt(x, y, rgb);
+				float* cell = grid.cell(static_cast<int>(x / sigmaSpatial + 0.5f) + Pad, gy, static_cast<int>(l / sigmaRange + 0.5f) + Pad);
+				cell[0] += rgb[0];
+				cell[1] += rgb[1];
+				cell[2] += rgb[2];
+				cell[3] += 1.f;
+			}
+		}
+	});
+	blur(grid);
+
+	// Slice: trilinear lookup at (x, y, luma), normalised by the weight channel.
+	// Rows are written through the bits taken here, so no thread detaches the result.
+	uchar* bits = result.bits();
+	int bytesPerLine = result.bytesPerLine();
+	forBands(height, [&](int y0, int y1)
+	{
+		float rgb[3];
+		for (int y = y0; y < y1; y++)
+		{
+			float fy = y / sigmaSpatial + Pad;
+			int gy = std::min(static_cast<int>(fy), grid.height - 2);
+			float ty = fy - gy;
+			uchar* grayLine = bits + static_cast<std::size_t>(y) * bytesPerLine;
+			QRgb* line = reinterpret_cast<QRgb*>(grayLine);
+			const QRgb* srcLine = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+			for (int x = 0; x < width; x++)
+			{
+				float l = pixelAt(x, y, rgb);
+				float fx = x / sigmaSpatial + Pad, fz = l / sigmaRange + Pad;
+				int gx = std::min(static_cast<int>(fx), grid.width - 2), gz = std::min(static_cast<int>(fz), grid.depth - 2);
+				float tx = fx - gx, tz = fz - gz;
+				float sum[4] = { 0, 0, 0, 0 };
+				for (int k = 0; k < 8; k++)
+				{
+					int dx = k & 1, dy = (k >> 1) & 1, dz = k >> 2;
+					float w = (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty) * (dz ? tz : 1 - tz);
+					const float* cell = grid.cell(gx + dx, gy + dy, gz + dz);
+					for (int c = 0; c < 4; c++)
+						sum[c] += w * cell[c];
+				}
+				// Every pixel splats into a cell next to its own position, so the weight is never 0
+				float norm = sum[3] > 0 ? 1.f / sum[3] : 0.f;
+				int r = static_cast<int>(tclamp(sum[0] * norm + 0.5f, 255.f, 0.f));
+				if (gray)
+				{
+					grayLine[x] = static_cast<uchar>(r);
+					continue;
+				}
+				int g = static_cast<int>(tclamp(sum[1] * norm + 0.5f, 255.f, 0.f));
+				int b = static_cast<int>(tclamp(sum[2] * norm + 0.5f, 255.f, 0.f));
+				line[x] = qRgba(r, g, b, qAlpha(srcLine[x]));
+			}
+		}
+	});
+	return result;
+}
+
+// The exact value at one pixel, which the grid approximates
+QColor BilateralFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+{
+	QImage src = workingCopy(img);
+	QImage pixel(1, 1, src.format());
+	processDirect(src, QRect(x, y, 1, 1), pixel, QPoint(x, y));
+	return pixel.pixelColor(0, 0);
+}
+
+void BilateralFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	QImage src = workingCopy(img);
+	if (!useGrid(src.size()) && dst.format() == (src.format() == QImage::Format_Grayscale8 ? QImage::Format_Grayscale8 : src.format()))
+	{
+		processDirect(src, rect, dst);
+		return;
+	}
+	QImage full = processImage(src);
+	if (full.format() != dst.format())
+		full = dst.format() == QImage::Format_Grayscale8 ? narrowToGray(full) : full.convertToFormat(dst.format());
+	int bpp = full.depth() / 8;
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+		std::memcpy(dst.scanLine(y) + rect.left() * bpp, full.constScanLine(y) + rect.left() * bpp, rect.width() * bpp);
+}
+
+// Brute-force bilateral filter with the same weights, over a window of
+// radius 3 sigmaSpatial. O(r^2) per pixel with an exp per tap; kept to
+// validate the grid, not for use.
+inline QImage bilateralReference(const QImage& img, float sigmaSpatial, float sigmaRange)
+{
+	bool gray = img.format() == QImage::Format_Grayscale8;
+	QImage src = gray || img.format() == workingFormat(img) ? img : img.convertToFormat(workingFormat(img));
+	QImage result(src.size(), gray ? QImage::Format_Grayscale8 : src.format());
+	int radius = static_cast<int>(std::ceil(3 * sigmaSpatial));
+	auto value = [&src, gray](int x, int y, int c)
+	{
+		if (gray)
+			return static_cast<float>(src.constScanLine(y)[x]);
+		QRgb p = reinterpret_cast<const QRgb*>(src.constScanLine(y))[x];
+		return static_cast<float>(c == 0 ? qRed(p) : c == 1 ? qGreen(p) : c == 2 ? qBlue(p) : 0);
+	};
+	auto lumaAt = [&src, gray](int x, int y)
+	{
+		return gray ? static_cast<float>(src.constScanLine(y)[x]) : luma(reinterpret_cast<const QRgb*>(src.constScanLine(y))[x]);
+	};
+	for (int y = 0; y < src.height(); y++)
+		for (int x = 0; x < src.width(); x++)
+		{
+			float centre = lumaAt(x, y);
+			double sum[3] = { 0, 0, 0 }, norm = 0;
+			for (int j = std::max(0, y - radius); j <= std::min(src.height() - 1, y + radius); j++)
+				for (int i = std::max(0, x - radius); i <= std::min(src.width() - 1, x + radius); i++)
+				{
+					float d = lumaAt(i, j) - centre;
+					double w = std::exp(-((i - x) * (i - x) + (j - y) * (j - y)) / (2.0 * sigmaSpatial * sigmaSpatial) - d * d / (2.0 * sigmaRange * sigmaRange));
+					for (int c = 0; c < 3; c++)
+						sum[c] += w * value(i, j, c);
+					norm += w;
+				}
+			auto channel = [&](int c) { return static_cast<int>(tclamp(sum[c] / norm + 0.5, 255.0, 0.0)); };
+			if (gray)
+				result.scanLine(y)[x] = static_cast<uchar>(channel(0));
+			else
+				reinterpret_cast<QRgb*>(result.scanLine(y))[x] = qRgba(channel(0), channel(1), channel(2), qAlpha(reinterpret_cast<const QRgb*>(src.constScanLine(y))[x]));
+		}
+	return result;
+}
@@ -0,0 +1,292 @@
+﻿#pragma once
+#include <QImage>
+#include <cstdint>
+#include <vector>
+#include "Filter.h"
+
+// One bit per pixel, 64 pixels per word; pixel x of a row is bit x % 64 of
+// word x / 64. Bits past the width in the last word are kept zero.
+class BinaryImage
+{
+	int w = 0, h = 0, stride = 0;
+	std::vector<std::uint64_t> bits;
+public:
+	BinaryImage() = default;
+	BinaryImage(int width, int height) : w(width), h(height), stride((width + 63) / 64),
+		bits(static_cast<std::size_t>((width + 63) / 64) * height, 0)
+	{
+		Tracer::countAllocation(bits.size() * sizeof(std::uint64_t));
+	}
+	int width() const { return w; }
+	int height() const { return h; }
+	int words() const { return stride; }
+	std::uint64_t* row(int y) { return bits.data() + static_cast<std::size_t>(y) * stride; }
+	const std::uint64_t* row(int y) const { return bits.data() + static_cast<std::size_t>(y) * stride; }
+	bool get(int x, int y) const { return (row(y)[x >> 6] >> (x & 63)) & 1; }
+	void set(int x, int y, bool value)
+	{
+		std::uint64_t bit = std::uint64_t(1) << (x & 63);
+		if (value)
+			row(y)[x >> 6] |= bit;
+		else
+			row(y)[x >> 6] &= ~bit;
+	}
+	// Mask of the valid bits in the last word of a row
+	std::uint64_t tailMask() const { return (w & 63) ? (std::uint64_t(1) << (w & 63)) - 1 : ~std::uint64_t(0); }
+
+	// Pixels whose luminance is at least level become 1
+	static BinaryImage threshold(const QImage& img, int level = 128);
+	QImage toImage(QRgb on = qRgb(255, 255, 255), QRgb off = qRgb(0, 0, 0)) const;
+};
+
+inline BinaryImage BinaryImage::threshold(const QImage& img, int level)
+{
+	BinaryImage result(img.width(), img.height());
+	QImage src = img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32
+		? img : img.convertToFormat(QImage::Format_ARGB32);
+	int scaled = level * 1000;
+	for (int y = 0; y < img.height(); y++)
+	{
+		const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+		std::uint64_t* dst = result.row(y);
+		for (int x0 = 0; x0 < img.width(); x0 += 64)
+		{
+			std::uint64_t word = 0;
+			int count = std::min(64, img.width() - x0);
+			for (int b = 0; b < count; b++)
+			{
+				QRgb c = line[x0 + b];
+				if (299 * qRed(c) + 587 * qGreen(c) + 114 * qBlue(c) >= scaled)
+					word |= std::uint64_t(1) << b;
+			}
+			dst[x0 >> 6] = word;
+		}
+	}
+	return result;
+}
+
+inline QImage BinaryImage::toImage(QRgb on, QRgb off) const
+{
+	QImage result(w, h, QImage::Format_RGB32);
+	for (int y = 0; y < h; y++)
+	{
+		const std::uint64_t* src = row(y);
+		QRgb* line = reinterpret_cast<QRgb*>(result.scanLine(y));
+		for (int x = 0; x < w; x++)
+			line[x] = (src[x >> 6] >> (x & 63)) & 1 ? on : off;
+	}
+	return result;
+}
+
+// Binary dilation, erosion and their compounds with bitwise operations on
+// whole words. Same semantics as DilationFilter / ErosionFilter on a
+// black-and-white image: the mask is the non-zero taps of a Kernel, applied
+// without reflection, and pixels outside the image replicate the edge.
+class BinaryMorphology
+{
+	std::vector<QPoint> taps;	// (column, row) offsets of the set mask entries
+	int radius;
+
+	// dst[x] = src[clamp(x + shift)] for a whole row
+	static void shiftRow(const std::uint64_t* src, std::uint64_t* dst, int words, int width, int shift);
+	BinaryImage apply(const BinaryImage& src, bool dilate) const;
+public:
+	BinaryMorphology(const Kernel& mask);
+	int getRadius() const { return radius; }
+	const std::vector<QPoint>& getTaps() const { return taps; }
+
+	BinaryImage dilate(const BinaryImage& src) const { return apply(src, true); }
+	BinaryImage erode(const BinaryImage& src) const { return apply(src, false); }
+	BinaryImage open(const BinaryImage& src) const { return dilate(erode(src)); }
+	BinaryImage close(const BinaryImage& src) const { return erode(dilate(src)); }
+	// dilate - erode
+	BinaryImage gradient(const BinaryImage& src) const;
+	// src - open
+	BinaryImage topHat(const BinaryImage& src) const;
+	// close - src
+	BinaryImage blackHat(const BinaryImage& src) const;
+};
+
+inline BinaryMorphology::BinaryMorphology(const Kernel& mask) : radius(static_cast<int>(mask.getRadius()))
+{
+	int size = static_cast<int>(mask.getSize());
+	for (int i = 0; i < size; i++)
+		for (int j = 0; j < size; j++)
+			if (mask[i * size + j])
+				taps.push_back(QPoint(j - radius, i - radius));
+}
+
+inline void BinaryMorphology::shiftRow(const std::uint64_t* src, std::uint64_t* dst, int words, int width, int shift)
+{
+	int wordShift = shift >> 6;	// floor division, also for negative shifts
+	int bitShift = shift & 63;
+	for (int k = 0; k < words; k++)
+	{
+		int a = k + wordShift, b = a + 1;
+		std::uint64_t lo = a >= 0 && a < words ? src[a] : 0;
+		std::uint64_t hi = b >= 0 && b < words ? src[b] : 0;
+		dst[k] = bitShift ? (lo >> bitShift) | (hi << (64 - bitShift)) : lo;
+	}
+	// Replicate the edge pixel over the positions that were shifted in
+	auto fill = [dst](int from, int to, bool value)
+	{
+		for (int x = from; x < to; x++)
+		{
+			std::uint64_t bit = std::uint64_t(1) << (x & 63);
+			dst[x >> 6] = value ? dst[x >> 6] | bit : dst[x >> 6] & ~bit;
+		}
+	};
+	if (shift > 0)
+		fill(std::max(0, width - shift), width, (src[(width - 1) >> 6] >> ((width - 1) & 63)) & 1);
+	else if (shift < 0)
+		fill(0, std::min(width, -shift), src[0] & 1);
+	if (width & 63)
+		dst[words - 1] &= (std::uint64_t(1) << (width & 63)) - 1;
+}
+
+inline BinaryImage BinaryMorphology::apply(const BinaryImage& src, bool dilate) const
+{
+	TraceScope scope("filter", dilate ? "BinaryMorphology::dilate" : "BinaryMorphology::erode");
+	scope.addPixels(qint64(src.width()) * src.height());
+	int width = src.width(), height = src.height(), words = src.words();
+	BinaryImage result(width, height);
+	std::vector<std::uint64_t> shifted(words);
+	std::uint64_t tail = src.tailMask();
+	for (int y = 0; y < height; y++)
+	{
+		std::uint64_t* acc = result.row(y);
+		std::fill(acc, acc + words, dilate ? std::uint64_t(0) : ~std::uint64_t(0));
+		for (const QPoint& tap : taps)
+		{
+			const std::uint64_t* line = src.row(std::max(0, std::min(height - 1, y + tap.y())));
+			const std::uint64_t* from = line;
+			if (tap.x() != 0)
+			{
+				shiftRow(line, shifted.data(), words, width, tap.x());
+				from = shifted.data();
+			}
+			if (dilate)
+				for (int k = 0; k < words; k++)
+					acc[k] |= from[k];
+			else
+				for (int k = 0; k < words; k++)
+					acc[k] &= from[k];
+		}
+		if (words)
+			acc[words - 1] &= tail;
+	}
+	return result;
+}
+
+inline BinaryImage BinaryMorphology::gradient(const BinaryImage& src) const
+{
+	BinaryImage a = dilate(src), b = erode(src);
+	for (int y = 0; y < src.height(); y++)
+		for (int k = 0; k < src.words(); k++)
+			a.row(y)[k] &= ~b.row(y)[k];
+	return a;
+}
+
+inline BinaryImage BinaryMorphology::topHat(const BinaryImage& src) const
+{
+	BinaryImage result = open(src);
+	for (int y = 0; y < src.height(); y++)
+		for (int k = 0; k < src.words(); k++)
+			result.row(y)[k] = src.row(y)[k] & ~result.row(y)[k];
+	return result;
+}
+
+inline BinaryImage BinaryMorphology::blackHat(const BinaryImage& src) const
+{
+	BinaryImage result = close(src);
+	for (int y = 0; y < src.height(); y++)
+		for (int k = 0; k < src.words(); k++)
+			result.row(y)[k] &= ~src.row(y)[k];
+	return result;
+}
+
+enum class MorphologyOp
+{
+	Dilate,
+	Erode,
+	Open,
+	Close,
+	Gradient,
+	TopHat,
+	BlackHat
+};
+
+// Thresholds, runs one packed operation and unpacks to black and white,
+// so it can stand in a Pipeline like the colour morphology filters
+class BinaryMorphologyFilter : public Filter
+{
+protected:
+	MorphologyOp op;
+	BinaryMorphology morphology;
+	int level;
+	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	QImage processImage(const QImage& img) const override;
+	BinaryImage run(const BinaryImage& src) const;
+public:
+	BinaryMorphologyFilter(MorphologyOp op, const Kernel& mask = MorphoKernel(1), int level = 128)
+		: op(op), morphology(mask), level(level) {}
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	QMargins margins() const override
+	{
+		// Compound operators apply the mask twice
+		int r = morphology.getRadius() * (op == MorphologyOp::Dilate || op == MorphologyOp::Erode ? 1 : 2);
+		return QMargins(r, r, r, r);
+	}
+	void hashParams(ParamHash& hash) const override;
+};
+
+inline BinaryImage BinaryMorphologyFilter::run(const BinaryImage& src) const
+{
+	switch (op)
+	{
+	case MorphologyOp::Dilate:
+		return morphology.dilate(src);
+	case MorphologyOp::Erode:
+		return morphology.erode(src);
+	case MorphologyOp::Open:
+		return morphology.open(src);
+	case MorphologyOp::Close:
+		return morphology.close(src);
+	case MorphologyOp::Gradient:
+		return morphology.gradient(src);
+	case MorphologyOp::TopHat:
+		return morphology.topHat(src);
+	default:
+		return morphology.blackHat(src);
+	}
+}
+
+inline QColor BinaryMorphologyFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+{
+	return process(img, QRect(x, y, 1, 1)).pixelColor(0, 0);
+}
+
+inline QImage BinaryMorphologyFilter::processImage(const QImage& img) const
+{
+	return run(BinaryImage::threshold(img, level)).toImage();
+}
+
+inline void BinaryMorphologyFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	// Replicating at the edge of the crop cannot reach rect, which is margins() inside it
+	QRect area = requiredRect(rect, img.size());
+	BinaryImage result = run(BinaryImage::threshold(img.copy(area), level));
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+	{
+		QRgb* line = reinterpret_cast<QRgb*>(dst.scanLine(y));
+		for (int x = rect.left(); x <= rect.right(); x++)
+			line[x] = result.get(x - area.left(), y - area.top()) ? qRgb(255, 255, 255) : qRgb(0, 0, 0);
+	}
+}
+
+inline void BinaryMorphologyFilter::hashParams(ParamHash& hash) const
+{
+	hash.add(op).add(level).add(morphology.getRadius());
+	for (const QPoint& tap : morphology.getTaps())
+		hash.add(tap.x()).add(tap.y());
+}
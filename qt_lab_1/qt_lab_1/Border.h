@@ -0,0 +1,199 @@
+﻿#pragma once
+#include <QImage>
+#include <QMargins>
+#include <QRect>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "Trace.h"
+
+// How neighbourhood filters sample pixels that fall outside the image.
+// Replicate matches the old tclamp behaviour and stays the default.
+enum class BorderMode
+{
+	Replicate,	// aaa|abcd|ddd
+	Reflect,	// cba|abcd|dcb
+	Wrap,		// bcd|abcd|abc
+	Constant	// kkk|abcd|kkk
+};
+
+struct BorderPolicy
+{
+	BorderMode mode = BorderMode::Replicate;
+	QRgb color = qRgb(0, 0, 0);
+
+	BorderPolicy() = default;
+	BorderPolicy(BorderMode mode, QRgb color = qRgb(0, 0, 0)) : mode(mode), color(color) {}
+};
+
+// Maps coordinate i onto [0, n). Returns -1 when the Constant colour must be
+// used, and on an empty axis, where there is nothing to map onto.
+inline int borderIndex(int i, int n, BorderMode mode)
+{
+	if (i >= 0 && i < n)
+		return i;
+	if (n <= 0)
+		return -1;
+	switch (mode)
+	{
+	case BorderMode::Replicate:
+		return i < 0 ? 0 : n - 1;
+	case BorderMode::Reflect:
+	{
+		int period = 2 * n;
+		i %= period;
+		if (i < 0)
+			i += period;
+		return i < n ? i : period - 1 - i;
+	}
+	case BorderMode::Wrap:
+		i %= n;
+		return i < 0 ? i + n : i;
+	default:
+		return -1;
+	}
+}
+
+// Input area a neighbourhood of the given margins reads around rect.
+// Wrap reads the opposite edge, so it needs everything once rect reaches a border.
+inline QRect borderArea(const QRect& rect, const QMargins& margins, const QSize& size, BorderMode mode)
+{
+	QRect bounds(QPoint(0, 0), size);
+	QRect area = rect.marginsAdded(margins);
+	if (mode == BorderMode::Wrap && !bounds.contains(area))
+		return bounds;
+	return area.intersected(bounds);
+}
+
+inline QRgb borderPixel(const QImage& img, int x, int y, const BorderPolicy& border)
+{
+	int bx = borderIndex(x, img.width(), border.mode);
+	int by = borderIndex(y, img.height(), border.mode);
+	if (bx < 0 || by < 0)
+		return border.color;
+	return img.pixel(bx, by);
+}
+
+// Copy of an image area surrounded by `pad` pixels of border on every side.
+// Neighbourhood kernels read it without any coordinate checks: row(y)[x]
+// is valid for x in [-pad, width + pad) and y in [-pad, height + pad),
+// where (0, 0) is the top-left corner of the area.
+class PaddedImage
+{
+	std::vector<QRgb> pixels;
+	int width, height, pad, stride;
+public:
+	PaddedImage(const QImage& img, int pad, const BorderPolicy& border = BorderPolicy(), QRect area = QRect());
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getPad() const { return pad; }
+	const QRgb* row(int y) const { return pixels.data() + (y + pad) * stride + pad; }
+};
+
+inline PaddedImage::PaddedImage(const QImage& img, int pad, const BorderPolicy& border, QRect area) : pad(pad)
+{
+	if (area.isNull())
+		area = img.rect();
+	width = area.width();
+	height = area.height();
+	stride = width + 2 * pad;
+	pixels.resize(static_cast<std::size_t>(stride) * (height + 2 * pad));
+	Tracer::countAllocation(pixels.size() * sizeof(QRgb));
+	if (img.isNull())
+	{
+		std::fill(pixels.begin(), pixels.end(), border.color);
+		return;
+	}
+
+	QImage src = img;
+	if (src.format() != QImage::Format_RGB32 && src.format() != QImage::Format_ARGB32)
+		src = src.convertToFormat(QImage::Format_ARGB32);
+
+	// Columns of the padded row that map back into the image, in image coordinates
+	int x0 = area.left() - pad;
+	int innerBegin = std::max(0, std::min(stride, -x0));
+	int innerEnd = std::max(innerBegin, std::min(stride, img.width() - x0));
+
+	for (int py = 0; py < height + 2 * pad; py++)
+	{
+		QRgb* dst = pixels.data() + py * stride;
+		int sy = borderIndex(area.top() - pad + py, img.height(), border.mode);
+		if (sy < 0)
+		{
+			std::fill(dst, dst + stride, border.color);
+			continue;
+		}
+		const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(sy));
+		if (innerEnd > innerBegin)
+			std::memcpy(dst + innerBegin, line + x0 + innerBegin, (innerEnd - innerBegin) * sizeof(QRgb));
+		for (int px = 0; px < innerBegin; px++)
+		{
+			int sx = borderIndex(x0 + px, img.width(), border.mode);
+			dst[px] = sx < 0 ? border.color : line[sx];
+		}
+		for (int px = innerEnd; px < stride; px++)
+		{
+			int sx = borderIndex(x0 + px, img.width(), border.mode);
+			dst[px] = sx < 0 ? border.color : line[sx];
+		}
+	}
+}
+
+// Single-channel counterpart of PaddedImage for Format_Grayscale8 sources
+class PaddedPlane
+{
+	std::vector<uchar> pixels;
+	int width, height, pad, stride;
+public:
+	PaddedPlane(const QImage& img, int pad, const BorderPolicy& border = BorderPolicy(), QRect area = QRect());
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getPad() const { return pad; }
+	const uchar* row(int y) const { return pixels.data() + (y + pad) * stride + pad; }
+};
+
+inline PaddedPlane::PaddedPlane(const QImage& img, int pad, const BorderPolicy& border, QRect area) : pad(pad)
+{
+	if (area.isNull())
+		area = img.rect();
+	width = area.width();
+	height = area.height();
+	stride = width + 2 * pad;
+	pixels.resize(static_cast<std::size_t>(stride) * (height + 2 * pad));
+	Tracer::countAllocation(pixels.size());
+	if (img.isNull())
+	{
+		std::fill(pixels.begin(), pixels.end(), static_cast<uchar>(qGray(border.color)));
+		return;
+	}
+
+	QImage src = img.format() == QImage::Format_Grayscale8 ? img : img.convertToFormat(QImage::Format_Grayscale8);
+	uchar constant = static_cast<uchar>(qGray(border.color));
+	int x0 = area.left() - pad;
+	int innerBegin = std::max(0, std::min(stride, -x0));
+	int innerEnd = std::max(innerBegin, std::min(stride, img.width() - x0));
+
+	for (int py = 0; py < height + 2 * pad; py++)
+	{
+		uchar* dst = pixels.data() + py * stride;
+		int sy = borderIndex(area.top() - pad + py, img.height(), border.mode);
+		if (sy < 0)
+		{
+			std::fill(dst, dst + stride, constant);
+			continue;
+		}
+		const uchar* line = src.constScanLine(sy);
+		if (innerEnd > innerBegin)
+			std::memcpy(dst + innerBegin, line + x0 + innerBegin, innerEnd - innerBegin);
+		for (int px = 0; px < innerBegin; px++)
+		{
+			int sx = borderIndex(x0 + px, img.width(), border.mode);
+			dst[px] = sx < 0 ? constant : line[sx];
+		}
+		for (int px = innerEnd; px < stride; px++)
+		{
+			int sx = borderIndex(x0 + px, img.width(), border.mode);
+			dst[px] = sx < 0 ? constant : line[sx];
+		}
+	}
+}
@@ -0,0 +1,181 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <cmath>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COLORSPACE_SSE2 1
+#endif
+
+// Colour conversions shared by every filter. Luminance and YCbCr use the
+// BT.601 weights in full range (as JPEG does); HSV has h in [0, 360) and
+// s, v in [0, 1]; Lab is CIE L*a*b* of sRGB under D65.
+
+const float LumaR = 0.299f, LumaG = 0.587f, LumaB = 0.114f;
+
+inline float luma(QRgb c)
+{
+	return LumaR * qRed(c) + LumaG * qGreen(c) + LumaB * qBlue(c);
+}
+
+// Which channels a neighbourhood filter works on
+enum class ChannelMode
+{
+	RGB,	// every channel separately
+	Luma	// Y only; Cb and Cr of the centre pixel pass through
+};
+
+inline void rgbToYCbCr(QRgb c, float& y, float& cb, float& cr)
+{
+	float r = float(qRed(c)), g = float(qGreen(c)), b = float(qBlue(c));
+	y = LumaR * r + LumaG * g + LumaB * b;
+	cb = 128.f - 0.168736f * r - 0.331264f * g + 0.5f * b;
+	cr = 128.f + 0.5f * r - 0.418688f * g - 0.081312f * b;
+}
+
+inline QRgb yCbCrToRgb(float y, float cb, float cr)
+{
+	auto channel = [](float v) { return static_cast<int>(std::max(0.f, std::min(255.f, v)) + 0.5f); };
+	return qRgb(channel(y + 1.402f * (cr - 128.f)),
+		channel(y - 0.344136f * (cb - 128.f) - 0.714136f * (cr - 128.f)),
+		channel(y + 1.772f * (cb - 128.f)));
+}
+
+// Row conversions; four pixels at a time with SSE2, the remainder scalar
+inline void rgbToLumaRow(const QRgb* src, float* y, int n)
+{
+	int x = 0;
+#ifdef COLORSPACE_SSE2
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128 kr = _mm_set1_ps(LumaR), kg = _mm_set1_ps(LumaG), kb = _mm_set1_ps(LumaB);
+	for (; x + 4 <= n; x += 4)
+	{
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+		__m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+		__m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+		__m128 b = _mm_cvtepi32_ps(_mm_and_si128(p, mask));
+		_mm_storeu_ps(y + x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, kr), _mm_mul_ps(g, kg)), _mm_mul_ps(b, kb)));
+	}
+#endif
+	for (; x < n; x++)
+		y[x] = luma(src[x]);
+}
+
+inline void rgbToYCbCrRow(const QRgb* src, float* y, float* cb, float* cr, int n)
+{
+	int x = 0;
+#ifdef COLORSPACE_SSE2
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128 half = _mm_set1_ps(128.f);
+	for (; x + 4 <= n; x += 4)
+	{
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+		__m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+		__m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+		__m128 b = _mm_cvtepi32_ps(_mm_and_si128(p, mask));
+		_mm_storeu_ps(y + x, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(LumaR)),
+			_mm_mul_ps(g, _mm_set1_ps(LumaG))), _mm_mul_ps(b, _mm_set1_ps(LumaB))));
+		_mm_storeu_ps(cb + x, _mm_add_ps(half, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b, _mm_set1_ps(0.5f)),
+			_mm_mul_ps(r, _mm_set1_ps(0.168736f))), _mm_mul_ps(g, _mm_set1_ps(-0.331264f)))));
+		_mm_storeu_ps(cr + x, _mm_add_ps(half, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(r, _mm_set1_ps(0.5f)),
+			_mm_mul_ps(g, _mm_set1_ps(0.418688f))), _mm_mul_ps(b, _mm_set1_ps(-0.081312f)))));
+	}
+#endif
+	for (; x < n; x++)
+		rgbToYCbCr(src[x], y[x], cb[x], cr[x]);
+}
+
+inline void yCbCrToRgbRow(const float* y, const float* cb, const float* cr, QRgb* dst, int n)
+{
+	int x = 0;
+#ifdef COLORSPACE_SSE2
+	const __m128 half = _mm_set1_ps(128.f), zero = _mm_setzero_ps(), top = _mm_set1_ps(255.f), round = _mm_set1_ps(0.5f);
+	const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000u));
+	auto channel = [&](__m128 v) { return _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(v, zero), top), round)); };
+	for (; x + 4 <= n; x += 4)
+	{
+		__m128 yy = _mm_loadu_ps(y + x);
+		__m128 u = _mm_sub_ps(_mm_loadu_ps(cb + x), half);
+		__m128 v = _mm_sub_ps(_mm_loadu_ps(cr + x), half);
+		__m128i r = channel(_mm_add_ps(yy, _mm_mul_ps(v, _mm_set1_ps(1.402f))));
+		__m128i g = channel(_mm_sub_ps(_mm_sub_ps(yy, _mm_mul_ps(u, _mm_set1_ps(0.344136f))), _mm_mul_ps(v, _mm_set1_ps(0.714136f))));
+		__m128i b = channel(_mm_add_ps(yy, _mm_mul_ps(u, _mm_set1_ps(1.772f))));
+		__m128i p = _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(r, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), b));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), p);
+	}
+#endif
+	for (; x < n; x++)
+		dst[x] = yCbCrToRgb(y[x], cb[x], cr[x]);
+}
+
+inline void rgbToHsv(QRgb c, float& h, float& s, float& v)
+{
+	float r = qRed(c) / 255.f, g = qGreen(c) / 255.f, b = qBlue(c) / 255.f;
+	float high = std::max(r, std::max(g, b)), low = std::min(r, std::min(g, b));
+	float delta = high - low;
+	v = high;
+	s = high > 0 ? delta / high : 0.f;
+	if (delta <= 0)
+		h = 0;
+	else if (high == r)
+		h = 60.f * std::fmod((g - b) / delta + 6.f, 6.f);
+	else if (high == g)
+		h = 60.f * ((b - r) / delta + 2.f);
+	else
+		h = 60.f * ((r - g) / delta + 4.f);
+}
+
+inline QRgb hsvToRgb(float h, float s, float v)
+{
+	float c = v * s;
+	float hh = std::fmod(std::fmod(h, 360.f) + 360.f, 360.f) / 60.f;
+	float x = c * (1 - std::fabs(std::fmod(hh, 2.f) - 1));
+	float r = 0, g = 0, b = 0;
+	switch (static_cast<int>(hh))
+	{
+	case 0: r = c; g = x; break;
+	case 1: r = x; g = c; break;
+	case 2: g = c; b = x; break;
+	case 3: g = x; b = c; break;
+	case 4: r = x; b = c; break;
+	default: r = c; b = x; break;
+	}
+	float m = v - c;
+	auto channel = [m](float value) { return static_cast<int>(std::max(0.f, std::min(1.f, value + m)) * 255.f + 0.5f); };
+	return qRgb(channel(r), channel(g), channel(b));
+}
+
+inline void rgbToLab(QRgb c, float& l, float& a, float& b)
+{
+	auto linear = [](int value)
+	{
+		float v = value / 255.f;
+		return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+	};
+	float r = linear(qRed(c)), g = linear(qGreen(c)), bl = linear(qBlue(c));
+	float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * bl) / 0.95047f;
+	float y = 0.2126729f * r + 0.7151522f * g + 0.0721750f * bl;
+	float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * bl) / 1.08883f;
+	auto f = [](float t) { return t > 216.f / 24389.f ? std::cbrt(t) : (24389.f / 27.f * t + 16.f) / 116.f; };
+	float fx = f(x), fy = f(y), fz = f(z);
+	l = 116.f * fy - 16.f;
+	a = 500.f * (fx - fy);
+	b = 200.f * (fy - fz);
+}
+
+inline QRgb labToRgb(float l, float a, float b)
+{
+	float fy = (l + 16.f) / 116.f, fx = fy + a / 500.f, fz = fy - b / 200.f;
+	auto inverse = [](float t) { return t * t * t > 216.f / 24389.f ? t * t * t : (116.f * t - 16.f) * 27.f / 24389.f; };
+	float x = inverse(fx) * 0.95047f, y = inverse(fy), z = inverse(fz) * 1.08883f;
+	float r = 3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+	float g = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+	float bl = 0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+	auto encode = [](float v)
+	{
+		v = std::max(0.f, std::min(1.f, v));
+		v = v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1 / 2.4f) - 0.055f;
+		return static_cast<int>(v * 255.f + 0.5f);
+	};
+	return qRgb(encode(r), encode(g), encode(bl));
+}
@@ -0,0 +1,229 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include "Pipeline.h"
+
+// What running a filter on an image of a given size is expected to cost.
+// peakBytes counts the buffers the run allocates on top of the source
+// image; buffers is how many of them are image-sized.
+struct CostEstimate
+{
+	double cpuSeconds = 0;
+	qint64 peakBytes = 0;
+	int buffers = 0;
+};
+
+// Per-filter cost model: nanoseconds per pixel for the engines that do not
+// depend on a kernel, per window sample for the median, and the
+// ConvolutionCostModel for matrix filters. The defaults are rough desktop
+// numbers; calibrate() measures them on the current machine.
+struct FilterCostModel
+{
+	double pointPixel = 2.0;		// ns per pixel of a PointFilter
+	double medianSample = 3.0;		// ns per pixel per window sample
+	double recursivePixel = 40.0;	// ns per pixel of the recursive Gaussian
+	double genericPixel = 150.0;	// ns per pixel through calcNewPixelColor
+
+	static FilterCostModel& instance()
+	{
+		static FilterCostModel model;
+		return model;
+	}
+	CostEstimate estimate(const Filter& filter, const QSize& size, QImage::Format format = QImage::Format_RGB32) const;
+	void calibrate();
+};
+
+inline CostEstimate FilterCostModel::estimate(const Filter& filter, const QSize& size, QImage::Format format) const
+{
+	CostEstimate result;
+	double pixels = double(size.width()) * size.height();
+	// Colour filters widen grey input, as Filter::process does
+	bool gray = format == QImage::Format_Grayscale8 && filter.supportsGray();
+	qint64 bpp = gray ? 1 : 4;
+	qint64 image = qint64(size.width()) * size.height() * bpp;
+
+	if (const Pipeline* pipeline = dynamic_cast<const Pipeline*>(&filter))
+	{
+		// Two intermediates used in turn, plus whatever the busiest stage needs besides its output
+		qint64 working = 0;
+		for (std::size_t i = 0; i < pipeline->size(); i++)
+		{
+			CostEstimate stage = estimate(pipeline->stage(i), size, format);
+			result.cpuSeconds += stage.cpuSeconds;
+			working = std::max(working, stage.peakBytes - image);
+			result.buffers = std::max(result.buffers, stage.buffers - 1);
+			if (pipeline->stage(i).producesGray())
+				format = QImage::Format_Grayscale8;
+		}
+		result.peakBytes = 2 * image + working;
+		result.buffers += 2;
+		return result;
+	}
+
+	result.peakBytes = image;
+	result.buffers = 1;
+	const MotionBlurFilter* motion = dynamic_cast<const MotionBlurFilter*>(&filter);
+	if (dynamic_cast<const PointFilter*>(&filter))
+		result.cpuSeconds = pixels * pointPixel * 1e-9;
+	else if (motion && motion->isDirectional())
+	{
+		// Running sums over three float planes, like the recursive Gaussian
+		result.cpuSeconds = pixels * recursivePixel * 1e-9;
+		result.peakBytes += qint64(pixels) * 3 * qint64(sizeof(float)) * 2;
+		result.buffers += 2;
+	}
+	else if (const MatrixFilter* matrix = dynamic_cast<const MatrixFilter*>(&filter))
+	{
+		const Kernel& kernel = matrix->getKernel();
+		int size1 = static_cast<int>(kernel.getSize()), radius = static_cast<int>(kernel.getRadius());
+		int taps = kernel.isSparse() ? static_cast<int>(kernel.getTaps().size()) : 0;
+		const ConvolutionCostModel& convolution = ConvolutionCostModel::instance();
+		double spatial = convolution.spatialCost(size1, size.width(), size.height(), taps);
+		double fft = convolution.fftCost(size1, size.width(), size.height());
+		// The same choice as MatrixFilter::useFFT, which luma mode makes too
+		bool useFFT = matrix->isLinear() && !gray && matrix->getBackend() != ConvolutionBackend::Spatial
+			&& (matrix->getBackend() == ConvolutionBackend::FFT ? fft < HUGE_VAL : fft < spatial);
+		bool luma = matrix->getChannels() == ChannelMode::Luma && !gray;
+		qint64 padded = qint64(size.width() + 2 * radius) * (size.height() + 2 * radius);
+		qint64 n = useFFT ? ConvolutionCostModel::blockSize(size1, size.width(), size.height()) : 0;
+		// The padded copy of the source; FFT adds its n x n complex blocks
+		result.peakBytes += padded * bpp;
+		result.buffers++;
+		if (luma)
+		{
+			// One channel instead of three; an FFT block pair shares one transform
+			// instead of two per block. The colour conversions cost about a point filter
+			result.cpuSeconds = ((useFFT ? fft / 4 : spatial / 3) + pixels * pointPixel) * 1e-9;
+			result.peakBytes += padded * qint64(sizeof(float));
+			result.buffers++;
+			if (useFFT)
+			{
+				result.peakBytes += qint64(pixels) * qint64(sizeof(float)) + 2 * n * n * qint64(sizeof(Complex));
+				result.buffers++;
+			}
+		}
+		else
+		{
+			// Kernel spectrum, red and green, blue
+			result.cpuSeconds = (useFFT ? fft : spatial) * 1e-9;
+			if (useFFT)
+				result.peakBytes += 3 * n * n * qint64(sizeof(Complex));
+		}
+	}
+	else if (const MedianFilter* median = dynamic_cast<const MedianFilter*>(&filter))
+	{
+		int side = 2 * median->getRadius() + 1;
+		result.cpuSeconds = pixels * side * side * medianSample * 1e-9;
+		result.peakBytes += qint64(size.width() + side - 1) * (size.height() + side - 1) * bpp;
+		result.buffers++;
+	}
+	else if (dynamic_cast<const RecursiveGaussianFilter*>(&filter))
+	{
+		result.cpuSeconds = pixels * recursivePixel * 1e-9;
+		// A float plane per channel and the copy of the source
+		result.peakBytes += qint64(pixels) * (gray ? 1 : 3) * qint64(sizeof(float)) + image;
+		result.buffers += 2;
+	}
+	else
+		result.cpuSeconds = pixels * genericPixel * 1e-9;
+	return result;
+}
+
+inline void FilterCostModel::calibrate()
+{
+	typedef std::chrono::steady_clock Clock;
+	const int side = 256;
+	const double pixels = double(side) * side;
+	QImage img(side, side, QImage::Format_RGB32);
+	for (int y = 0; y < side; y++)
+		for (int x = 0; x < side; x++)
+			img.setPixel(x, y, qRgb(x, y, x ^ y));
+	auto time = [&img](const Filter& filter)
+	{
+		filter.process(img);
+		auto start = Clock::now();
+		filter.process(img);
+		return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	};
+	ConvolutionCostModel::instance().calibrate();
+	pointPixel = time(InvertFilter()) / pixels;
+	medianSample = time(MedianFilter(2)) / (pixels * 25);
+	recursivePixel = time(RecursiveGaussianFilter(4.f)) / pixels;
+	genericPixel = time(WavesFilter()) / pixels;
+}
+
+inline CostEstimate estimateCost(const Filter& filter, const QSize& size, QImage::Format format = QImage::Format_RGB32)
+{
+	return FilterCostModel::instance().estimate(filter, size, format);
+}
+
+// Limits a job must stay within; 0 leaves a limit off. With downgrade set,
+// a job over the CPU budget is retried with its filter scaled down by
+// halves, down to an eighth, instead of being turned away. Memory is
+// never downgraded: smaller kernels do not shrink the images.
+struct CostBudget
+{
+	double cpuSeconds = 0;
+	qint64 peakBytes = 0;
+	bool downgrade = false;
+
+	bool limited() const { return cpuSeconds > 0 || peakBytes > 0; }
+	bool fits(const CostEstimate& cost) const
+	{
+		return (cpuSeconds <= 0 || cost.cpuSeconds <= cpuSeconds) && (peakBytes <= 0 || cost.peakBytes <= peakBytes);
+	}
+};
+
+enum class Admission
+{
+	Accepted,
+	Downgraded,	// filter replaced by a cheaper, scaled-down one
+	Rejected
+};
+
+struct AdmissionDecision
+{
+	Admission verdict = Admission::Accepted;
+	std::shared_ptr<const Filter> filter;	// what to run; null when rejected
+	CostEstimate estimate;					// of that filter, or of the original when rejected
+	std::string reason;
+};
+
+inline AdmissionDecision admitJob(const std::shared_ptr<const Filter>& filter, const QSize& size, QImage::Format format, const CostBudget& budget)
+{
+	AdmissionDecision decision;
+	decision.estimate = estimateCost(*filter, size, format);
+	decision.filter = filter;
+	if (budget.fits(decision.estimate))
+		return decision;
+	if (budget.peakBytes > 0 && decision.estimate.peakBytes > budget.peakBytes)
+	{
+		decision.verdict = Admission::Rejected;
+		decision.filter = nullptr;
+		decision.reason = "needs " + std::to_string(decision.estimate.peakBytes) + " bytes, budget " + std::to_string(budget.peakBytes);
+		return decision;
+	}
+	if (budget.downgrade)
+		for (float factor = 0.5f; factor >= 0.125f; factor /= 2)
+		{
+			auto scaled = filter->scaled(factor);
+			if (!scaled)
+				break;
+			CostEstimate cost = estimateCost(*scaled, size, format);
+			if (budget.fits(cost))
+			{
+				decision.verdict = Admission::Downgraded;
+				decision.filter = scaled;
+				decision.estimate = cost;
+				decision.reason = "scaled by " + std::to_string(factor) + " to fit the CPU budget";
+				return decision;
+			}
+		}
+	decision.verdict = Admission::Rejected;
+	decision.filter = nullptr;
+	decision.reason = "needs " + std::to_string(decision.estimate.cpuSeconds) + " CPU-seconds, budget " + std::to_string(budget.cpuSeconds);
+	return decision;
+}
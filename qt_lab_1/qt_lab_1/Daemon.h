@@ -0,0 +1,663 @@
+﻿#pragma once
+#ifdef __linux__
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "FilterChain.h"
+#include "Tuner.h"
+
+// Filter server for callers that send many small jobs: it runs in a single
+// long-lived process and takes jobs over a Unix domain socket. Pixels never
+// travel through the socket. The client puts them into a memfd, the daemon
+// maps it, filters straight into a second memfd and passes that one back.
+// Both descriptors cross the socket as SCM_RIGHTS ancillary data.
+//
+// The socket is SOCK_SEQPACKET, so every DaemonRequest / DaemonReply is one
+// message. A connection carries any number of jobs, one after another.
+
+const std::uint32_t DaemonMagic = 0x51544c44;	// "DLTQ"
+
+enum class DaemonStatus : std::uint32_t
+{
+	Ok,
+	BadRequest,	// malformed message, missing descriptor or unsupported format
+	BadChain,	// parseFilterChain refused the chain
+	Failed
+};
+
+struct DaemonRequest
+{
+	std::uint32_t magic;
+	std::uint32_t width, height, stride;
+	std::uint32_t format;		// RGB32, ARGB32 or Grayscale8
+	char chain[236];		// see parseFilterChain, zero-terminated
+};
+
+struct DaemonReply
+{
+	std::uint32_t magic;
+	DaemonStatus status;
+	std::uint32_t width, height, stride;
+	std::uint32_t format;
+	char error[232];
+};
+static_assert(sizeof(DaemonRequest) == 256 && sizeof(DaemonReply) == 256, "daemon messages must stay 256 bytes");
+
+// Image in an anonymous shared-memory file; the descriptor can be handed
+// to another process, which maps the same pages. create() seals the size
+// of the file, so a receiver can map it without the sender truncating it
+// underneath (which would raise SIGBUS on the next access).
+class SharedImage
+{
+	int descriptor = -1;
+	uchar* map = nullptr;
+	std::size_t length = 0;
+	QImage view;
+public:
+	SharedImage() = default;
+	SharedImage(const SharedImage&) = delete;
+	SharedImage& operator=(const SharedImage&) = delete;
+	SharedImage(SharedImage&& other) noexcept { *this = std::move(other); }
+	SharedImage& operator=(SharedImage&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			std::swap(descriptor, other.descriptor);
+			std::swap(map, other.map);
+			std::swap(length, other.length);
+			std::swap(view, other.view);
+		}
+		return *this;
+	}
+	~SharedImage() { release(); }
+
+	// New zero-filled image with scanlines aligned like QImage
+	bool create(const QSize& size, QImage::Format format);
+	// Maps an image received from another process and takes over fd
+	bool adopt(int fd, const QSize& size, int stride, QImage::Format format, bool writable);
+	// Read-only adopt() for a sender that is not trusted: fd is mapped only
+	// when its size is sealed, otherwise the pixels are read into a private
+	// copy and fd is closed
+	bool receive(int fd, const QSize& size, int stride, QImage::Format format);
+	void release();
+
+	bool isNull() const { return view.isNull(); }
+	int fd() const { return descriptor; }
+	// Views into the shared pages; valid until release()
+	QImage& image() { return view; }
+	const QImage& image() const { return view; }
+};
+
+inline bool SharedImage::create(const QSize& size, QImage::Format format)
+{
+	release();
+	int bpp = format == QImage::Format_Grayscale8 ? 1 : 4;
+	int stride = (size.width() * bpp + 3) & ~3;
+	std::size_t bytes = std::max<std::size_t>(1, static_cast<std::size_t>(stride) * size.height());
+	int fd = memfd_create("qt_lab_1", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+	{
+		// Kernels before 3.17: an unlinked POSIX shared-memory object does the same
+		std::string name = "/qt_lab_1." + std::to_string(getpid()) + "." + std::to_string(reinterpret_cast<std::uintptr_t>(this));
+		fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd >= 0)
+			shm_unlink(name.c_str());
+	}
+	if (fd < 0 || ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+	{
+		if (fd >= 0)
+			::close(fd);
+		return false;
+	}
+	// Fails on the shm_open fallback; receivers copy from such files instead
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+	return adopt(fd, size, stride, format, true);
+}
+
+inline bool SharedImage::adopt(int fd, const QSize& size, int stride, QImage::Format format, bool writable)
+{
+	release();
+	descriptor = fd;
+	struct stat info;
+	std::size_t bytes = static_cast<std::size_t>(stride) * size.height();
+	if (fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < bytes || bytes == 0)
+	{
+		release();
+		return false;
+	}
+	void* address = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED)
+	{
+		release();
+		return false;
+	}
+	map = static_cast<uchar*>(address);
+	length = bytes;
+	view = writable ? QImage(map, size.width(), size.height(), stride, format)
+		: QImage(static_cast<const uchar*>(map), size.width(), size.height(), stride, format);
+	return true;
+}
+
+inline bool SharedImage::receive(int fd, const QSize& size, int stride, QImage::Format format)
+{
+	const int required = F_SEAL_SHRINK | F_SEAL_GROW;
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals >= 0 && (seals & required) == required)
+		return adopt(fd, size, stride, format, false);
+	release();
+	QImage copy(size, format);
+	std::size_t rowBytes = static_cast<std::size_t>(size.width()) * (format == QImage::Format_Grayscale8 ? 1 : 4);
+	bool complete = !copy.isNull();
+	for (int y = 0; complete && y < size.height(); y++)
+		complete = pread(fd, copy.scanLine(y), rowBytes, static_cast<off_t>(y) * stride) == static_cast<ssize_t>(rowBytes);
+	::close(fd);
+	if (complete)
+		view = copy;
+	return complete;
+}
+
+inline void SharedImage::release()
+{
+	view = QImage();
+	if (map)
+		munmap(map, length);
+	if (descriptor >= 0)
+		::close(descriptor);
+	map = nullptr;
+	length = 0;
+	descriptor = -1;
+}
+
+// One message plus at most one descriptor in either direction
+inline bool sendMessage(int socket, const void* data, std::size_t size, int fd = -1)
+{
+	iovec io = { const_cast<void*>(data), size };
+	msghdr message = {};
+	message.msg_iov = &io;
+	message.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+	if (fd >= 0)
+	{
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		cmsghdr* header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+	}
+	ssize_t sent;
+	do
+		sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+	while (sent < 0 && errno == EINTR);
+	return sent == static_cast<ssize_t>(size);
+}
+
+// Returns the message length (0 when the peer closed, -1 on error); fd is
+// -1 unless a descriptor came along
+inline ssize_t receiveMessage(int socket, void* data, std::size_t size, int& fd)
+{
+	fd = -1;
+	iovec io = { data, size };
+	msghdr message = {};
+	message.msg_iov = &io;
+	message.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	ssize_t received;
+	do
+		received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+	while (received < 0 && errno == EINTR);
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); received > 0 && header; header = CMSG_NXTHDR(&message, header))
+		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+			std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+	return received;
+}
+
+inline bool supportedDaemonFormat(std::uint32_t format)
+{
+	return format == QImage::Format_RGB32 || format == QImage::Format_ARGB32 || format == QImage::Format_Grayscale8;
+}
+
+// Rows must hold width pixels, 32-bit rows must stay aligned to whole
+// pixels, and the image must fit in a QImage
+inline bool validDaemonLayout(std::uint32_t width, std::uint32_t height, std::uint32_t stride, std::uint32_t format)
+{
+	if (!supportedDaemonFormat(format) || width == 0 || height == 0)
+		return false;
+	std::uint64_t bpp = format == QImage::Format_Grayscale8 ? 1 : 4;
+	if (stride < width * bpp || stride % bpp != 0)
+		return false;
+	return std::uint64_t(stride) * height <= static_cast<std::uint64_t>(std::numeric_limits<int>::max());
+}
+
+// Serves one detached thread per connection. The last chainCapacity parsed
+// chains are kept by their text, so a repeated chain costs a map lookup;
+// they are configured by the tuning profile once, when first parsed.
+class FilterDaemon
+{
+	typedef std::pair<std::string, std::shared_ptr<const Filter>> CachedChain;
+	std::string path;
+	int listener = -1;
+	std::atomic<bool> stopping{ false };
+	std::mutex mutex;
+	std::list<CachedChain> recent;	// most recently used first
+	std::map<std::string, std::list<CachedChain>::iterator> chains;
+	std::size_t chainCapacity;
+	std::condition_variable idle;
+	int active = 0;	// connection threads still running
+	std::atomic<std::uint64_t> served{ 0 };
+
+	std::shared_ptr<const Filter> chain(const std::string& text, std::string& error);
+	void serve(int socket);
+	// Takes over fd
+	DaemonStatus handle(const DaemonRequest& request, int fd, SharedImage& output, std::string& error);
+public:
+	explicit FilterDaemon(const std::string& path, std::size_t chainCapacity = 256) : path(path), chainCapacity(chainCapacity) {}
+	~FilterDaemon() { stop(); }
+	FilterDaemon(const FilterDaemon&) = delete;
+	FilterDaemon& operator=(const FilterDaemon&) = delete;
+
+	// Binds the socket, replacing a stale one left by a previous run
+	bool listen();
+	// Accepts connections until stop()
+	void run();
+	void stop();
+	std::uint64_t jobsServed() const { return served; }
+};
+
+inline bool FilterDaemon::listen()
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		return false;
+	std::strcpy(address.sun_path, path.c_str());
+	listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		return false;
+	unlink(path.c_str());
+	if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener, 64) != 0)
+	{
+		std::cerr << "FilterDaemon: cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+		::close(listener);
+		listener = -1;
+		return false;
+	}
+	return true;
+}
+
+inline void FilterDaemon::run()
+{
+	while (!stopping)
+	{
+		int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			active++;
+		}
+		std::thread(&FilterDaemon::serve, this, client).detach();
+	}
+}
+
+inline void FilterDaemon::stop()
+{
+	if (stopping.exchange(true))
+		return;
+	if (listener >= 0)
+	{
+		shutdown(listener, SHUT_RDWR);
+		::close(listener);
+		unlink(path.c_str());
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this] { return active == 0; });
+}
+
+inline std::shared_ptr<const Filter> FilterDaemon::chain(const std::string& text, std::string& error)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = chains.find(text);
+		if (it != chains.end())
+		{
+			recent.splice(recent.begin(), recent, it->second);
+			return it->second->second;
+		}
+	}
+	auto filter = tunedFilter(parseFilterChain(text, &error));
+	if (!filter)
+		return filter;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (chains.count(text))
+		return filter;
+	recent.emplace_front(text, filter);
+	chains[text] = recent.begin();
+	if (recent.size() > chainCapacity)
+	{
+		chains.erase(recent.back().first);
+		recent.pop_back();
+	}
+	return filter;
+}
+
+inline void FilterDaemon::serve(int socket)
+{
+	// Lets stop() return without waiting for idle clients forever
+	timeval timeout = { 1, 0 };
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while (!stopping)
+	{
+		DaemonRequest request;
+		int fd;
+		ssize_t received = receiveMessage(socket, &request, sizeof(request), fd);
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			continue;
+		if (received <= 0)
+			break;
+
+		DaemonReply reply = {};
+		reply.magic = DaemonMagic;
+		SharedImage output;
+		std::string error;
+		if (received != sizeof(request) || request.magic != DaemonMagic)
+		{
+			if (fd >= 0)
+				::close(fd);
+			reply.status = DaemonStatus::BadRequest;
+			error = "malformed request";
+		}
+		else
+		{
+			request.chain[sizeof(request.chain) - 1] = '\0';
+			try
+			{
+				reply.status = handle(request, fd, output, error);
+			}
+			catch (const std::exception& e)
+			{
+				reply.status = DaemonStatus::Failed;
+				error = e.what();
+			}
+		}
+		if (reply.status == DaemonStatus::Ok)
+		{
+			reply.width = output.image().width();
+			reply.height = output.image().height();
+			reply.stride = output.image().bytesPerLine();
+			reply.format = output.image().format();
+		}
+		std::strncpy(reply.error, error.c_str(), sizeof(reply.error) - 1);
+		if (!sendMessage(socket, &reply, sizeof(reply), reply.status == DaemonStatus::Ok ? output.fd() : -1))
+			break;
+		served++;
+	}
+	::close(socket);
+	std::lock_guard<std::mutex> lock(mutex);
+	if (--active == 0)
+		idle.notify_all();
+}
+
+inline DaemonStatus FilterDaemon::handle(const DaemonRequest& request, int fd, SharedImage& output, std::string& error)
+{
+	TraceScope scope("daemon", "job");
+	SharedImage input;
+	QImage::Format format = static_cast<QImage::Format>(request.format);
+	bool valid = validDaemonLayout(request.width, request.height, request.stride, request.format);
+	if (!valid && fd >= 0)
+		::close(fd);
+	if (!valid || fd < 0 || !input.receive(fd, QSize(request.width, request.height), request.stride, format))
+	{
+		error = "no usable image in the request";
+		return DaemonStatus::BadRequest;
+	}
+	auto filter = chain(request.chain, error);
+	if (!filter)
+		return DaemonStatus::BadChain;
+
+	QImage src = input.image();
+	if (src.format() == QImage::Format_Grayscale8 && !filter->supportsGray())
+		src = src.convertToFormat(QImage::Format_RGB32);
+	QImage::Format target = filter->producesGray() ? QImage::Format_Grayscale8 : filter->outputFormat(src);
+	if (!output.create(src.size(), target))
+	{
+		error = std::string("cannot allocate shared memory: ") + std::strerror(errno);
+		return DaemonStatus::Failed;
+	}
+	scope.addPixels(qint64(src.width()) * src.height());
+	// Local filters write straight into the shared pages
+	if (filter->isLocal() && !filter->producesGray())
+	{
+		filter->processRegion(src, src.rect(), output.image());
+		return DaemonStatus::Ok;
+	}
+	QImage result = filter->process(src);
+	if (target == QImage::Format_Grayscale8)
+		result = narrowToGray(result);
+	else if (result.format() != target)
+		result = result.convertToFormat(target);
+	int rowBytes = std::min(result.bytesPerLine(), output.image().bytesPerLine());
+	for (int y = 0; y < result.height(); y++)
+		std::memcpy(output.image().scanLine(y), result.constScanLine(y), rowBytes);
+	return DaemonStatus::Ok;
+}
+
+// Client side of FilterDaemon; one connection, jobs in sequence
+class FilterClient
+{
+	int socket = -1;
+	std::string lastError;
+public:
+	FilterClient() = default;
+	FilterClient(const FilterClient&) = delete;
+	FilterClient& operator=(const FilterClient&) = delete;
+	~FilterClient() { disconnect(); }
+
+	bool connect(const std::string& path);
+	void disconnect()
+	{
+		if (socket >= 0)
+			::close(socket);
+		socket = -1;
+	}
+	bool isConnected() const { return socket >= 0; }
+	const std::string& error() const { return lastError; }
+
+	// Zero-copy form: input is sent by descriptor and output maps the
+	// daemon's result
+	bool process(const SharedImage& input, const std::string& chain, SharedImage& output);
+	// Convenience form that copies img into shared memory first; returns a null image on failure
+	QImage process(const QImage& img, const std::string& chain);
+};
+
+inline bool FilterClient::connect(const std::string& path)
+{
+	disconnect();
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		return false;
+	std::strcpy(address.sun_path, path.c_str());
+	socket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (socket < 0 || ::connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		lastError = std::strerror(errno);
+		disconnect();
+		return false;
+	}
+	return true;
+}
+
+inline bool FilterClient::process(const SharedImage& input, const std::string& chain, SharedImage& output)
+{
+	if (socket < 0 || input.isNull())
+	{
+		lastError = "not connected";
+		return false;
+	}
+	if (chain.size() >= sizeof(DaemonRequest::chain))
+	{
+		lastError = "chain too long";
+		return false;
+	}
+	DaemonRequest request = {};
+	request.magic = DaemonMagic;
+	request.width = input.image().width();
+	request.height = input.image().height();
+	request.stride = input.image().bytesPerLine();
+	request.format = input.image().format();
+	std::strcpy(request.chain, chain.c_str());
+	if (!sendMessage(socket, &request, sizeof(request), input.fd()))
+	{
+		lastError = std::strerror(errno);
+		return false;
+	}
+
+	DaemonReply reply;
+	int fd;
+	ssize_t received = receiveMessage(socket, &reply, sizeof(reply), fd);
+	if (received != sizeof(reply) || reply.magic != DaemonMagic)
+	{
+		if (fd >= 0)
+			::close(fd);
+		lastError = received < 0 ? std::strerror(errno) : "connection closed";
+		return false;
+	}
+	reply.error[sizeof(reply.error) - 1] = '\0';
+	if (reply.status != DaemonStatus::Ok)
+	{
+		if (fd >= 0)
+			::close(fd);
+		lastError = reply.error;
+		return false;
+	}
+	if (fd >= 0 && !validDaemonLayout(reply.width, reply.height, reply.stride, reply.format))
+	{
+		::close(fd);
+		fd = -1;
+	}
+	if (fd < 0 || !output.receive(fd, QSize(reply.width, reply.height), reply.stride, static_cast<QImage::Format>(reply.format)))
+	{
+		lastError = "cannot map the result";
+		return false;
+	}
+	return true;
+}
+
+inline QImage FilterClient::process(const QImage& img, const std::string& chain)
+{
+	QImage::Format format = supportedDaemonFormat(img.format()) ? img.format() : workingFormat(img);
+	QImage src = img.format() == format ? img : img.convertToFormat(format);
+	SharedImage input, output;
+	if (!input.create(src.size(), format))
+	{
+		lastError = "cannot allocate shared memory";
+		return QImage();
+	}
+	int rowBytes = src.width() * src.depth() / 8;
+	for (int y = 0; y < src.height(); y++)
+		std::memcpy(input.image().scanLine(y), src.constScanLine(y), rowBytes);
+	if (!process(input, chain, output))
+		return QImage();
+	return output.image().copy();
+}
+
+struct DaemonLoadReport
+{
+	std::uint64_t requests = 0, failures = 0;
+	double seconds = 0;
+	double meanMs = 0, p50Ms = 0, p99Ms = 0, maxMs = 0;
+	double requestsPerSecond() const { return seconds > 0 ? requests / seconds : 0; }
+};
+
+// Local load generator: clients connections, each sending requestsPerClient
+// jobs back to back over the same shared input
+inline DaemonLoadReport runDaemonLoad(const std::string& path, const std::string& chain, const QImage& img, int clients, int requestsPerClient)
+{
+	std::vector<std::vector<double>> latencies(clients);
+	std::atomic<std::uint64_t> failures{ 0 };
+	QImage::Format format = supportedDaemonFormat(img.format()) ? img.format() : workingFormat(img);
+	QImage src = img.format() == format ? img : img.convertToFormat(format);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int c = 0; c < clients; c++)
+		threads.emplace_back([&, c]
+		{
+			FilterClient client;
+			SharedImage input, output;
+			if (!client.connect(path) || !input.create(src.size(), format))
+			{
+				failures += requestsPerClient;
+				return;
+			}
+			for (int y = 0; y < src.height(); y++)
+				std::memcpy(input.image().scanLine(y), src.constScanLine(y), src.width() * src.depth() / 8);
+			latencies[c].reserve(requestsPerClient);
+			for (int i = 0; i < requestsPerClient; i++)
+			{
+				auto begin = std::chrono::steady_clock::now();
+				if (!client.process(input, chain, output))
+				{
+					failures++;
+					continue;
+				}
+				latencies[c].push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+			}
+		});
+	for (std::thread& thread : threads)
+		thread.join();
+
+	DaemonLoadReport report;
+	report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::vector<double> all;
+	for (const auto& list : latencies)
+		all.insert(all.end(), list.begin(), list.end());
+	report.requests = all.size();
+	report.failures = failures;
+	if (all.empty())
+		return report;
+	std::sort(all.begin(), all.end());
+	for (double value : all)
+		report.meanMs += value;
+	report.meanMs /= all.size();
+	report.p50Ms = all[all.size() / 2];
+	report.p99Ms = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+	report.maxMs = all.back();
+	return report;
+}
+
+inline void printDaemonLoadReport(const DaemonLoadReport& report, std::ostream& out = std::cout)
+{
+	out << report.requests << " requests (" << report.failures << " failed) in " << report.seconds << " s: "
+		<< report.requestsPerSecond() << " req/s, latency mean " << report.meanMs << " ms, p50 " << report.p50Ms
+		<< " ms, p99 " << report.p99Ms << " ms, max " << report.maxMs << " ms" << std::endl;
+}
+#endif
@@ -0,0 +1,263 @@
+﻿#pragma once
+#include <QImage>
+#include <complex>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include "Border.h"
+
+typedef std::complex<float> Complex;
+
+// In-place iterative radix-2 FFT; a.size() must be a power of two.
+inline void fft(Complex* a, int n, bool inverse)
+{
+	for (int i = 1, j = 0; i < n; i++)
+	{
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			std::swap(a[i], a[j]);
+	}
+	for (int len = 2; len <= n; len <<= 1)
+	{
+		double angle = 2 * 3.14159265358979323846 / len * (inverse ? 1 : -1);
+		Complex wlen(static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)));
+		for (int i = 0; i < n; i += len)
+		{
+			Complex w(1);
+			for (int j = 0; j < len / 2; j++)
+			{
+				Complex u = a[i + j];
+				Complex v = a[i + j + len / 2] * w;
+				a[i + j] = u + v;
+				a[i + j + len / 2] = u - v;
+				w *= wlen;
+			}
+		}
+	}
+	if (inverse)
+		for (int i = 0; i < n; i++)
+			a[i] /= static_cast<float>(n);
+}
+
+// n x n row-major block: rows, then columns
+inline void fft2d(std::vector<Complex>& a, int n, bool inverse)
+{
+	for (int y = 0; y < n; y++)
+		fft(a.data() + y * n, n, inverse);
+	std::vector<Complex> column(n);
+	for (int x = 0; x < n; x++)
+	{
+		for (int y = 0; y < n; y++)
+			column[y] = a[y * n + x];
+		fft(column.data(), n, inverse);
+		for (int y = 0; y < n; y++)
+			a[y * n + x] = column[y];
+	}
+}
+
+// Relative costs used to pick between spatial and FFT convolution.
+// The defaults are rough desktop numbers; calibrate() replaces them with
+// timings measured on the current machine.
+struct ConvolutionCostModel
+{
+	double spatialTap = 1.0;	// ns per pixel per kernel tap (3 channels)
+	double fftPoint = 6.0;		// ns per point per log2(point count) of a 2D transform
+
+	static ConvolutionCostModel& instance()
+	{
+		static ConvolutionCostModel model;
+		return model;
+	}
+	// Best block size for an FFT pass over an image; 0 if the kernel is too big for any block
+	static int blockSize(int kernelSize, int width, int height, double* cost = nullptr);
+	// taps: nonzero taps walked by the sparse loops, 0 for the full window
+	double spatialCost(int kernelSize, int width, int height, int taps = 0) const
+	{
+		return spatialTap * (taps ? taps : kernelSize * kernelSize) * double(width) * height;
+	}
+	double fftCost(int kernelSize, int width, int height) const
+	{
+		double cost = 0;
+		return blockSize(kernelSize, width, height, &cost) ? cost * fftPoint : HUGE_VAL;
+	}
+	bool preferFFT(int kernelSize, int width, int height, int taps = 0) const
+	{
+		return fftCost(kernelSize, width, height) < spatialCost(kernelSize, width, height, taps);
+	}
+	void calibrate();
+};
+
+inline int ConvolutionCostModel::blockSize(int kernelSize, int width, int height, double* cost)
+{
+	int best = 0;
+	double bestCost = HUGE_VAL;
+	for (int n = 32; n <= 1024; n <<= 1)
+	{
+		int tile = n - kernelSize + 1;
+		if (tile < kernelSize)
+			continue;
+		double tiles = double((width + tile - 1) / tile) * ((height + tile - 1) / tile);
+		// two forward and two inverse n x n transforms per block
+		double blockCost = tiles * 4.0 * n * n * std::log2(double(n) * n);
+		if (blockCost < bestCost)
+		{
+			bestCost = blockCost;
+			best = n;
+		}
+	}
+	if (cost)
+		*cost = bestCost;
+	return best;
+}
+
+// Correlates src with a (2r+1)^2 kernel the same way MatrixFilter does,
+// using overlap-save blocks: each n x n block of padded input yields an
+// (n - 2r)^2 tile of output. R and G share one complex transform (real and
+// imaginary parts), B gets its own.
+inline void fftCorrelate(const PaddedImage& src, const float* kernel, int radius, QImage& result, const QPoint& origin = QPoint())
+{
+	int size = 2 * radius + 1;
+	int width = src.getWidth(), height = src.getHeight();
+	int n = ConvolutionCostModel::blockSize(size, width, height);
+	int tile = n - size + 1;
+
+	// Kernel spectrum, mirrored so that the circular convolution becomes a correlation
+	std::vector<Complex> spectrum(n * n);
+	for (int i = -radius; i <= radius; i++)
+		for (int j = -radius; j <= radius; j++)
+			spectrum[((n - i) % n) * n + (n - j) % n] = kernel[(i + radius) * size + j + radius];
+	fft2d(spectrum, n, false);
+
+	std::vector<Complex> rg(n * n), b(n * n);
+	Tracer::countAllocation(3 * spectrum.size() * sizeof(Complex));
+	for (int y0 = 0; y0 < height; y0 += tile)
+		for (int x0 = 0; x0 < width; x0 += tile)
+		{
+			TraceScope scope("tile", "fft block");
+			scope.addPixels(qint64(n) * n);
+			int tw = std::min(tile, width - x0), th = std::min(tile, height - y0);
+			std::fill(rg.begin(), rg.end(), Complex());
+			std::fill(b.begin(), b.end(), Complex());
+			for (int y = 0; y < th + 2 * radius; y++)
+			{
+				const QRgb* line = src.row(y0 - radius + y) + x0 - radius;
+				for (int x = 0; x < tw + 2 * radius; x++)
+				{
+					rg[y * n + x] = Complex(qRed(line[x]), qGreen(line[x]));
+					b[y * n + x] = Complex(qBlue(line[x]), 0);
+				}
+			}
+			fft2d(rg, n, false);
+			fft2d(b, n, false);
+			for (int i = 0; i < n * n; i++)
+			{
+				rg[i] *= spectrum[i];
+				b[i] *= spectrum[i];
+			}
+			fft2d(rg, n, true);
+			fft2d(b, n, true);
+			for (int y = 0; y < th; y++)
+			{
+				QRgb* dst = reinterpret_cast<QRgb*>(result.scanLine(origin.y() + y0 + y)) + origin.x() + x0;
+				const Complex* lineRG = rg.data() + (y + radius) * n + radius;
+				const Complex* lineB = b.data() + (y + radius) * n + radius;
+				for (int x = 0; x < tw; x++)
+				{
+					float red = std::max(0.f, std::min(255.f, lineRG[x].real()));
+					float green = std::max(0.f, std::min(255.f, lineRG[x].imag()));
+					float blue = std::max(0.f, std::min(255.f, lineB[x].real()));
+					dst[x] = qRgb(static_cast<int>(red + 0.5f), static_cast<int>(green + 0.5f), static_cast<int>(blue + 0.5f));
+				}
+			}
+		}
+}
+
+// Single-plane counterpart of fftCorrelate for the luma path: plane holds
+// (width + 2r) x (height + 2r) samples with the given stride, result gets
+// width x height. Two neighbouring blocks share one complex transform.
+inline void fftCorrelatePlane(const float* plane, int stride, int width, int height, const float* kernel, int radius, float* result, int resultStride)
+{
+	int size = 2 * radius + 1;
+	int n = ConvolutionCostModel::blockSize(size, width, height);
+	int tile = n - size + 1;
+
+	std::vector<Complex> spectrum(n * n);
+	for (int i = -radius; i <= radius; i++)
+		for (int j = -radius; j <= radius; j++)
+			spectrum[((n - i) % n) * n + (n - j) % n] = kernel[(i + radius) * size + j + radius];
+	fft2d(spectrum, n, false);
+
+	std::vector<Complex> block(n * n);
+	Tracer::countAllocation(2 * spectrum.size() * sizeof(Complex));
+	for (int y0 = 0; y0 < height; y0 += tile)
+		for (int x0 = 0; x0 < width; x0 += 2 * tile)
+		{
+			TraceScope scope("tile", "fft block");
+			scope.addPixels(qint64(n) * n);
+			int tw = std::min(tile, width - x0), th = std::min(tile, height - y0);
+			int x1 = x0 + tile, tw1 = std::max(0, std::min(tile, width - x1));
+			std::fill(block.begin(), block.end(), Complex());
+			for (int y = 0; y < th + 2 * radius; y++)
+			{
+				const float* line = plane + static_cast<std::size_t>(y0 + y) * stride;
+				for (int x = 0; x < tw + 2 * radius; x++)
+					block[y * n + x].real(line[x0 + x]);
+				if (tw1)
+					for (int x = 0; x < tw1 + 2 * radius; x++)
+						block[y * n + x].imag(line[x1 + x]);
+			}
+			fft2d(block, n, false);
+			for (int i = 0; i < n * n; i++)
+				block[i] *= spectrum[i];
+			fft2d(block, n, true);
+			for (int y = 0; y < th; y++)
+			{
+				float* dst = result + static_cast<std::size_t>(y0 + y) * resultStride;
+				const Complex* line = block.data() + (y + radius) * n + radius;
+				for (int x = 0; x < tw; x++)
+					dst[x0 + x] = line[x].real();
+				for (int x = 0; x < tw1; x++)
+					dst[x1 + x] = line[x].imag();
+			}
+		}
+}
+
+inline void ConvolutionCostModel::calibrate()
+{
+	typedef std::chrono::steady_clock Clock;
+	const int side = 256, radius = 4, size = 2 * radius + 1;
+	QImage img(side, side, QImage::Format_RGB32);
+	for (int y = 0; y < side; y++)
+		for (int x = 0; x < side; x++)
+			img.setPixel(x, y, qRgb(x, y, x ^ y));
+	std::vector<float> kernel(size * size, 1.f / (size * size));
+	PaddedImage src(img, radius);
+	QImage result(img.size(), QImage::Format_RGB32);
+
+	auto start = Clock::now();
+	volatile float sink = 0;
+	for (int y = 0; y < side; y++)
+		for (int x = 0; x < side; x++)
+		{
+			float sum = 0;
+			for (int i = -radius; i <= radius; i++)
+			{
+				const QRgb* line = src.row(y + i) + x - radius;
+				for (int j = 0; j < size; j++)
+					sum += (qRed(line[j]) + qGreen(line[j]) + qBlue(line[j])) * kernel[(i + radius) * size + j];
+			}
+			sink = sink + sum;
+		}
+	double spatialNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	spatialTap = spatialNs / (double(side) * side * size * size);
+
+	double work = 0;
+	blockSize(size, side, side, &work);
+	start = Clock::now();
+	fftCorrelate(src, kernel.data(), radius, result);
+	double fftNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	fftPoint = fftNs / work;
+}
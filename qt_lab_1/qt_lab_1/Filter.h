@@ -1,8 +1,21 @@
 ﻿#pragma once
 #include <QImage>
+#include <QMargins>
 #include <vector>
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <mutex>
+#include "Border.h"
+#include "ColorSpace.h"
+#include "FFT.h"
+#include "Hash.h"
+#include "MotionBlur.h"
+#include "RecursiveGaussian.h"
+#include "PerfCounters.h"
+#include "Trace.h"
 
 template <class T>
 T tclamp(T value, T max, T min)
@@ -14,55 +27,355 @@ T tclamp(T value, T max, T min)
 	return value;
 }
 
+// 32-bit format the fast paths write into: keeps RGB32/ARGB32 inputs as they are
+inline QImage::Format workingFormat(const QImage& img)
+{
+	if (img.format() == QImage::Format_RGB32)
+		return QImage::Format_RGB32;
+	return QImage::Format_ARGB32;
+}
+
+// Grey copy of an image whose channels are known to be equal
+inline QImage narrowToGray(const QImage& img)
+{
+	if (img.format() == QImage::Format_Grayscale8)
+		return img;
+	QImage result(img.size(), QImage::Format_Grayscale8);
+	Tracer::countAllocation(result.sizeInBytes());
+	QImage src = img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32 ? img : img.convertToFormat(QImage::Format_ARGB32);
+	for (int y = 0; y < img.height(); y++)
+	{
+		const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+		uchar* dst = result.scanLine(y);
+		for (int x = 0; x < img.width(); x++)
+			dst[x] = static_cast<uchar>(qGreen(line[x]));
+	}
+	return result;
+}
+
+// Formats whose rows can be cut into windows by pointer arithmetic
+inline bool isWindowable(const QImage& img)
+{
+	return img.depth() == 32 || img.format() == QImage::Format_Grayscale8 || img.format() == QImage::Format_RGB888;
+}
+
+// Read-only view of area of img over its scanlines; a copy of area for
+// formats a view cannot express
+inline QImage windowOf(const QImage& img, const QRect& area)
+{
+	if (area == img.rect())
+		return img;
+	if (!isWindowable(img))
+		return img.copy(area);
+	return QImage(img.constScanLine(area.top()) + area.left() * (img.depth() / 8), area.width(), area.height(), img.bytesPerLine(), img.format());
+}
+
+// Writable view of area of a windowable image; valid while img lives
+inline QImage writableWindow(QImage& img, const QRect& area)
+{
+	return QImage(img.scanLine(area.top()) + area.left() * (img.depth() / 8), area.width(), area.height(), img.bytesPerLine(), img.format());
+}
+
 class Filter
 {
 protected:
 	virtual QColor calcNewPixelColor(const QImage& img, int x, int y) const = 0;
+	// The actual work behind process()
+	virtual QImage processImage(const QImage& img) const;
 public:
 	virtual ~Filter() = default;
-	virtual QImage process(const QImage& img) const;
+	// Traced entry point; see Tracer
+	QImage process(const QImage& img) const;
+	// For an image the caller is done with: filters that can work in place
+	// write into its buffer instead of a copy
+	QImage process(QImage&& img) const;
+	// img = process(img), in place where possible
+	void apply(QImage& img) const { img = process(std::move(img)); }
+	// processRegion(img, rect, img) gives the same result as with a separate dst
+	virtual bool canProcessInPlace(const QImage&) const { return false; }
+	// Only the pixels inside roi, returned as an image of roi's size; the
+	// input is read, and buffers are allocated, no further than requiredRect(roi)
+	QImage process(const QImage& img, const QRect& roi) const;
+	// Computes only the pixels of rect, writing them at the same coordinates
+	// into dst (same size as img). Filters with fast paths expect dst in
+	// outputFormat(img).
+	virtual void processRegion(const QImage& img, const QRect& rect, QImage& dst) const;
+	// processRegion on a window of a larger image: img holds the part of an
+	// image of the given size that starts at origin, and must cover
+	// requiredRect(rect, size); dst has img's size. rect is in whole-image
+	// coordinates. Shifting rect into the window is exact for filters that
+	// only see their neighbourhood; those that depend on where a pixel lies
+	// in the image override this.
+	virtual void processWindow(const QImage& img, const QPoint& origin, const QSize&, const QRect& rect, QImage& dst) const
+	{
+		processRegion(img, rect.translated(-origin), dst);
+	}
+	// Grey in gives grey out, and processRegion handles Grayscale8 img and dst
+	virtual bool supportsGray() const { return false; }
+	// Output channels are always equal (desaturating filters)
+	virtual bool producesGray() const { return false; }
+	// Grayscale8 for grey input when supported, otherwise workingFormat(img)
+	QImage::Format outputFormat(const QImage& img) const
+	{
+		if (img.format() == QImage::Format_Grayscale8 && supportsGray())
+			return QImage::Format_Grayscale8;
+		return workingFormat(img);
+	}
+	// How far around an output pixel the input is read
+	virtual QMargins margins() const { return QMargins(); }
+	// Input area that rect of an image of the given size depends on
+	virtual QRect requiredRect(const QRect& rect, const QSize& size) const;
+	// False when the output depends on statistics of the whole image
+	virtual bool isLocal() const { return true; }
+	// Everything besides the class and the input that changes the output;
+	// see ResultCache
+	virtual void hashParams(ParamHash&) const {}
+	// False when the same input can give different outputs
+	virtual bool isDeterministic() const { return true; }
+	// The same filter for the image resampled by factor (0.5 per pyramid
+	// octave), spatial parameters scaled to match; nullptr when nothing
+	// depends on the scale or it is already at its smallest, and this
+	// filter can be used as it is
+	virtual std::shared_ptr<const Filter> scaled(float) const { return nullptr; }
 };
 
 QImage Filter::process(const QImage& img) const
+{
+	TraceScope scope("filter", typeid(*this));
+	PerfScope counters(typeid(*this));
+	// A grey image handed to a colour filter is widened, otherwise the colour would be lost
+	QImage result = img.format() == QImage::Format_Grayscale8 && !supportsGray()
+		? processImage(img.convertToFormat(QImage::Format_RGB32)) : processImage(img);
+	scope.addPixels(qint64(img.width()) * img.height());
+	counters.addPixels(qint64(img.width()) * img.height());
+	scope.addBytes(img.sizeInBytes() + result.sizeInBytes());
+	Tracer::countAllocation(result.sizeInBytes());
+	return result;
+}
+
+QImage Filter::process(QImage&& img) const
+{
+	if (!canProcessInPlace(img))
+		return process(static_cast<const QImage&>(img));
+	TraceScope scope("filter", typeid(*this));
+	PerfScope counters(typeid(*this));
+	// Detaches only if someone else still shares the pixels
+	processRegion(img, img.rect(), img);
+	scope.addPixels(qint64(img.width()) * img.height());
+	counters.addPixels(qint64(img.width()) * img.height());
+	scope.addBytes(img.sizeInBytes());
+	return std::move(img);
+}
+
+QImage Filter::process(const QImage& img, const QRect& roi) const
+{
+	QRect rect = roi.intersected(img.rect());
+	if (rect.isEmpty())
+		return QImage();
+	TraceScope scope("filter", typeid(*this));
+	PerfScope counters(typeid(*this));
+	// Work in a window of the area rect depends on, not in image-sized buffers
+	QRect area = requiredRect(rect, img.size());
+	QImage window(area.size(), outputFormat(img));
+	if (window.isNull())
+		return QImage();
+	Tracer::countAllocation(window.sizeInBytes());
+	processWindow(windowOf(img, area), area.topLeft(), img.size(), rect, window);
+	QImage result = window.copy(rect.translated(-area.topLeft()));
+	scope.addPixels(qint64(rect.width()) * rect.height());
+	counters.addPixels(qint64(rect.width()) * rect.height());
+	Tracer::countAllocation(result.sizeInBytes());
+	return result;
+}
+
+QRect Filter::requiredRect(const QRect& rect, const QSize& size) const
+{
+	QRect bounds(QPoint(0, 0), size);
+	if (!isLocal())
+		return bounds;
+	return rect.marginsAdded(margins()).intersected(bounds);
+}
+
+QImage Filter::processImage(const QImage& img) const
 {
 	QImage result(img);
-	for (int x = 0; x < img.width(); x++)
-		for (int y = 0; y < img.height(); y++)
+	processRegion(img, img.rect(), result);
+	return result;
+}
+
+void Filter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	for (int x = rect.left(); x <= rect.right(); x++)
+		for (int y = rect.top(); y <= rect.bottom(); y++)
 		{
 			QColor color = calcNewPixelColor(img, x, y);
-			result.setPixelColor(x, y, color);
+			dst.setPixelColor(x, y, color);
 		}
-	return result;
 }
+// Filters whose output pixel depends only on the input pixel at the same
+// place. They map whole scanlines, so a region, a strip or a batch of
+// images stacked in one buffer costs one virtual call per row.
+class PointFilter : public Filter
+{
+protected:
+	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	// 32-bit rows; src and dst may be the same
+	virtual void mapRow(const QRgb* src, QRgb* dst, int width) const = 0;
+public:
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	bool canProcessInPlace(const QImage& img) const override
+	{
+		return img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32
+			|| (img.format() == QImage::Format_Grayscale8 && supportsGray());
+	}
+};
+
+QColor PointFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+{
+	QRgb in = img.pixel(x, y), out;
+	mapRow(&in, &out, 1);
+	return QColor(out);
+}
+
+void PointFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	auto is32 = [](const QImage& image) { return image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32; };
+	if (img.format() == QImage::Format_Grayscale8 && dst.format() == QImage::Format_Grayscale8)
+	{
+		// Grey output is only asked for when the channels stay equal, so one table covers it
+		QRgb grey[256], mapped[256];
+		uchar table[256];
+		for (int i = 0; i < 256; i++)
+			grey[i] = qRgb(i, i, i);
+		mapRow(grey, mapped, 256);
+		for (int i = 0; i < 256; i++)
+			table[i] = static_cast<uchar>(qGreen(mapped[i]));
+		for (int y = rect.top(); y <= rect.bottom(); y++)
+		{
+			const uchar* src = img.constScanLine(y) + rect.left();
+			uchar* out = dst.scanLine(y) + rect.left();
+			for (int x = 0; x < rect.width(); x++)
+				out[x] = table[src[x]];
+		}
+		return;
+	}
+	if (!is32(img) || !is32(dst))
+	{
+		Filter::processRegion(img, rect, dst);
+		return;
+	}
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+		mapRow(reinterpret_cast<const QRgb*>(img.constScanLine(y)) + rect.left(), reinterpret_cast<QRgb*>(dst.scanLine(y)) + rect.left(), rect.width());
+}
+
+// Nonzero kernel entry at offset (dx, dy) from the centre
+struct KernelTap
+{
+	int dx, dy;
+	float weight;
+};
+
 class Kernel
 {
 protected:
 	std::unique_ptr<float[]> data;
 	std::size_t radius;
+	std::vector<KernelTap> taps;	// row-major, so sums keep the order of the dense loops
 	std::size_t getLen() const { return getSize() * getSize(); }
 public:
+	// Kernels with at most this share of nonzero taps are walked through the tap list
+	static constexpr float sparseDensity = 0.6f;
+
 	Kernel(std::size_t radius) : radius(radius)
 	{
 		data = std::make_unique<float[]>(getLen());
 	}
+	// Derived kernels fill data after this base is built, so the tap list is
+	// made by the copy every filter keeps; compact() again after editing taps
 	Kernel(const Kernel& other) : Kernel(other.radius)
 	{
 		std::copy(other.data.get(), other.data.get() + getLen(), data.get());
+		compact();
 	}
 	std::size_t getRadius() const { return radius; }
 	std::size_t getSize() const { return 2 * radius + 1; }
-	float operator [] (std::size_t id) const { return data[id]; }
+	const float& operator [] (std::size_t id) const { return data[id]; }
 	float& operator [] (std::size_t id) { return data[id]; }
+	void compact();
+	const std::vector<KernelTap>& getTaps() const { return taps; }
+	bool isSparse() const { return taps.size() <= sparseDensity * getLen(); }
+};
+
+void Kernel::compact()
+{
+	int r = static_cast<int>(radius), size = static_cast<int>(getSize());
+	taps.clear();
+	for (int i = 0; i < size; i++)
+		for (int j = 0; j < size; j++)
+			if (data[i * size + j])
+				taps.push_back({ j - r, i - r, data[i * size + j] });
+}
+
+enum class ConvolutionBackend
+{
+	Auto,		// pick by ConvolutionCostModel
+	Spatial,
+	FFT
 };
 
 class MatrixFilter :public Filter
 {
 protected:
 	Kernel mKernel;
+	BorderPolicy border;
+	ConvolutionBackend backend = ConvolutionBackend::Auto;
+	ChannelMode channels = ChannelMode::RGB;
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	// One output row from the padded source; no coordinate checks needed.
+	virtual void processRow(const PaddedImage& src, QRgb* dst, int y) const;
+	// Luma counterpart: lines[i][x + j] is the tap (i, j) of output pixel x
+	virtual void processLumaRow(const float* const* lines, float* dst, int width) const;
+	void processLumaRegion(const QImage& img, const QRect& rect, QImage& dst) const;
+	// Grayscale8 counterpart of processRow
+	virtual void processGrayRow(const PaddedPlane& src, uchar* dst, int y) const;
+	// Filter of the same kind with another kernel; scaled() relies on it
+	virtual std::shared_ptr<MatrixFilter> withKernel(const Kernel& kernel) const { return std::make_shared<MatrixFilter>(kernel); }
+	bool useFFT(const QSize& size) const;
+	QImage processImage(const QImage& img) const override;
 public:
 	MatrixFilter(const Kernel& kernel) : mKernel(kernel) {};
 	virtual ~MatrixFilter() = default;
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	bool supportsGray() const override { return true; }
+	QMargins margins() const override
+	{
+		int radius = static_cast<int>(mKernel.getRadius());
+		return QMargins(radius, radius, radius, radius);
+	}
+	// Morphology reuses the kernel as a mask and must never go through the FFT path
+	virtual bool isLinear() const { return true; }
+	const Kernel& getKernel() const { return mKernel; }
+	void setBorder(const BorderPolicy& policy) { border = policy; }
+	const BorderPolicy& getBorder() const { return border; }
+	void setBackend(ConvolutionBackend value) { backend = value; }
+	ConvolutionBackend getBackend() const { return backend; }
+	// Same filter on another backend; the auto-tuner applies its plans with it
+	std::shared_ptr<MatrixFilter> withBackend(ConvolutionBackend value) const
+	{
+		auto result = withKernel(mKernel);
+		result->setBorder(border);
+		result->setBackend(value);
+		result->setChannels(channels);
+		return result;
+	}
+	void setChannels(ChannelMode mode) { channels = mode; }
+	ChannelMode getChannels() const { return channels; }
+	QRect requiredRect(const QRect& rect, const QSize& size) const override
+	{
+		return borderArea(rect, margins(), size, border.mode);
+	}
+	void hashParams(ParamHash& hash) const override;
+	std::shared_ptr<const Filter> scaled(float factor) const override;
 };
 
 QColor MatrixFilter::calcNewPixelColor(const QImage& img, int x, int y) const
@@ -70,19 +383,230 @@ QColor MatrixFilter::calcNewPixelColor(const QImage& img, int x, int y) const
 	float returnR = 0;
 	float returnG = 0;
 	float returnB = 0;
+	for (const KernelTap& tap : mKernel.getTaps())
+	{
+		QColor color = borderPixel(img, x + tap.dx, y + tap.dy, border);
+		returnR += color.red() * tap.weight;
+		returnG += color.green() * tap.weight;
+		returnB += color.blue() * tap.weight;
+	}
+	return QColor(tclamp(returnR, 255.f, 0.f), tclamp(returnG, 255.f, 0.f), tclamp(returnB, 255.f, 0.f));
+};
+
+void MatrixFilter::processRow(const PaddedImage& src, QRgb* dst, int y) const
+{
 	int size = mKernel.getSize();
 	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < src.getWidth(); x++)
+		{
+			float returnR = 0;
+			float returnG = 0;
+			float returnB = 0;
+			for (const KernelTap& tap : mKernel.getTaps())
+			{
+				QRgb pixel = src.row(y + tap.dy)[x + tap.dx];
+				returnR += qRed(pixel) * tap.weight;
+				returnG += qGreen(pixel) * tap.weight;
+				returnB += qBlue(pixel) * tap.weight;
+			}
+			dst[x] = qRgb(tclamp(returnR, 255.f, 0.f), tclamp(returnG, 255.f, 0.f), tclamp(returnB, 255.f, 0.f));
+		}
+		return;
+	}
+	for (int x = 0; x < src.getWidth(); x++)
+	{
+		float returnR = 0;
+		float returnG = 0;
+		float returnB = 0;
+		for (int i = -radius; i <= radius; i++)
+		{
+			const QRgb* line = src.row(y + i) + x - radius;
+			const float* k = &mKernel[(i + radius) * size];
+			for (int j = 0; j < size; j++)
+			{
+				returnR += qRed(line[j]) * k[j];
+				returnG += qGreen(line[j]) * k[j];
+				returnB += qBlue(line[j]) * k[j];
+			}
+		}
+		dst[x] = qRgb(tclamp(returnR, 255.f, 0.f), tclamp(returnG, 255.f, 0.f), tclamp(returnB, 255.f, 0.f));
+	}
+}
+
+void MatrixFilter::hashParams(ParamHash& hash) const
+{
+	hash.add(mKernel.getRadius()).add(&mKernel[0], mKernel.getSize() * mKernel.getSize() * sizeof(float));
+	hash.add(border.mode).add(border.color).add(backend).add(channels);
+}
+
+void MatrixFilter::processGrayRow(const PaddedPlane& src, uchar* dst, int y) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < src.getWidth(); x++)
+		{
+			float sum = 0;
+			for (const KernelTap& tap : mKernel.getTaps())
+				sum += src.row(y + tap.dy)[x + tap.dx] * tap.weight;
+			dst[x] = static_cast<uchar>(tclamp(sum, 255.f, 0.f));
+		}
+		return;
+	}
+	for (int x = 0; x < src.getWidth(); x++)
+	{
+		float sum = 0;
+		for (int i = -radius; i <= radius; i++)
+		{
+			const uchar* line = src.row(y + i) + x - radius;
+			const float* k = &mKernel[(i + radius) * size];
+			for (int j = 0; j < size; j++)
+				sum += line[j] * k[j];
+		}
+		dst[x] = static_cast<uchar>(tclamp(sum, 255.f, 0.f));
+	}
+}
+
+void MatrixFilter::processLumaRow(const float* const* lines, float* dst, int width) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float sum = 0;
+			for (const KernelTap& tap : mKernel.getTaps())
+				sum += lines[tap.dy + radius][x + tap.dx + radius] * tap.weight;
+			dst[x] = sum;
+		}
+		return;
+	}
+	for (int x = 0; x < width; x++)
+	{
+		float sum = 0;
+		for (int i = 0; i < size; i++)
+		{
+			const float* k = &mKernel[i * size];
+			const float* line = lines[i] + x;
+			for (int j = 0; j < size; j++)
+				sum += line[j] * k[j];
+		}
+		dst[x] = sum;
+	}
+}
+
+// Luma plane of the padded area, one kernel pass (spatial or FFT), then the
+// centre pixel's chroma back on
+void MatrixFilter::processLumaRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	int radius = mKernel.getRadius();
+	int size = mKernel.getSize();
+	PaddedImage src(img, radius, border, rect);
+	int stride = rect.width() + 2 * radius;
+	std::vector<float> plane(static_cast<std::size_t>(stride) * (rect.height() + 2 * radius));
+	Tracer::countAllocation(plane.size() * sizeof(float));
+	for (int y = -radius; y < rect.height() + radius; y++)
+		rgbToLumaRow(src.row(y) - radius, plane.data() + static_cast<std::size_t>(y + radius) * stride, stride);
+
+	std::vector<float> filtered;
+	if (useFFT(rect.size()))
+	{
+		filtered.resize(static_cast<std::size_t>(rect.width()) * rect.height());
+		Tracer::countAllocation(filtered.size() * sizeof(float));
+		fftCorrelatePlane(plane.data(), stride, rect.width(), rect.height(), &mKernel[0], radius, filtered.data(), rect.width());
+	}
+
+	std::vector<float> luma(rect.width()), cb(rect.width()), cr(rect.width());
+	std::vector<const float*> lines(size);
+	for (int y = 0; y < rect.height(); y++)
+	{
+		rgbToYCbCrRow(src.row(y), luma.data(), cb.data(), cr.data(), rect.width());
+		if (filtered.empty())
+		{
+			for (int i = 0; i < size; i++)
+				lines[i] = plane.data() + static_cast<std::size_t>(y + i) * stride;
+			processLumaRow(lines.data(), luma.data(), rect.width());
+		}
+		else
+			std::copy_n(filtered.data() + static_cast<std::size_t>(y) * rect.width(), rect.width(), luma.data());
+		yCbCrToRgbRow(luma.data(), cb.data(), cr.data(), reinterpret_cast<QRgb*>(dst.scanLine(rect.top() + y)) + rect.left(), rect.width());
+	}
+}
+
+bool MatrixFilter::useFFT(const QSize& size) const
+{
+	int kernelSize = mKernel.getSize();
+	if (!isLinear() || backend == ConvolutionBackend::Spatial)
+		return false;
+	if (!ConvolutionCostModel::blockSize(kernelSize, size.width(), size.height()))
+		return false;
+	return backend == ConvolutionBackend::FFT
+		|| ConvolutionCostModel::instance().preferFFT(kernelSize, size.width(), size.height(),
+			mKernel.isSparse() ? static_cast<int>(mKernel.getTaps().size()) : 0);
+}
+
+QImage MatrixFilter::processImage(const QImage& img) const
+{
+	if (img.isNull())
+		return QImage();
+	QImage result(img.size(), outputFormat(img));
+	processRegion(img, img.rect(), result);
+	return result;
+}
+
+void MatrixFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	if (img.isNull() || rect.isEmpty())
+		return;
+	if (img.format() == QImage::Format_Grayscale8 && dst.format() == QImage::Format_Grayscale8)
+	{
+		PaddedPlane src(img, mKernel.getRadius(), border, rect);
+		for (int y = 0; y < rect.height(); y++)
+			processGrayRow(src, dst.scanLine(rect.top() + y) + rect.left(), y);
+		return;
+	}
+	if (channels == ChannelMode::Luma)
+		return processLumaRegion(img, rect, dst);
+	PaddedImage src(img, mKernel.getRadius(), border, rect);
+	if (useFFT(rect.size()))
+	{
+		fftCorrelate(src, &mKernel[0], mKernel.getRadius(), dst, rect.topLeft());
+		return;
+	}
+	for (int y = 0; y < rect.height(); y++)
+		processRow(src, reinterpret_cast<QRgb*>(dst.scanLine(rect.top() + y)) + rect.left(), y);
+}
+
+// Taps binned to the nearest position of a kernel of radius * factor: linear
+// kernels keep their sum, masks keep any tap set in a bin. A 1x1 target
+// would turn every kernel into a plain gain, so radius 1 stays as it is.
+std::shared_ptr<const Filter> MatrixFilter::scaled(float factor) const
+{
+	int radius = static_cast<int>(mKernel.getRadius());
+	int target = static_cast<int>(radius * factor);
+	if (target < 1 || target >= radius)
+		return nullptr;
+	Kernel kernel(target);
+	int size = mKernel.getSize(), targetSize = kernel.getSize();
+	std::fill(&kernel[0], &kernel[0] + targetSize * targetSize, 0.f);
+	auto bin = [&](int offset) { return tclamp(static_cast<int>(std::lround(offset * factor)), target, -target) + target; };
 	for (int i = -radius; i <= radius; i++)
 		for (int j = -radius; j <= radius; j++)
 		{
-			int idx = (i + radius) * size + j + radius;
-			QColor color = img.pixelColor(tclamp(x + j, img.width() - 1, 0), tclamp(y + i, img.height() - 1, 0));
-			returnR += color.red() * mKernel[idx];
-			returnG += color.green() * mKernel[idx];
-			returnB += color.blue() * mKernel[idx];
+			float tap = mKernel[(i + radius) * size + j + radius];
+			float& cell = kernel[bin(i) * targetSize + bin(j)];
+			cell = isLinear() ? cell + tap : std::max(cell, tap);
 		}
-	return QColor(tclamp(returnR, 255.f, 0.f), tclamp(returnG, 255.f, 0.f), tclamp(returnB, 255.f, 0.f));
-};
+	auto result = withKernel(kernel);
+	result->setBorder(border);
+	result->setBackend(backend);
+	result->setChannels(channels);
+	return result;
+}
 
 class GaussianKernel : public Kernel
 {
@@ -92,11 +616,11 @@ public:
 	{
 		float norm = 0;
 		int signed_radius = static_cast<int>(radius);
-		for (int x = -signed_radius; x < signed_radius; x++)
-			for (int y = -signed_radius; y < signed_radius; y++)
+		for (int x = -signed_radius; x <= signed_radius; x++)
+			for (int y = -signed_radius; y <= signed_radius; y++)
 			{
 				std::size_t idx = (x + radius) * getSize() + (y + radius);
-				data[idx] = std::exp(-(x * x + y * y) / (sigma * sigma));
+				data[idx] = std::exp(-(x * x + y * y) / (2 * sigma * sigma));
 				norm += data[idx];
 			}
 		for (std::size_t i = 0; i < getLen(); i++)
@@ -104,14 +628,113 @@ public:
 			data[i] /= norm;
 		}
 	}
+	// Shared instance per (radius, sigma); kernels are immutable once built
+	static std::shared_ptr<const GaussianKernel> cached(std::size_t radius, float sigma)
+	{
+		static std::mutex mutex;
+		static std::map<std::pair<std::size_t, float>, std::shared_ptr<const GaussianKernel>> kernels;
+		std::lock_guard<std::mutex> lock(mutex);
+		auto& kernel = kernels[std::make_pair(radius, sigma)];
+		if (!kernel)
+			kernel = std::make_shared<const GaussianKernel>(radius, sigma);
+		return kernel;
+	}
 };
 
 class  GaussianFilter : public MatrixFilter
 {
+protected:
+	float sigma;
 public:
-	GaussianFilter(std::size_t radius = 3) : MatrixFilter(GaussianKernel(radius)) {}
+	GaussianFilter(std::size_t radius = 3, float sigma = 2.f) : MatrixFilter(*GaussianKernel::cached(radius, sigma)), sigma(sigma) {}
+	float getSigma() const { return sigma; }
+	// Exact kernel for the scaled sigma rather than a binned one
+	std::shared_ptr<const Filter> scaled(float factor) const override
+	{
+		auto result = std::make_shared<GaussianFilter>(std::max<std::size_t>(1, static_cast<std::size_t>(mKernel.getRadius() * factor)), sigma * factor);
+		result->setBorder(border);
+		result->setBackend(backend);
+		result->setChannels(channels);
+		return result;
+	}
 };
 
+// Gaussian blur in time independent of sigma; see RecursiveGaussian
+class RecursiveGaussianFilter : public Filter
+{
+protected:
+	float sigma;
+	BorderPolicy border;
+	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	QImage processImage(const QImage& img) const override;
+public:
+	RecursiveGaussianFilter(float sigma = 2.f) : sigma(sigma) {}
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	// The impulse response is infinite but below a level past this distance
+	QMargins margins() const override
+	{
+		int m = RecursiveGaussian::margin(sigma);
+		return QMargins(m, m, m, m);
+	}
+	QRect requiredRect(const QRect& rect, const QSize& size) const override
+	{
+		return borderArea(rect, margins(), size, border.mode);
+	}
+	bool supportsGray() const override { return true; }
+	void hashParams(ParamHash& hash) const override { hash.add(sigma).add(border.mode).add(border.color); }
+	void setBorder(const BorderPolicy& policy) { border = policy; }
+	const BorderPolicy& getBorder() const { return border; }
+	float getSigma() const { return sigma; }
+	std::shared_ptr<const Filter> scaled(float factor) const override;
+};
+
+QColor RecursiveGaussianFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+{
+	return process(img, QRect(x, y, 1, 1)).pixelColor(0, 0);
+}
+
+QImage RecursiveGaussianFilter::processImage(const QImage& img) const
+{
+	RecursiveGaussian engine;
+	return engine.process(img, sigma, border);
+}
+
+void RecursiveGaussianFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	QRect area = requiredRect(rect, img.size());
+	QImage src = img.copy(area);
+	if (src.format() == QImage::Format_Grayscale8 && dst.format() != QImage::Format_Grayscale8)
+		src = src.convertToFormat(QImage::Format_RGB32);
+	RecursiveGaussian engine;
+	QImage blurred = engine.process(src, sigma, border);
+	int bpp = blurred.depth() / 8;
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+		std::memcpy(dst.scanLine(y) + rect.left() * bpp, blurred.constScanLine(y - area.top()) + (rect.left() - area.left()) * bpp, rect.width() * bpp);
+}
+
+// Picks the implementation for a Gaussian of the given sigma: a cached FIR
+// kernel of radius 3 sigma for small sigmas, where it is both cheap and more
+// accurate, the recursive filter beyond
+const float RecursiveGaussianMinSigma = 2.f;
+
+inline std::shared_ptr<Filter> makeGaussianFilter(float sigma, const BorderPolicy& border = BorderPolicy())
+{
+	if (sigma < RecursiveGaussianMinSigma)
+	{
+		auto fir = std::make_shared<GaussianFilter>(static_cast<std::size_t>(std::max(1.f, std::ceil(3 * sigma))), sigma);
+		fir->setBorder(border);
+		return fir;
+	}
+	auto iir = std::make_shared<RecursiveGaussianFilter>(sigma);
+	iir->setBorder(border);
+	return iir;
+}
+
+std::shared_ptr<const Filter> RecursiveGaussianFilter::scaled(float factor) const
+{
+	return makeGaussianFilter(sigma * factor, border);
+}
+
 class BlurKernel : public Kernel
 {
 public:
@@ -170,89 +793,101 @@ public:
 	SobelFilter( std::size_t radius = 1) : MatrixFilter(SobelKernel(radius)) {}
 };
 
-class InvertFilter : public Filter
+class InvertFilter : public PointFilter
 {
 protected:
-	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	void mapRow(const QRgb* src, QRgb* dst, int width) const override;
+public:
+	bool supportsGray() const override { return true; }
 };
 
-QColor InvertFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+void InvertFilter::mapRow(const QRgb* src, QRgb* dst, int width) const
 {
-	QColor color = img.pixelColor(x, y);
-	color.setRgb(255 - color.red(), 255 - color.green(), 255 - color.blue());
-	return color;
+	for (int x = 0; x < width; x++)
+		dst[x] = qRgb(255 - qRed(src[x]), 255 - qGreen(src[x]), 255 - qBlue(src[x]));
 }
 
-class GrayScaleFilter : public Filter
+class GrayScaleFilter : public PointFilter
 {
 protected:
-	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	void mapRow(const QRgb* src, QRgb* dst, int width) const override;
+public:
+	bool supportsGray() const override { return true; }
+	bool producesGray() const override { return true; }
 };
 
-QColor GrayScaleFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+void GrayScaleFilter::mapRow(const QRgb* src, QRgb* dst, int width) const
 {
-	QColor color = img.pixelColor(x, y);
-	color.setRgb(0.299 * color.red() + 0.587 * color.green() + 0.114 * color.blue(), 0.299 * color.red() + 0.587 * color.green() + 0.114 * color.blue(), 0.299 * color.red() + 0.587 * color.green() + 0.114 * color.blue());
-	return color;
+	for (int x = 0; x < width; x++)
+	{
+		int intensity = static_cast<int>(luma(src[x]));
+		dst[x] = qRgb(intensity, intensity, intensity);
+	}
 }
 
-class SepiaFilter : public Filter
+class SepiaFilter : public PointFilter
 {
 protected:
-	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	void mapRow(const QRgb* src, QRgb* dst, int width) const override;
 };
 
-QColor SepiaFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+void SepiaFilter::mapRow(const QRgb* src, QRgb* dst, int width) const
 {
-	QColor color = img.pixelColor(x, y);
-	float intensity = 0.299f * color.red() + 0.587f * color.green() + 0.114f * color.blue();
 	float k = 10;
-	int r = (int)tclamp(2 * k + intensity, 255.f, 0.f);
-	int g = (int)tclamp(0.5f * k + intensity, 255.f, 0.f);
-	int b = (int)tclamp(intensity - 1 * k, 255.f, 0.f);
-	color.setRgb(r, g, b);
-	return color;
+	for (int x = 0; x < width; x++)
+	{
+		float intensity = luma(src[x]);
+		int r = (int)tclamp(2 * k + intensity, 255.f, 0.f);
+		int g = (int)tclamp(0.5f * k + intensity, 255.f, 0.f);
+		int b = (int)tclamp(intensity - 1 * k, 255.f, 0.f);
+		dst[x] = qRgb(r, g, b);
+	}
 }
 
-class BrightFilter : public Filter
+class BrightFilter : public PointFilter
 {
 protected:
-	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	void mapRow(const QRgb* src, QRgb* dst, int width) const override;
+public:
+	bool supportsGray() const override { return true; }
 };
 
-QColor BrightFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+void BrightFilter::mapRow(const QRgb* src, QRgb* dst, int width) const
 {
 	int k = 20;
-	QColor color = img.pixelColor(x, y);
-	int r = (int)tclamp(color.red() + k, 255, 0);
-	int g = (int)tclamp(color.green() + k, 255, 0);
-	int b = (int)tclamp(color.blue() + k, 255, 0);
-	color.setRgb(r, g, b);
-	return color;
+	for (int x = 0; x < width; x++)
+	{
+		int r = (int)tclamp(qRed(src[x]) + k, 255, 0);
+		int g = (int)tclamp(qGreen(src[x]) + k, 255, 0);
+		int b = (int)tclamp(qBlue(src[x]) + k, 255, 0);
+		dst[x] = qRgb(r, g, b);
+	}
 }
-class СorrectionFilter : public Filter
+class СorrectionFilter : public PointFilter
 {
 protected:
-	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	void mapRow(const QRgb* src, QRgb* dst, int width) const override;
+public:
+	bool supportsGray() const override { return true; }
 };
 
-QColor СorrectionFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+void СorrectionFilter::mapRow(const QRgb* src, QRgb* dst, int width) const
 {
-	QColor color = img.pixelColor(x, y);
-
 	int big = 10000;
-	int r = tclamp(color.red() * 255 / big, 255, 0);
-	int g = tclamp(color.green() * 255 / big, 255, 0);
-	int b = tclamp(color.blue() * 255 / big, 255, 0);
-	color.setRgb(r, g, b);
-	return color;
+	for (int x = 0; x < width; x++)
+	{
+		int r = tclamp(qRed(src[x]) * 255 / big, 255, 0);
+		int g = tclamp(qGreen(src[x]) * 255 / big, 255, 0);
+		int b = tclamp(qBlue(src[x]) * 255 / big, 255, 0);
+		dst[x] = qRgb(r, g, b);
+	}
 }
 
 class MotionBlurKernel : public Kernel
 {
 public:
 	using Kernel::Kernel;
-	MotionBlurKernel(int n = 2, std::size_t radius = 1) : Kernel(radius)
+	MotionBlurKernel(std::size_t radius = 1) : Kernel(radius)
 	{
 		for (std::size_t x = 0; x < getSize(); x++)
 		{
@@ -260,7 +895,7 @@ public:
 			{
 				if (x == y)
 				{
-					data[x * getSize() + y] = (float)1 / n;
+					data[x * getSize() + y] = 1.0f / getSize();
 				}
 				else
 				{
@@ -269,49 +904,166 @@ public:
 			}
 		}
 	}
+	// Line of the given angle and length, rasterised with bilinear subpixel weights
+	MotionBlurKernel(const MotionBlurParams& params)
+		: Kernel(static_cast<std::size_t>(std::ceil(params.length / 2)) + 1)
+	{
+		std::fill(data.get(), data.get() + getLen(), 0.f);
+		const double radians = params.angle * 3.14159265358979323846 / 180.0;
+		float dx = static_cast<float>(std::cos(radians)), dy = static_cast<float>(std::sin(radians));
+		int samples = std::max(2, static_cast<int>(std::ceil(params.length * 4)));
+		int r = static_cast<int>(radius);
+		float norm = 0;
+		for (int s = 0; s <= samples; s++)
+		{
+			float t = params.length * (static_cast<float>(s) / samples - 0.5f);
+			float px = t * dx + r, py = t * dy + r;
+			int x0 = static_cast<int>(std::floor(px)), y0 = static_cast<int>(std::floor(py));
+			float fx = px - x0, fy = py - y0;
+			data[y0 * getSize() + x0] += (1 - fx) * (1 - fy);
+			data[y0 * getSize() + x0 + 1] += fx * (1 - fy);
+			data[(y0 + 1) * getSize() + x0] += (1 - fx) * fy;
+			data[(y0 + 1) * getSize() + x0 + 1] += fx * fy;
+			norm += 1;
+		}
+		for (std::size_t i = 0; i < getLen(); i++)
+			data[i] /= norm;
+	}
 };
 
 class MotionBlurFilter : public MatrixFilter
 {
+protected:
+	bool directional = false;
+	MotionBlurParams params = MotionBlurParams();
+	QImage processImage(const QImage& img) const override;
 public:
-	MotionBlurFilter(int n = 3, std::size_t radius = 1) : MatrixFilter(MotionBlurKernel(n, radius)) {}
+	// Main diagonal, 2 * radius + 1 taps
+	MotionBlurFilter(std::size_t radius = 1) : MatrixFilter(MotionBlurKernel(radius)) {}
+	// Arbitrary direction, applied in time independent of the length. The
+	// engine never reads a kernel, so only a 1x1 placeholder is kept
+	MotionBlurFilter(const MotionBlurParams& params)
+		: MatrixFilter(Kernel(0)), directional(true), params(params) {}
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	// The streak is sampled along lines fixed in the whole image
+	void processWindow(const QImage& img, const QPoint& origin, const QSize& size, const QRect& rect, QImage& dst) const override;
+	bool isDirectional() const { return directional; }
+	// Dense kernel of the streak, built on demand for code that needs taps
+	Kernel denseKernel() const
+	{
+		if (!directional)
+			return mKernel;
+		return MotionBlurKernel(params);
+	}
+	QMargins margins() const override
+	{
+		if (!directional)
+			return MatrixFilter::margins();
+		int radius = static_cast<int>(std::ceil(params.length / 2)) + 1;
+		return QMargins(radius, radius, radius, radius);
+	}
+	// The directional engine works on RGB
+	bool supportsGray() const override { return !directional; }
+	void hashParams(ParamHash& hash) const override
+	{
+		MatrixFilter::hashParams(hash);
+		hash.add(directional).add(params.angle).add(params.length);
+	}
+	std::shared_ptr<const Filter> scaled(float factor) const override
+	{
+		if (!directional)
+			return MatrixFilter::scaled(factor);
+		auto result = std::make_shared<MotionBlurFilter>(MotionBlurParams{ params.angle, params.length * factor });
+		result->setBorder(border);
+		return result;
+	}
 };
 
+QImage MotionBlurFilter::processImage(const QImage& img) const
+{
+	if (!directional)
+		return MatrixFilter::processImage(img);
+	MotionBlurEngine engine;
+	return engine.process(img, params, border);
+}
+
+void MotionBlurFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	if (!directional)
+		return MatrixFilter::processRegion(img, rect, dst);
+	processWindow(img, QPoint(), img.size(), rect, dst);
+}
+
+void MotionBlurFilter::processWindow(const QImage& img, const QPoint& origin, const QSize& size, const QRect& rect, QImage& dst) const
+{
+	if (!directional)
+		return MatrixFilter::processWindow(img, origin, size, rect, dst);
+	// The engine works on whole images; run it on the area the rect depends on
+	QRect area = requiredRect(rect, size);
+	MotionBlurEngine engine;
+	QImage blurred = engine.process(img.copy(area.translated(-origin)), params, border, area.topLeft());
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+		std::copy_n(reinterpret_cast<const QRgb*>(blurred.constScanLine(y - area.top())) + rect.left() - area.left(),
+			rect.width(), reinterpret_cast<QRgb*>(dst.scanLine(y - origin.y())) + rect.left() - origin.x());
+}
+
 class GreyWorldFilter : public Filter
 {
 protected:
-	double Rs, Gs, Bs, AVG;
+	// Channel means of the whole image. Kept per call, never in the filter:
+	// one instance may be running on several images at once
+	struct Averages
+	{
+		double Rs = 0, Gs = 0, Bs = 0, AVG = 0;
+	};
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	Averages calcAverages(const QImage& img) const;
+	QColor correctPixel(const QColor& color, const Averages& averages) const;
 public:
-	QImage process(const QImage& img);
-	
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	bool isLocal() const override { return false; }
+	bool supportsGray() const override { return true; }
 };
 
+// processRegion takes the means once; this is only for single pixels
 QColor GreyWorldFilter::calcNewPixelColor(const QImage& img, int x, int y) const
 {
-	QColor color = img.pixelColor(x, y);
-	color.setRgb(tclamp((AVG * color.red() / Rs), 255.0, 0.0), tclamp((AVG * color.green() / Gs), 255.0, 0.0), tclamp((AVG * color.blue() / Bs), 255.0, 0.0));
-	return color;
+	return correctPixel(img.pixelColor(x, y), calcAverages(img));
 }
 
-QImage GreyWorldFilter::process(const QImage& img)
+QColor GreyWorldFilter::correctPixel(const QColor& color, const Averages& averages) const
 {
+	QColor result;
+	result.setRgb(tclamp((averages.AVG * color.red() / averages.Rs), 255.0, 0.0), tclamp((averages.AVG * color.green() / averages.Gs), 255.0, 0.0), tclamp((averages.AVG * color.blue() / averages.Bs), 255.0, 0.0));
+	return result;
+}
+
+GreyWorldFilter::Averages GreyWorldFilter::calcAverages(const QImage& img) const
+{
+	Averages result;
 	for (int x = 0; x < img.width(); x++)
 		for (int y = 0; y < img.height(); y++)
 		{
 			QColor tmp = img.pixelColor(x, y);
-			Rs += tmp.red();
-			Gs += tmp.green();
-			Bs += tmp.blue();
+			result.Rs += tmp.red();
+			result.Gs += tmp.green();
+			result.Bs += tmp.blue();
 		}
 
-	Rs /= img.width() * img.height();
-	Gs /= img.width() * img.height();
-	Bs /= img.width() * img.height();
+	result.Rs /= img.width() * img.height();
+	result.Gs /= img.width() * img.height();
+	result.Bs /= img.width() * img.height();
 
-	AVG = (Rs + Gs + Bs) / 3;
+	result.AVG = (result.Rs + result.Gs + result.Bs) / 3;
+	return result;
+}
 
-	return Filter::process(img);
+void GreyWorldFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	Averages averages = calcAverages(img);
+	for (int x = rect.left(); x <= rect.right(); x++)
+		for (int y = rect.top(); y <= rect.bottom(); y++)
+			dst.setPixelColor(x, y, correctPixel(img.pixelColor(x, y), averages));
 }
 
 class SharpnessKernel : public Kernel
@@ -356,6 +1108,11 @@ class GlassFilter : public Filter
 {
 protected:
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+public:
+	QMargins margins() const override { return QMargins(3, 3, 3, 3); }
+	bool supportsGray() const override { return true; }
+	// Displacements come from rand()
+	bool isDeterministic() const override { return false; }
 };
 
 QColor GlassFilter::calcNewPixelColor(const QImage& img, int x, int y) const
@@ -382,29 +1139,48 @@ class WavesFilter : public Filter
 {
 protected:
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	// x, y and size are whole-image coordinates; img starts at origin
+	QColor wavePixel(const QImage& img, const QPoint& origin, const QSize& size, int x, int y) const;
+public:
+	QMargins margins() const override { return QMargins(20, 0, 20, 0); }
+	bool supportsGray() const override { return true; }
+	// The wave's phase follows the whole-image x
+	void processWindow(const QImage& img, const QPoint& origin, const QSize& size, const QRect& rect, QImage& dst) const override;
 };
 
 QColor WavesFilter::calcNewPixelColor(const QImage& img, int x, int y) const
+{
+	return wavePixel(img, QPoint(), img.size(), x, y);
+}
+
+QColor WavesFilter::wavePixel(const QImage& img, const QPoint& origin, const QSize& size, int x, int y) const
 {
 	int x_1(0), y_1(0);
 	double pi = 3.14;
 	x_1 = x + 20 * sin(2 * pi*x / 60);
 	y_1 = y;
 	QColor color;
-	if (x_1 >= 0 && x_1 < img.width() && y_1 >= 0 && y_1 < img.height())
+	if (x_1 >= 0 && x_1 < size.width() && y_1 >= 0 && y_1 < size.height())
 	{
-		color = img.pixelColor(x_1, y_1);
+		color = img.pixelColor(x_1 - origin.x(), y_1 - origin.y());
 		color.setRgb(color.red(), color.green(), color.blue());
 		return color;
 	}
 	else
 	{
-		color = img.pixelColor(x, y);
+		color = img.pixelColor(x - origin.x(), y - origin.y());
 		color.setRgb(color.red(), color.green(), color.blue());
 		return color;
 	}
 }
 
+void WavesFilter::processWindow(const QImage& img, const QPoint& origin, const QSize& size, const QRect& rect, QImage& dst) const
+{
+	for (int x = rect.left(); x <= rect.right(); x++)
+		for (int y = rect.top(); y <= rect.bottom(); y++)
+			dst.setPixelColor(x - origin.x(), y - origin.y(), wavePixel(img, origin, size, x, y));
+}
+
 /*class MedianFilter : public Filter
 {
 protected:
@@ -435,45 +1211,164 @@ class MedianFilter : public Filter
 {
 protected:
 	int radius;
+	BorderPolicy border;
+	ChannelMode channels = ChannelMode::RGB;
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	QImage processImage(const QImage& img) const override;
+	void processLumaRegion(const QImage& img, const QRect& rect, QImage& dst) const;
+	void processGrayRegion(const QImage& img, const QRect& rect, QImage& dst) const;
 public:
 	MedianFilter(int _r) : radius(_r) {}
+	int getRadius() const { return radius; }
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	bool supportsGray() const override { return true; }
+	QMargins margins() const override { return QMargins(radius, radius, radius, radius); }
+	void setBorder(const BorderPolicy& policy) { border = policy; }
+	const BorderPolicy& getBorder() const { return border; }
+	void setChannels(ChannelMode mode) { channels = mode; }
+	ChannelMode getChannels() const { return channels; }
+	QRect requiredRect(const QRect& rect, const QSize& size) const override
+	{
+		return borderArea(rect, margins(), size, border.mode);
+	}
+	void hashParams(ParamHash& hash) const override { hash.add(radius).add(border.mode).add(border.color).add(channels); }
+	std::shared_ptr<const Filter> scaled(float factor) const override
+	{
+		int target = static_cast<int>(radius * factor);
+		if (target < 1 || target >= radius)
+			return nullptr;
+		auto result = std::make_shared<MedianFilter>(target);
+		result->setBorder(border);
+		result->setChannels(channels);
+		return result;
+	}
 };
 
 QColor MedianFilter::calcNewPixelColor(const QImage& img, int x, int y) const
 {
-	int returnR = 0;
-	int returnG = 0;
-	int returnB = 0;
-	short int size = 2 * radius + 1;
-
-	short int** data = new short int* [3];
-	for (int i = 0; i < 3; i++)
-		data[i] = new short int[size * size];
-
+	int size = 2 * radius + 1;
+	std::vector<short int> data[3];
+	for (int c = 0; c < 3; c++)
+		data[c].resize(size * size);
 
 	for (int i = -radius; i <= radius; i++)
 		for (int j = -radius; j <= radius; j++)
 		{
 			int idx = (i + radius) * size + j + radius;
-			data[0][idx] = img.pixelColor(tclamp<float>(x + j, img.width() - 1, 0), tclamp<float>(y + i, img.height() - 1, 0)).red();
-			data[1][idx] = img.pixelColor(tclamp<float>(x + j, img.width() - 1, 0), tclamp<float>(y + i, img.height() - 1, 0)).green();
-			data[2][idx] = img.pixelColor(tclamp<float>(x + j, img.width() - 1, 0), tclamp<float>(y + i, img.height() - 1, 0)).blue();
+			QRgb color = borderPixel(img, x + j, y + i, border);
+			data[0][idx] = qRed(color);
+			data[1][idx] = qGreen(color);
+			data[2][idx] = qBlue(color);
 		}
 
-	std::sort(data[0], data[0] + size * size);
-	returnR = data[0][(size * size - 1) / 2];
+	int mid = (size * size - 1) / 2;
+	for (int c = 0; c < 3; c++)
+		std::nth_element(data[c].begin(), data[c].begin() + mid, data[c].end());
+	return QColor(data[0][mid], data[1][mid], data[2][mid]);
+}
 
-	std::sort(data[1], data[1] + size * size);
-	returnG = data[1][(size * size - 1) / 2];
+QImage MedianFilter::processImage(const QImage& img) const
+{
+	if (img.isNull())
+		return QImage();
+	QImage result(img.size(), outputFormat(img));
+	processRegion(img, img.rect(), result);
+	return result;
+}
 
-	std::sort(data[2], data[2] + size * size);
-	returnB = data[2][(size * size - 1) / 2];
+void MedianFilter::processRegion(const QImage& img, const QRect& rect, QImage& result) const
+{
+	if (img.isNull() || rect.isEmpty())
+		return;
+	if (img.format() == QImage::Format_Grayscale8 && result.format() == QImage::Format_Grayscale8)
+		return processGrayRegion(img, rect, result);
+	if (channels == ChannelMode::Luma)
+		return processLumaRegion(img, rect, result);
+	PaddedImage src(img, radius, border, rect);
+	int size = 2 * radius + 1;
+	int mid = (size * size - 1) / 2;
+	std::vector<uchar> data[3];
+	for (int c = 0; c < 3; c++)
+		data[c].resize(size * size);
+
+	for (int y = 0; y < rect.height(); y++)
+	{
+		QRgb* dst = reinterpret_cast<QRgb*>(result.scanLine(rect.top() + y)) + rect.left();
+		for (int x = 0; x < rect.width(); x++)
+		{
+			int idx = 0;
+			for (int i = -radius; i <= radius; i++)
+			{
+				const QRgb* line = src.row(y + i) + x - radius;
+				for (int j = 0; j < size; j++, idx++)
+				{
+					data[0][idx] = qRed(line[j]);
+					data[1][idx] = qGreen(line[j]);
+					data[2][idx] = qBlue(line[j]);
+				}
+			}
+			for (int c = 0; c < 3; c++)
+				std::nth_element(data[c].begin(), data[c].begin() + mid, data[c].end());
+			dst[x] = qRgb(data[0][mid], data[1][mid], data[2][mid]);
+		}
+	}
+}
+
+// One selection per pixel instead of three
+void MedianFilter::processLumaRegion(const QImage& img, const QRect& rect, QImage& result) const
+{
+	PaddedImage src(img, radius, border, rect);
+	int size = 2 * radius + 1;
+	int stride = rect.width() + 2 * radius;
+	std::vector<float> plane(static_cast<std::size_t>(stride) * (rect.height() + 2 * radius));
+	Tracer::countAllocation(plane.size() * sizeof(float));
+	for (int y = -radius; y < rect.height() + radius; y++)
+		rgbToLumaRow(src.row(y) - radius, plane.data() + static_cast<std::size_t>(y + radius) * stride, stride);
+
+	int mid = (size * size - 1) / 2;
+	std::vector<float> window(size * size);
+	std::vector<float> luma(rect.width()), cb(rect.width()), cr(rect.width());
+	for (int y = 0; y < rect.height(); y++)
+	{
+		rgbToYCbCrRow(src.row(y), luma.data(), cb.data(), cr.data(), rect.width());
+		for (int x = 0; x < rect.width(); x++)
+		{
+			int idx = 0;
+			for (int i = 0; i < size; i++)
+			{
+				const float* line = plane.data() + static_cast<std::size_t>(y + i) * stride + x;
+				for (int j = 0; j < size; j++)
+					window[idx++] = line[j];
+			}
+			std::nth_element(window.begin(), window.begin() + mid, window.end());
+			luma[x] = window[mid];
+		}
+		yCbCrToRgbRow(luma.data(), cb.data(), cr.data(), reinterpret_cast<QRgb*>(result.scanLine(rect.top() + y)) + rect.left(), rect.width());
+	}
+}
 
-	return QColor(
-		tclamp<float>(returnR, 255, 0),
-		tclamp<float>(returnG, 255, 0),
-		tclamp<float>(returnB, 255, 0));
+void MedianFilter::processGrayRegion(const QImage& img, const QRect& rect, QImage& result) const
+{
+	PaddedPlane src(img, radius, border, rect);
+	int size = 2 * radius + 1;
+	int mid = (size * size - 1) / 2;
+	std::vector<uchar> window(size * size);
+	for (int y = 0; y < rect.height(); y++)
+	{
+		uchar* dst = result.scanLine(rect.top() + y) + rect.left();
+		for (int x = 0; x < rect.width(); x++)
+		{
+			int idx = 0;
+			for (int i = -radius; i <= radius; i++)
+			{
+				const uchar* line = src.row(y + i) + x - radius;
+				for (int j = 0; j < size; j++)
+					window[idx++] = line[j];
+			}
+			std::nth_element(window.begin(), window.begin() + mid, window.end());
+			dst[x] = window[mid];
+		}
+	}
 }
 
 class MorphoKernel : public Kernel
@@ -492,6 +1387,11 @@ class DilationFilter : public MatrixFilter
 {
 protected:
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const;
+	void processRow(const PaddedImage& src, QRgb* dst, int y) const override;
+	void processLumaRow(const float* const* lines, float* dst, int width) const override;
+	void processGrayRow(const PaddedPlane& src, uchar* dst, int y) const override;
+	bool isLinear() const override { return false; }
+	std::shared_ptr<MatrixFilter> withKernel(const Kernel& kernel) const override { return std::make_shared<DilationFilter>(kernel); }
 public:
 	DilationFilter(const Kernel& kernel) : MatrixFilter(kernel) {}
 	DilationFilter(size_t radius = 1) : MatrixFilter(MorphoKernel(radius)) {}
@@ -501,6 +1401,11 @@ class ErosionFilter : public MatrixFilter
 {
 protected:
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const;
+	void processRow(const PaddedImage& src, QRgb* dst, int y) const override;
+	void processLumaRow(const float* const* lines, float* dst, int width) const override;
+	void processGrayRow(const PaddedPlane& src, uchar* dst, int y) const override;
+	bool isLinear() const override { return false; }
+	std::shared_ptr<MatrixFilter> withKernel(const Kernel& kernel) const override { return std::make_shared<ErosionFilter>(kernel); }
 public:
 	ErosionFilter(const Kernel& kernel) : MatrixFilter(kernel) {}
 	ErosionFilter(size_t radius = 1) : MatrixFilter(MorphoKernel(radius)) {}
@@ -541,26 +1446,16 @@ QColor DilationFilter::calcNewPixelColor(const QImage& img, int x, int y) const
 	float returnB = 0;
 	float returnG = 0;
 
-	int size = mKernel.getSize();
-	int radius = mKernel.getRadius();
-	for (int i = -radius; i <= radius; i++)
-		for (int j = -radius; j <= radius; j++)
-		{
-			int idx = (i + radius) * size + j + radius;
-			QColor color = img.pixelColor(tclamp<float>(x + j, img.width() - 1, 0),
-				tclamp<float>(y + i, img.height() - 1, 0));
-
-			if (mKernel[idx])
-			{
-				if (color.red() > returnR)
-					returnR = color.red();
-				if (color.green() > returnG)
-					returnG = color.green();
-				if (color.blue() > returnB)
-					returnB = color.blue();
-			}
-
-		}
+	for (const KernelTap& tap : mKernel.getTaps())
+	{
+		QColor color = borderPixel(img, x + tap.dx, y + tap.dy, border);
+		if (color.red() > returnR)
+			returnR = color.red();
+		if (color.green() > returnG)
+			returnG = color.green();
+		if (color.blue() > returnB)
+			returnB = color.blue();
+	}
 	return QColor(returnR, returnG, returnB);
 }
 
@@ -570,27 +1465,219 @@ QColor ErosionFilter::calcNewPixelColor(const QImage& img, int x, int y) const
 	float returnB = 255;
 	float returnG = 255;
 
+	for (const KernelTap& tap : mKernel.getTaps())
+	{
+		QColor color = borderPixel(img, x + tap.dx, y + tap.dy, border);
+		if (color.red() < returnR)
+			returnR = color.red();
+		if (color.green() < returnG)
+			returnG = color.green();
+		if (color.blue() < returnB)
+			returnB = color.blue();
+	}
+	return QColor(returnR, returnG, returnB);
+}
+
+void DilationFilter::processRow(const PaddedImage& src, QRgb* dst, int y) const
+{
 	int size = mKernel.getSize();
 	int radius = mKernel.getRadius();
-	for (int i = -radius; i <= radius; i++)
-		for (int j = -radius; j <= radius; j++)
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < src.getWidth(); x++)
 		{
-			int idx = (i + radius) * size + j + radius;
-			QColor color = img.pixelColor(tclamp<float>(x + j, img.width() - 1, 0),
-				tclamp<float>(y + i, img.height() - 1, 0));
+			int returnR = 0;
+			int returnG = 0;
+			int returnB = 0;
+			for (const KernelTap& tap : mKernel.getTaps())
+			{
+				QRgb pixel = src.row(y + tap.dy)[x + tap.dx];
+				returnR = std::max(returnR, qRed(pixel));
+				returnG = std::max(returnG, qGreen(pixel));
+				returnB = std::max(returnB, qBlue(pixel));
+			}
+			dst[x] = qRgb(returnR, returnG, returnB);
+		}
+		return;
+	}
+	for (int x = 0; x < src.getWidth(); x++)
+	{
+		int returnR = 0;
+		int returnG = 0;
+		int returnB = 0;
+		for (int i = -radius; i <= radius; i++)
+		{
+			const QRgb* line = src.row(y + i) + x - radius;
+			const float* k = &mKernel[(i + radius) * size];
+			for (int j = 0; j < size; j++)
+			{
+				if (k[j])
+				{
+					returnR = std::max(returnR, qRed(line[j]));
+					returnG = std::max(returnG, qGreen(line[j]));
+					returnB = std::max(returnB, qBlue(line[j]));
+				}
+			}
+		}
+		dst[x] = qRgb(returnR, returnG, returnB);
+	}
+}
 
-			if (mKernel[idx])
+void ErosionFilter::processRow(const PaddedImage& src, QRgb* dst, int y) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < src.getWidth(); x++)
+		{
+			int returnR = 255;
+			int returnG = 255;
+			int returnB = 255;
+			for (const KernelTap& tap : mKernel.getTaps())
 			{
-				if (color.red() < returnR)
-					returnR = color.red();
-				if (color.green() < returnG)
-					returnG = color.green();
-				if (color.blue() < returnB)
-					returnB = color.blue();
+				QRgb pixel = src.row(y + tap.dy)[x + tap.dx];
+				returnR = std::min(returnR, qRed(pixel));
+				returnG = std::min(returnG, qGreen(pixel));
+				returnB = std::min(returnB, qBlue(pixel));
 			}
+			dst[x] = qRgb(returnR, returnG, returnB);
+		}
+		return;
+	}
+	for (int x = 0; x < src.getWidth(); x++)
+	{
+		int returnR = 255;
+		int returnG = 255;
+		int returnB = 255;
+		for (int i = -radius; i <= radius; i++)
+		{
+			const QRgb* line = src.row(y + i) + x - radius;
+			const float* k = &mKernel[(i + radius) * size];
+			for (int j = 0; j < size; j++)
+			{
+				if (k[j])
+				{
+					returnR = std::min(returnR, qRed(line[j]));
+					returnG = std::min(returnG, qGreen(line[j]));
+					returnB = std::min(returnB, qBlue(line[j]));
+				}
+			}
+		}
+		dst[x] = qRgb(returnR, returnG, returnB);
+	}
+}
+
+void DilationFilter::processGrayRow(const PaddedPlane& src, uchar* dst, int y) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < src.getWidth(); x++)
+		{
+			uchar value = 0;
+			for (const KernelTap& tap : mKernel.getTaps())
+				value = std::max(value, src.row(y + tap.dy)[x + tap.dx]);
+			dst[x] = value;
+		}
+		return;
+	}
+	for (int x = 0; x < src.getWidth(); x++)
+	{
+		uchar value = 0;
+		for (int i = -radius; i <= radius; i++)
+		{
+			const uchar* line = src.row(y + i) + x - radius;
+			const float* k = &mKernel[(i + radius) * size];
+			for (int j = 0; j < size; j++)
+				if (k[j])
+					value = std::max(value, line[j]);
+		}
+		dst[x] = value;
+	}
+}
 
+void ErosionFilter::processGrayRow(const PaddedPlane& src, uchar* dst, int y) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < src.getWidth(); x++)
+		{
+			uchar value = 255;
+			for (const KernelTap& tap : mKernel.getTaps())
+				value = std::min(value, src.row(y + tap.dy)[x + tap.dx]);
+			dst[x] = value;
 		}
-	return QColor(returnR, returnG, returnB);
+		return;
+	}
+	for (int x = 0; x < src.getWidth(); x++)
+	{
+		uchar value = 255;
+		for (int i = -radius; i <= radius; i++)
+		{
+			const uchar* line = src.row(y + i) + x - radius;
+			const float* k = &mKernel[(i + radius) * size];
+			for (int j = 0; j < size; j++)
+				if (k[j])
+					value = std::min(value, line[j]);
+		}
+		dst[x] = value;
+	}
+}
+
+void DilationFilter::processLumaRow(const float* const* lines, float* dst, int width) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float value = 0;
+			for (const KernelTap& tap : mKernel.getTaps())
+				value = std::max(value, lines[tap.dy + radius][x + tap.dx + radius]);
+			dst[x] = value;
+		}
+		return;
+	}
+	for (int x = 0; x < width; x++)
+	{
+		float value = 0;
+		for (int i = 0; i < size; i++)
+			for (int j = 0; j < size; j++)
+				if (mKernel[i * size + j])
+					value = std::max(value, lines[i][x + j]);
+		dst[x] = value;
+	}
+}
+
+void ErosionFilter::processLumaRow(const float* const* lines, float* dst, int width) const
+{
+	int size = mKernel.getSize();
+	int radius = mKernel.getRadius();
+	if (mKernel.isSparse())
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float value = 255;
+			for (const KernelTap& tap : mKernel.getTaps())
+				value = std::min(value, lines[tap.dy + radius][x + tap.dx + radius]);
+			dst[x] = value;
+		}
+		return;
+	}
+	for (int x = 0; x < width; x++)
+	{
+		float value = 255;
+		for (int i = 0; i < size; i++)
+			for (int j = 0; j < size; j++)
+				if (mKernel[i * size + j])
+					value = std::min(value, lines[i][x + j]);
+		dst[x] = value;
+	}
 }
 
 QImage OpeningFilter::process(const QImage& img)
@@ -832,21 +1919,34 @@ QColor Erosion::calcNewPixelColor(const QImage& img, int x, int y) const
 
 class HistogrammFilter : public Filter
 {
-	float intensity_max, intensity_min;
 public:
-	HistogrammFilter()
+	// Luma range of the whole image, computed per call so that one instance
+	// can serve several threads
+	struct IntensityRange
 	{
-		intensity_max = 1, intensity_min = 1;
-	}
-	void intensities_range_calc(const QImage& img);
+		float intensity_max = 1, intensity_min = 1;
+	};
+	IntensityRange intensities_range_calc(const QImage& img) const;
+	QColor stretchPixel(const QColor& color, const IntensityRange& range) const;
 	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
-	QImage process(const QImage& img);
+	QImage processImage(const QImage& img) const override;
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	bool isLocal() const override { return false; }
+	bool supportsGray() const override { return true; }
+	bool producesGray() const override { return true; }
 };
 
+void HistogrammFilter::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	IntensityRange range = intensities_range_calc(img);
+	for (int x = rect.left(); x <= rect.right(); x++)
+		for (int y = rect.top(); y <= rect.bottom(); y++)
+			dst.setPixelColor(x, y, stretchPixel(img.pixelColor(x, y), range));
+}
 
-QImage HistogrammFilter::process(const QImage& img)
+QImage HistogrammFilter::processImage(const QImage& img) const
 {
-	intensities_range_calc(img);
+	IntensityRange range = intensities_range_calc(img);
 	QImage result(img);//создаём переменную-картинку-результат
 	//проходим каждый пикслей в цикле 
 	for (int x = 0; x < img.width(); x++)
@@ -855,7 +1955,7 @@ QImage HistogrammFilter::process(const QImage& img)
 		{
 			//создаём "переменную-результат"-"color" работы функции обработки цвета текущего пикселя
 			//(в новой картинке)
-			QColor color = calcNewPixelColor(img, x, y);
+			QColor color = stretchPixel(img.pixelColor(x, y), range);
 			//в результирующей картинке устанавливаем этот пиксель(x,y) в новый цвет color
 			result.setPixelColor(x, y, color);
 		}
@@ -864,22 +1964,28 @@ QImage HistogrammFilter::process(const QImage& img)
 	return result;
 }
 
+// processRegion takes the range once; this is only for single pixels
 QColor HistogrammFilter::calcNewPixelColor(const QImage& img, int x, int y) const
 {
 	//берём значения цвета текущего пикселя
-	QColor color = img.pixelColor(x, y);
+	return stretchPixel(img.pixelColor(x, y), intensities_range_calc(img));
+}
+
+QColor HistogrammFilter::stretchPixel(const QColor& pixel, const IntensityRange& range) const
+{
+	QColor color = pixel;
 
 	//устанавливаем во все каналы полученное значение
 	float intensity = 0, intensity_tmp = 0;
-	intensity_tmp  = 0.3 * color.red() + 0.59 * color.green() + 0.51 * color.blue();
-	intensity = (intensity_tmp - intensity_min) * (255 - 0) / (intensity_max - intensity_min);
+	intensity_tmp = luma(color.rgb());
+	intensity = (intensity_tmp - range.intensity_min) * (255 - 0) / (range.intensity_max - range.intensity_min);
 
 	color.setRgb(tclamp<float>(intensity, 255.f, 0.f), tclamp<float>(intensity, 255.f, 0.f), tclamp<float>(intensity, 255.f, 0.f));
 	return color;
 }
 
 
-void HistogrammFilter::intensities_range_calc(const QImage& img)
+HistogrammFilter::IntensityRange HistogrammFilter::intensities_range_calc(const QImage& img) const
 {
 	float min_int = 0, max_int = 0;
 	float tmp_intens;
@@ -888,7 +1994,7 @@ void HistogrammFilter::intensities_range_calc(const QImage& img)
 		for (int y = 0; y < img.height(); y++)
 		{
 			QColor color = img.pixelColor(tclamp<float>(x, img.width() - 1, 0), tclamp<float>(y, img.height() - 1, 0));
-			tmp_intens = 0.3 * color.red() + 0.59 * color.green() + 0.11 * color.blue();
+			tmp_intens = luma(color.rgb());
 			if (tmp_intens > max_int)
 			{
 				max_int = tmp_intens;
@@ -899,7 +2005,9 @@ void HistogrammFilter::intensities_range_calc(const QImage& img)
 			}
 		}
 	}
-	intensity_max = max_int;
-	intensity_min = min_int;
+	IntensityRange range;
+	range.intensity_max = max_int;
+	range.intensity_min = min_int;
+	return range;
 
 }
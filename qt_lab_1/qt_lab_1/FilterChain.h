@@ -0,0 +1,116 @@
+﻿#pragma once
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Bilateral.h"
+#include "BinaryMorphology.h"
+#include "Pipeline.h"
+
+// Text form of a filter chain: stages separated by ',', arguments by ':',
+// e.g. "median:2,gauss:1.5,invert". Omitted arguments take the defaults of
+// the constructors.
+//
+//   invert gray sepia bright correction greyworld histogram glass waves
+//   sobel emboss sharpen blur[:r] gauss[:sigma] median[:r]
+//   dilate[:r] erode[:r] motion[:r] motion:angle:length
+//   bilateral[:sigmaSpatial[:sigmaRange]]
+//   binary:op[:level]   op = dilate erode open close gradient tophat blackhat
+//
+// Returns nullptr and fills error for an unknown name or a bad argument.
+inline std::shared_ptr<const Filter> parseFilterChain(const std::string& text, std::string* error = nullptr)
+{
+	auto fail = [error](const std::string& message) -> std::shared_ptr<const Filter>
+	{
+		if (error)
+			*error = message;
+		return nullptr;
+	};
+	auto split = [](const std::string& value, char separator)
+	{
+		std::vector<std::string> parts;
+		std::stringstream stream(value);
+		std::string part;
+		while (std::getline(stream, part, separator))
+			parts.push_back(part);
+		return parts;
+	};
+
+	auto pipeline = std::make_shared<Pipeline>();
+	for (const std::string& stage : split(text, ','))
+	{
+		std::vector<std::string> args = split(stage, ':');
+		if (args.empty() || args[0].empty())
+			return fail("empty stage in \"" + text + "\"");
+		const std::string& name = args[0];
+		// The binary morphology operator is a word, the numbers follow it
+		std::vector<double> numbers;
+		for (std::size_t i = name == "binary" ? 2 : 1; i < args.size(); i++)
+		{
+			char* end = nullptr;
+			numbers.push_back(std::strtod(args[i].c_str(), &end));
+			if (args[i].empty() || *end != '\0')
+				return fail("bad argument \"" + args[i] + "\" of " + name);
+		}
+		auto arg = [&numbers](std::size_t i, double fallback) { return i < numbers.size() ? numbers[i] : fallback; };
+		auto radius = [&arg](double fallback) { return static_cast<std::size_t>(std::max(0.0, arg(0, fallback))); };
+
+		if (name == "invert")
+			pipeline->add<InvertFilter>();
+		else if (name == "gray")
+			pipeline->add<GrayScaleFilter>();
+		else if (name == "sepia")
+			pipeline->add<SepiaFilter>();
+		else if (name == "bright")
+			pipeline->add<BrightFilter>();
+		else if (name == "correction")
+			pipeline->add<СorrectionFilter>();
+		else if (name == "greyworld")
+			pipeline->add<GreyWorldFilter>();
+		else if (name == "histogram")
+			pipeline->add<HistogrammFilter>();
+		else if (name == "glass")
+			pipeline->add<GlassFilter>();
+		else if (name == "waves")
+			pipeline->add<WavesFilter>();
+		else if (name == "sobel")
+			pipeline->add<SobelFilter>();
+		else if (name == "emboss")
+			pipeline->add<EmbossmentFilter>();
+		else if (name == "sharpen")
+			pipeline->add<SharpnessFilter>();
+		else if (name == "blur")
+			pipeline->add<BlurFilter>(radius(1));
+		else if (name == "gauss")
+			pipeline->add(makeGaussianFilter(static_cast<float>(arg(0, 2.0))));
+		else if (name == "median")
+			pipeline->add<MedianFilter>(static_cast<int>(radius(1)));
+		else if (name == "dilate")
+			pipeline->add<DilationFilter>(radius(1));
+		else if (name == "erode")
+			pipeline->add<ErosionFilter>(radius(1));
+		else if (name == "motion" && numbers.size() >= 2)
+			pipeline->add<MotionBlurFilter>(MotionBlurParams{ static_cast<float>(numbers[0]), static_cast<float>(numbers[1]) });
+		else if (name == "motion")
+			pipeline->add<MotionBlurFilter>(radius(1));
+		else if (name == "bilateral")
+			pipeline->add<BilateralFilter>(static_cast<float>(arg(0, 8.0)), static_cast<float>(arg(1, 20.0)));
+		else if (name == "binary" && args.size() >= 2)
+		{
+			static const char* const ops[] = { "dilate", "erode", "open", "close", "gradient", "tophat", "blackhat" };
+			int op = -1;
+			for (int i = 0; i < 7; i++)
+				if (args[1] == ops[i])
+					op = i;
+			if (op < 0)
+				return fail("unknown morphology operator \"" + args[1] + "\"");
+			pipeline->add<BinaryMorphologyFilter>(static_cast<MorphologyOp>(op), MorphoKernel(1), static_cast<int>(arg(0, 128)));
+		}
+		else
+			return fail("unknown filter \"" + name + "\"");
+	}
+	if (pipeline->size() == 1)
+		return std::shared_ptr<const Filter>(pipeline, &pipeline->stage(0));
+	return pipeline;
+}
@@ -0,0 +1,100 @@
+﻿#pragma once
+#include <QImage>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// XXH64 (xxHash, 64-bit variant), one-shot over a buffer
+class XXH64
+{
+	static const std::uint64_t P1 = 11400714785074694791ULL;
+	static const std::uint64_t P2 = 14029467366897019727ULL;
+	static const std::uint64_t P3 = 1609587929392839161ULL;
+	static const std::uint64_t P4 = 9650029242287828579ULL;
+	static const std::uint64_t P5 = 2870177450012600261ULL;
+
+	static std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static std::uint64_t read64(const uchar* p) { std::uint64_t v; std::memcpy(&v, p, 8); return v; }
+	static std::uint32_t read32(const uchar* p) { std::uint32_t v; std::memcpy(&v, p, 4); return v; }
+	static std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+	{
+		acc += input * P2;
+		return rotl(acc, 31) * P1;
+	}
+	static std::uint64_t merge(std::uint64_t acc, std::uint64_t value)
+	{
+		acc ^= round(0, value);
+		return acc * P1 + P4;
+	}
+public:
+	static std::uint64_t hash(const void* data, std::size_t length, std::uint64_t seed = 0)
+	{
+		const uchar* p = static_cast<const uchar*>(data);
+		const uchar* end = p + length;
+		std::uint64_t h;
+		if (length >= 32)
+		{
+			std::uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+			for (; p + 32 <= end; p += 32)
+			{
+				v1 = round(v1, read64(p));
+				v2 = round(v2, read64(p + 8));
+				v3 = round(v3, read64(p + 16));
+				v4 = round(v4, read64(p + 24));
+			}
+			h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+			h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+		}
+		else
+			h = seed + P5;
+		h += length;
+		for (; p + 8 <= end; p += 8)
+			h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if (p + 4 <= end)
+		{
+			h = rotl(h ^ (std::uint64_t(read32(p)) * P1), 23) * P2 + P3;
+			p += 4;
+		}
+		for (; p < end; p++)
+			h = rotl(h ^ (*p * P5), 11) * P1;
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+};
+
+// Accumulates values into a 64-bit digest, each one chained through XXH64
+class ParamHash
+{
+	std::uint64_t state;
+public:
+	explicit ParamHash(std::uint64_t seed = 0) : state(seed) {}
+	ParamHash& add(const void* data, std::size_t length)
+	{
+		state = XXH64::hash(data, length, state);
+		return *this;
+	}
+	template <class T>
+	ParamHash& add(const T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "hash plain values only");
+		return add(&value, sizeof(value));
+	}
+	ParamHash& add(const std::string& text) { return add(text.data(), text.size()); }
+	std::uint64_t value() const { return state; }
+};
+
+// Pixels only: scanline padding is skipped, geometry and format are included
+inline std::uint64_t imageHash(const QImage& img, std::uint64_t seed = 0)
+{
+	ParamHash hash(seed);
+	hash.add(img.width()).add(img.height()).add(static_cast<int>(img.format()));
+	std::size_t lineBytes = (static_cast<std::size_t>(img.width()) * img.depth() + 7) / 8;
+	for (int y = 0; y < img.height(); y++)
+		hash.add(img.constScanLine(y), lineBytes);
+	return hash.value();
+}
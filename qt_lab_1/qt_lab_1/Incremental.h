@@ -0,0 +1,129 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "Filter.h"
+
+// Output of a filter on an image that is being edited. Changes to the
+// source are recorded as dirty tiles; result() then recomputes only the
+// output tiles whose requiredRect() reaches a dirty tile, so a brush stroke
+// costs in proportion to its footprint grown by the filter's margins (for a
+// pipeline, the margins of all its stages). Every other tile keeps its
+// previous result. Filters that need the whole image are rerun whole after
+// any change.
+class IncrementalFilter
+{
+	std::shared_ptr<const Filter> filter;
+	QSize tile;
+	QImage source, output;
+	std::vector<char> dirty;	// per source tile, row-major
+	int tilesX = 0, tilesY = 0;
+	bool pending = false;
+	int recomputed = 0;
+
+	QRect tileRect(int tx, int ty) const
+	{
+		return QRect(tx * tile.width(), ty * tile.height(), tile.width(), tile.height()).intersected(source.rect());
+	}
+	bool reaches(const QRect& area) const;
+public:
+	explicit IncrementalFilter(std::shared_ptr<const Filter> filter, const QSize& tile = QSize(64, 64))
+		: filter(std::move(filter)), tile(tile) {}
+
+	// New image: everything is recomputed on the next result()
+	void setImage(const QImage& img);
+	// Copies patch into the source at pos and marks the area dirty
+	void update(const QImage& patch, const QPoint& pos);
+	// For painting into the source directly; call markDirty() with what was touched
+	QImage& image() { return source; }
+	void markDirty(const QRect& rect);
+	const QImage& result();
+	// Output tiles recomputed by the last result(); -1 if the filter was rerun whole
+	int lastRecomputed() const { return recomputed; }
+};
+
+inline void IncrementalFilter::setImage(const QImage& img)
+{
+	source = img.format() == QImage::Format_Grayscale8 && !filter->supportsGray() ? img.convertToFormat(QImage::Format_RGB32) : img;
+	output = QImage(source.size(), filter->outputFormat(source));
+	Tracer::countAllocation(output.sizeInBytes());
+	tilesX = (source.width() + tile.width() - 1) / tile.width();
+	tilesY = (source.height() + tile.height() - 1) / tile.height();
+	dirty.assign(static_cast<std::size_t>(tilesX) * tilesY, 1);
+	pending = true;
+}
+
+inline void IncrementalFilter::update(const QImage& patch, const QPoint& pos)
+{
+	QRect rect = QRect(pos, patch.size()).intersected(source.rect());
+	if (rect.isEmpty())
+		return;
+	QImage src = patch.format() == source.format() ? patch : patch.convertToFormat(source.format());
+	int bpp = source.depth() / 8;
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+		std::memcpy(source.scanLine(y) + rect.left() * bpp, src.constScanLine(y - pos.y()) + (rect.left() - pos.x()) * bpp, rect.width() * bpp);
+	markDirty(rect);
+}
+
+inline void IncrementalFilter::markDirty(const QRect& rect)
+{
+	QRect area = rect.intersected(source.rect());
+	if (area.isEmpty())
+		return;
+	for (int ty = area.top() / tile.height(); ty <= area.bottom() / tile.height(); ty++)
+		for (int tx = area.left() / tile.width(); tx <= area.right() / tile.width(); tx++)
+			dirty[ty * tilesX + tx] = 1;
+	pending = true;
+}
+
+// True when a dirty source tile lies within area
+inline bool IncrementalFilter::reaches(const QRect& area) const
+{
+	if (area.isEmpty())
+		return false;
+	for (int ty = area.top() / tile.height(); ty <= area.bottom() / tile.height(); ty++)
+		for (int tx = area.left() / tile.width(); tx <= area.right() / tile.width(); tx++)
+			if (dirty[ty * tilesX + tx])
+				return true;
+	return false;
+}
+
+inline const QImage& IncrementalFilter::result()
+{
+	if (!pending)
+		return output;
+	TraceScope scope("incremental", typeid(*filter));
+	if (!filter->isLocal())
+	{
+		output = filter->process(source);
+		recomputed = -1;
+	}
+	else
+	{
+		// Dirty output tiles of a tile row are merged into runs, so the
+		// margins between neighbouring tiles are read once
+		recomputed = 0;
+		for (int ty = 0; ty < tilesY; ty++)
+			for (int tx = 0; tx < tilesX;)
+			{
+				if (!reaches(filter->requiredRect(tileRect(tx, ty), source.size())))
+				{
+					tx++;
+					continue;
+				}
+				int end = tx + 1;
+				while (end < tilesX && reaches(filter->requiredRect(tileRect(end, ty), source.size())))
+					end++;
+				QRect run = tileRect(tx, ty).united(tileRect(end - 1, ty));
+				filter->processRegion(source, run, output);
+				scope.addPixels(qint64(run.width()) * run.height());
+				recomputed += end - tx;
+				tx = end;
+			}
+	}
+	std::fill(dirty.begin(), dirty.end(), 0);
+	pending = false;
+	return output;
+}
@@ -0,0 +1,162 @@
+﻿#pragma once
+#include <QImage>
+#include <vector>
+#include <cmath>
+#include "Border.h"
+
+// Straight-line motion. angle is in degrees from the +x axis towards +y
+// (image rows grow downwards, so 45 is the main diagonal); length is the
+// full extent of the streak in pixels, centred on the output pixel.
+struct MotionBlurParams
+{
+	float angle;
+	float length;
+};
+
+// Box blur of length L along direction (cos a, sin a), in time independent of L.
+// For |slope| <= 1 the image is sheared so that lines of that slope become
+// rows, each row is box-filtered with a running (prefix) sum whose ends are
+// weighted by their fractional coverage, and the result is sheared back.
+// Steeper directions are handled by transposing around the same pass.
+class MotionBlurEngine
+{
+	typedef std::vector<float> Plane;
+	int width = 0, height = 0;
+	Plane planes[3];
+
+	void load(const QImage& img, bool transpose);
+	QImage store(QImage::Format format, bool transpose) const;
+	void blurAlongRows(float slope, float half, float phase, const BorderPolicy& border);
+public:
+	// origin is the position of img inside a larger image, so that crops are
+	// sampled along exactly the same lines as the whole image
+	QImage process(const QImage& img, const MotionBlurParams& params, const BorderPolicy& border = BorderPolicy(), const QPoint& origin = QPoint());
+};
+
+inline void MotionBlurEngine::load(const QImage& img, bool transpose)
+{
+	width = transpose ? img.height() : img.width();
+	height = transpose ? img.width() : img.height();
+	for (int c = 0; c < 3; c++)
+		planes[c].assign(static_cast<std::size_t>(width) * height, 0.f);
+	Tracer::countAllocation(3 * planes[0].size() * sizeof(float));
+	QImage src = img.convertToFormat(QImage::Format_ARGB32);
+	for (int y = 0; y < img.height(); y++)
+	{
+		const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+		for (int x = 0; x < img.width(); x++)
+		{
+			std::size_t idx = transpose ? static_cast<std::size_t>(x) * width + y : static_cast<std::size_t>(y) * width + x;
+			planes[0][idx] = qRed(line[x]);
+			planes[1][idx] = qGreen(line[x]);
+			planes[2][idx] = qBlue(line[x]);
+		}
+	}
+}
+
+inline QImage MotionBlurEngine::store(QImage::Format format, bool transpose) const
+{
+	int outWidth = transpose ? height : width;
+	int outHeight = transpose ? width : height;
+	QImage result(outWidth, outHeight, format);
+	for (int y = 0; y < outHeight; y++)
+	{
+		QRgb* line = reinterpret_cast<QRgb*>(result.scanLine(y));
+		for (int x = 0; x < outWidth; x++)
+		{
+			std::size_t idx = transpose ? static_cast<std::size_t>(x) * width + y : static_cast<std::size_t>(y) * width + x;
+			int rgb[3];
+			for (int c = 0; c < 3; c++)
+				rgb[c] = static_cast<int>(std::max(0.f, std::min(255.f, planes[c][idx])) + 0.5f);
+			line[x] = qRgb(rgb[0], rgb[1], rgb[2]);
+		}
+	}
+	return result;
+}
+
+inline void MotionBlurEngine::blurAlongRows(float slope, float half, float phase, const BorderPolicy& border)
+{
+	int margin = static_cast<int>(std::ceil(half)) + 1;
+	int span = width + 2 * margin;
+	// Sheared row v holds samples (x, v + x * slope + phase); enough rows to cover every output pixel
+	float shift = slope * (width - 1);
+	int vBegin = static_cast<int>(std::floor(std::min(0.f, -shift) - phase));
+	int vEnd = static_cast<int>(std::ceil(height - 1 + std::max(0.f, -shift) - phase)) + 1;
+	int rows = vEnd - vBegin + 1;
+	float borderValue[3] = { float(qRed(border.color)), float(qGreen(border.color)), float(qBlue(border.color)) };
+
+	std::vector<float> sheared(span), prefix(span + 1);
+	std::vector<float> blurred(static_cast<std::size_t>(rows) * width);
+	Tracer::countAllocation(blurred.size() * sizeof(float));
+	for (int c = 0; c < 3; c++)
+	{
+		const Plane& plane = planes[c];
+		for (int r = 0; r < rows; r++)
+		{
+			for (int i = 0; i < span; i++)
+			{
+				int x = borderIndex(i - margin, width, border.mode);
+				float y = vBegin + r + (i - margin) * slope + phase;
+				int y0 = static_cast<int>(std::floor(y));
+				float fy = y - y0;
+				int ya = borderIndex(y0, height, border.mode);
+				int yb = borderIndex(y0 + 1, height, border.mode);
+				float a = (x < 0 || ya < 0) ? borderValue[c] : plane[static_cast<std::size_t>(ya) * width + x];
+				float b = (x < 0 || yb < 0) ? borderValue[c] : plane[static_cast<std::size_t>(yb) * width + x];
+				sheared[i] = a + (b - a) * fy;
+			}
+			prefix[0] = 0;
+			for (int i = 0; i < span; i++)
+				prefix[i + 1] = prefix[i] + sheared[i];
+			// Integral of the row up to position t, where sample i covers [i - 0.5, i + 0.5)
+			auto integral = [&](float t)
+			{
+				float edge = t + 0.5f;
+				int k = static_cast<int>(std::floor(edge));
+				return prefix[k] + (edge - k) * sheared[k];
+			};
+			float* out = blurred.data() + static_cast<std::size_t>(r) * width;
+			for (int x = 0; x < width; x++)
+			{
+				float centre = static_cast<float>(x + margin);
+				out[x] = (integral(centre + half) - integral(centre - half)) / (2 * half);
+			}
+		}
+		// Shear back: output (x, y) lies between rows floor(v) and floor(v) + 1
+		Plane& dst = planes[c];
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				float v = y - x * slope - phase - vBegin;
+				int r = static_cast<int>(std::floor(v));
+				float fv = v - r;
+				float a = blurred[static_cast<std::size_t>(r) * width + x];
+				float b = blurred[static_cast<std::size_t>(r + 1) * width + x];
+				dst[static_cast<std::size_t>(y) * width + x] = a + (b - a) * fv;
+			}
+	}
+}
+
+inline QImage MotionBlurEngine::process(const QImage& img, const MotionBlurParams& params, const BorderPolicy& border, const QPoint& origin)
+{
+	const double radians = params.angle * 3.14159265358979323846 / 180.0;
+	double dx = std::cos(radians), dy = std::sin(radians);
+	bool steep = std::fabs(dy) > std::fabs(dx);
+	if (steep)
+		std::swap(dx, dy);
+	float slope = static_cast<float>(dy / dx);
+	float half = static_cast<float>(params.length * std::fabs(dx) / 2);
+	QImage::Format format = img.format() == QImage::Format_RGB32 ? QImage::Format_RGB32 : QImage::Format_ARGB32;
+	if (half < 1e-3f || img.isNull())
+		return img.convertToFormat(format);
+
+	float ox = static_cast<float>(steep ? origin.y() : origin.x());
+	float oy = static_cast<float>(steep ? origin.x() : origin.y());
+	// Only the fractional part matters; keeps the float small for huge offsets
+	float phase = ox * slope - oy;
+	phase -= std::floor(phase);
+
+	load(img, steep);
+	blurAlongRows(slope, half, phase, border);
+	return store(format, steep);
+}
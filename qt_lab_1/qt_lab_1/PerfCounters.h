@@ -0,0 +1,237 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include "Trace.h"
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+// Hardware counters read around each Filter::process call
+enum PerfCounter
+{
+	PerfCycles,
+	PerfInstructions,
+	PerfCacheMisses,	// last level cache
+	PerfBranchMisses,
+	PerfCounterCount
+};
+
+struct PerfValues
+{
+	std::array<std::uint64_t, PerfCounterCount> value{};
+	std::array<bool, PerfCounterCount> valid{};
+};
+
+// Counters of the calling thread and of the threads it starts afterwards
+// (inherit), user space only so that the default perf_event_paranoid level
+// is enough. A child thread's counts are added when it exits, so band and
+// batch workers joined inside a process call are included. Counters the CPU or hypervisor does
+// not expose are simply left invalid.
+class PerfCounterGroup
+{
+#if defined(__linux__)
+	std::array<int, PerfCounterCount> fds;
+
+	static int openCounter(std::uint32_t type, std::uint64_t config, int group)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = group == -1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+	}
+#endif
+public:
+	std::string error;
+
+	PerfCounterGroup()
+	{
+#if defined(__linux__)
+		fds.fill(-1);
+		fds[PerfCycles] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+		if (fds[PerfCycles] < 0)
+		{
+			error = std::string("perf_event_open: ") + std::strerror(errno);
+			return;
+		}
+		int leader = fds[PerfCycles];
+		fds[PerfInstructions] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, leader);
+		fds[PerfCacheMisses] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, leader);
+		fds[PerfBranchMisses] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, leader);
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+		error = "hardware counters are only supported on Linux";
+#endif
+	}
+	PerfCounterGroup(const PerfCounterGroup&) = delete;
+	PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+	~PerfCounterGroup()
+	{
+#if defined(__linux__)
+		for (int fd : fds)
+			if (fd >= 0)
+				close(fd);
+#endif
+	}
+	bool isOpen() const { return error.empty(); }
+
+	// Running totals, scaled up when the kernel had to multiplex the counters
+	PerfValues read() const
+	{
+		PerfValues result;
+#if defined(__linux__)
+		for (int i = 0; i < PerfCounterCount; i++)
+		{
+			std::uint64_t data[3];
+			if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+				continue;
+			result.value[i] = data[2] < data[1] ? static_cast<std::uint64_t>(double(data[0]) * data[1] / data[2]) : data[0];
+			result.valid[i] = true;
+		}
+#endif
+		return result;
+	}
+};
+
+// Per filter class totals. Off by default; nested filters (Pipeline stages,
+// morphology built from erode/dilate) are counted inclusively, like TraceScope.
+// Work queued to threads that outlive the call, such as JobScheduler
+// workers, is counted by the scope on that thread instead.
+class PerfProfiler
+{
+	struct Row
+	{
+		int calls = 0;
+		qint64 pixels = 0;
+		PerfValues total;
+	};
+	std::mutex mutex;
+	std::map<std::string, Row> rows;
+	std::string error;
+
+	static std::atomic<bool>& flag()
+	{
+		static std::atomic<bool> value(false);
+		return value;
+	}
+public:
+	static PerfProfiler& instance()
+	{
+		static PerfProfiler profiler;
+		return profiler;
+	}
+	static bool enabled() { return flag().load(std::memory_order_relaxed); }
+	// Returns false (and stays disabled) when the counters cannot be opened
+	static bool setEnabled(bool value)
+	{
+		if (value && !group().isOpen())
+		{
+			std::cerr << "PerfProfiler: " << group().error << ", hardware counters disabled" << std::endl;
+			flag().store(false);
+			return false;
+		}
+		flag().store(value);
+		return true;
+	}
+	static const PerfCounterGroup& group()
+	{
+		thread_local PerfCounterGroup counters;
+		return counters;
+	}
+
+	void add(const std::string& name, const PerfValues& begin, const PerfValues& end, qint64 pixels)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Row& row = rows[name];
+		row.calls++;
+		row.pixels += pixels;
+		for (int i = 0; i < PerfCounterCount; i++)
+		{
+			if (!begin.valid[i] || !end.valid[i])
+				continue;
+			row.total.value[i] += end.value[i] - begin.value[i];
+			row.total.valid[i] = true;
+		}
+	}
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		rows.clear();
+	}
+	void printReport(std::ostream& out = std::cout);
+};
+
+inline void PerfProfiler::printReport(std::ostream& out)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto column = [&out](bool valid, double value)
+	{
+		if (valid)
+			out << std::setw(12) << value;
+		else
+			out << std::setw(12) << "n/a";
+	};
+	out << std::left << std::setw(32) << "filter" << std::right << std::setw(8) << "calls" << std::setw(12) << "Mcycles"
+		<< std::setw(12) << "IPC" << std::setw(12) << "cyc/pix" << std::setw(12) << "LLC/kpix" << std::setw(12) << "br/kpix" << "\n";
+	out << std::fixed << std::setprecision(2);
+	for (const auto& entry : rows)
+	{
+		const Row& row = entry.second;
+		const PerfValues& t = row.total;
+		double pixels = row.pixels > 0 ? double(row.pixels) : 1.0;
+		out << std::left << std::setw(32) << entry.first.substr(0, 31) << std::right << std::setw(8) << row.calls;
+		column(t.valid[PerfCycles], t.value[PerfCycles] / 1e6);
+		column(t.valid[PerfCycles] && t.valid[PerfInstructions] && t.value[PerfCycles] > 0,
+			double(t.value[PerfInstructions]) / t.value[PerfCycles]);
+		column(t.valid[PerfCycles], t.value[PerfCycles] / pixels);
+		column(t.valid[PerfCacheMisses], t.value[PerfCacheMisses] * 1e3 / pixels);
+		column(t.valid[PerfBranchMisses], t.value[PerfBranchMisses] * 1e3 / pixels);
+		out << "\n";
+	}
+	out.unsetf(std::ios::fixed);
+}
+
+// Reads the counters at construction and destruction and books the
+// difference on the filter class
+class PerfScope
+{
+	bool active;
+	const std::type_info& type;
+	PerfValues begin;
+	qint64 pixels = 0;
+public:
+	explicit PerfScope(const std::type_info& type) : active(PerfProfiler::enabled()), type(type)
+	{
+		if (active)
+			begin = PerfProfiler::group().read();
+	}
+	PerfScope(const PerfScope&) = delete;
+	PerfScope& operator=(const PerfScope&) = delete;
+	~PerfScope()
+	{
+		if (!active)
+			return;
+		PerfValues end = PerfProfiler::group().read();
+		PerfProfiler::instance().add(className(type), begin, end, pixels);
+	}
+	void addPixels(qint64 count) { pixels += count; }
+};
@@ -0,0 +1,218 @@
+﻿#pragma once
+#include <memory>
+#include <vector>
+#include "Filter.h"
+
+// Filters applied one after another. A pipeline is itself a Filter, so it
+// can be streamed, cropped or nested like any single stage. After a
+// desaturating stage the intermediate images are narrowed to Grayscale8,
+// and stay single-channel for as long as the following stages support it.
+// Intermediates live in two buffers used in turn: a local stage reads one
+// and writes the other, a point filter rewrites its input in place.
+class Pipeline : public Filter
+{
+protected:
+	std::vector<std::shared_ptr<const Filter>> stages;
+	QColor calcNewPixelColor(const QImage& img, int x, int y) const override;
+	QImage processImage(const QImage& img) const override;
+public:
+	Pipeline() = default;
+	Pipeline(std::initializer_list<std::shared_ptr<const Filter>> list) : stages(list) {}
+	Pipeline& add(std::shared_ptr<const Filter> stage)
+	{
+		stages.push_back(std::move(stage));
+		return *this;
+	}
+	template <class F, class... Args>
+	Pipeline& add(Args&&... args)
+	{
+		return add(std::make_shared<F>(std::forward<Args>(args)...));
+	}
+	std::size_t size() const { return stages.size(); }
+	const Filter& stage(std::size_t i) const { return *stages[i]; }
+	const std::shared_ptr<const Filter>& sharedStage(std::size_t i) const { return stages[i]; }
+
+	void processRegion(const QImage& img, const QRect& rect, QImage& dst) const override;
+	void processWindow(const QImage& img, const QPoint& origin, const QSize& size, const QRect& rect, QImage& dst) const override;
+	QMargins margins() const override;
+	bool isLocal() const override;
+	bool supportsGray() const override;
+	bool producesGray() const override;
+	QRect requiredRect(const QRect& rect, const QSize& size) const override;
+	void hashParams(ParamHash& hash) const override;
+	bool isDeterministic() const override;
+	std::shared_ptr<const Filter> scaled(float factor) const override;
+};
+
+QColor Pipeline::calcNewPixelColor(const QImage& img, int x, int y) const
+{
+	return process(img, QRect(x, y, 1, 1)).pixelColor(0, 0);
+}
+
+QImage Pipeline::processImage(const QImage& img) const
+{
+	// result shares the input until the first stage writes, spare is the other buffer
+	QImage result = img, spare;
+	for (const auto& stage : stages)
+	{
+		if (result.format() == QImage::Format_Grayscale8 && !stage->supportsGray())
+			result = result.convertToFormat(QImage::Format_RGB32);
+		if (stage->canProcessInPlace(result))
+			stage->apply(result);
+		else if (stage->isLocal())
+		{
+			QImage::Format format = stage->outputFormat(result);
+			if (spare.size() != result.size() || spare.format() != format)
+			{
+				spare = QImage(result.size(), format);
+				Tracer::countAllocation(spare.sizeInBytes());
+			}
+			TraceScope scope("stage", typeid(*stage));
+			scope.addPixels(qint64(result.width()) * result.height());
+			stage->processRegion(result, result.rect(), spare);
+			std::swap(result, spare);
+		}
+		else
+			result = stage->process(result);
+		if (stage->producesGray())
+			result = narrowToGray(result);
+	}
+	return result;
+}
+
+// Runs on the window rect depends on, so the intermediates are no larger than that
+void Pipeline::processRegion(const QImage& img, const QRect& rect, QImage& dst) const
+{
+	if (stages.empty() || rect.isEmpty())
+		return;
+	QRect area = requiredRect(rect, img.size());
+	if (isWindowable(dst))
+	{
+		QImage target = writableWindow(dst, area);
+		processWindow(windowOf(img, area), area.topLeft(), img.size(), rect, target);
+		return;
+	}
+	QImage part(area.size(), outputFormat(img));
+	processWindow(windowOf(img, area), area.topLeft(), img.size(), rect, part);
+	for (int y = rect.top(); y <= rect.bottom(); y++)
+		for (int x = rect.left(); x <= rect.right(); x++)
+			dst.setPixel(x, y, part.pixel(x - area.left(), y - area.top()));
+}
+
+void Pipeline::processWindow(const QImage& img, const QPoint& origin, const QSize& size, const QRect& rect, QImage& dst) const
+{
+	if (stages.empty())
+		return;
+	// Area each stage has to produce so that the later ones can compute rect
+	std::vector<QRect> areas(stages.size());
+	QRect area = rect;
+	for (std::size_t i = stages.size(); i-- > 0;)
+	{
+		areas[i] = area;
+		area = stages[i]->requiredRect(area, size);
+	}
+
+	// Stage i reads the window current, which starts at at, and writes a
+	// buffer of the same size, buffers[i % 2]; the next stage reads only the
+	// part of it holding areas[i], so the windows shrink stage by stage and
+	// the two buffers never outgrow the first one
+	QImage buffers[2];
+	QImage current = img;
+	QPoint at = origin;
+	for (std::size_t i = 0; i < stages.size(); i++)
+	{
+		TraceScope scope("stage", typeid(*stages[i]));
+		scope.addPixels(qint64(areas[i].width()) * areas[i].height());
+		if (i + 1 == stages.size())
+		{
+			QImage target = writableWindow(dst, QRect(at - origin, current.size()));
+			stages[i]->processWindow(current, at, size, areas[i], target);
+			break;
+		}
+		QImage& next = buffers[i % 2];
+		QImage::Format format = stages[i]->producesGray() ? QImage::Format_Grayscale8 : stages[i]->outputFormat(current);
+		if (next.width() < current.width() || next.height() < current.height() || next.format() != format)
+		{
+			next = QImage(current.size(), format);
+			if (next.isNull())
+				return;
+			Tracer::countAllocation(next.sizeInBytes());
+		}
+		QImage target = writableWindow(next, current.rect());
+		stages[i]->processWindow(current, at, size, areas[i], target);
+		current = windowOf(target, areas[i].translated(-at));
+		at = areas[i].topLeft();
+	}
+}
+
+QMargins Pipeline::margins() const
+{
+	QMargins total;
+	for (const auto& stage : stages)
+		total += stage->margins();
+	return total;
+}
+
+bool Pipeline::supportsGray() const
+{
+	for (const auto& stage : stages)
+		if (!stage->supportsGray())
+			return false;
+	return true;
+}
+
+bool Pipeline::producesGray() const
+{
+	bool gray = false;
+	for (const auto& stage : stages)
+		gray = stage->producesGray() || (gray && stage->supportsGray());
+	return gray;
+}
+
+QRect Pipeline::requiredRect(const QRect& rect, const QSize& size) const
+{
+	QRect area = rect;
+	for (std::size_t i = stages.size(); i-- > 0;)
+		area = stages[i]->requiredRect(area, size);
+	return area;
+}
+
+bool Pipeline::isLocal() const
+{
+	for (const auto& stage : stages)
+		if (!stage->isLocal())
+			return false;
+	return true;
+}
+
+void Pipeline::hashParams(ParamHash& hash) const
+{
+	for (const auto& stage : stages)
+	{
+		hash.add(className(typeid(*stage)));
+		stage->hashParams(hash);
+	}
+}
+
+bool Pipeline::isDeterministic() const
+{
+	for (const auto& stage : stages)
+		if (!stage->isDeterministic())
+			return false;
+	return true;
+}
+
+std::shared_ptr<const Filter> Pipeline::scaled(float factor) const
+{
+	auto result = std::make_shared<Pipeline>();
+	bool changed = false;
+	for (const auto& stage : stages)
+	{
+		auto scaledStage = stage->scaled(factor);
+		changed = changed || scaledStage;
+		result->add(scaledStage ? scaledStage : stage);
+	}
+	if (!changed)
+		return nullptr;
+	return result;
+}
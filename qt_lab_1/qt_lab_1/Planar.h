@@ -0,0 +1,561 @@
+﻿#pragma once
+#include <QImage>
+#include <QtGlobal>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "Pipeline.h"
+
+// Sample ranges of the deep planes. 16-bit planes span 0..65535 and are
+// clamped on every store; float planes take 1.0 as the white of an 8-bit
+// image and keep whatever the engines produce, above 1 and below 0 alike,
+// so a chain of filters quantizes nothing in between.
+template <class T> struct PlaneTraits;
+
+template <> struct PlaneTraits<quint16>
+{
+	static constexpr float white = 65535.f;
+	static quint16 store(float v) { return static_cast<quint16>(tclamp(v, white, 0.f) + 0.5f); }
+};
+
+template <> struct PlaneTraits<float>
+{
+	static constexpr float white = 1.f;
+	static float store(float v) { return v; }
+};
+
+// Image kept as one plane of T per channel: 1 for grey, 3 for RGB.
+// Channel c, row y starts at sample (c * height + y) * width.
+template <class T>
+class PlanarImage
+{
+	int w = 0, h = 0, planes = 0;
+	std::vector<T> samples;
+public:
+	PlanarImage() = default;
+	PlanarImage(int width, int height, int channels = 3)
+		: w(width), h(height), planes(channels), samples(static_cast<std::size_t>(width) * height * channels)
+	{
+		Tracer::countAllocation(samples.size() * sizeof(T));
+	}
+	int width() const { return w; }
+	int height() const { return h; }
+	QSize size() const { return QSize(w, h); }
+	int channelCount() const { return planes; }
+	bool isNull() const { return samples.empty(); }
+	T* row(int c, int y) { return samples.data() + (static_cast<std::size_t>(c) * h + y) * w; }
+	const T* row(int c, int y) const { return samples.data() + (static_cast<std::size_t>(c) * h + y) * w; }
+
+	// 8-bit images are scaled to the full range; RGBA64 and Grayscale16 are read as they are
+	static PlanarImage fromImage(const QImage& img);
+	// 8-bit copy for display: Grayscale8 for one channel, RGB32 otherwise
+	QImage toImage() const;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+	// 16 bits per channel: RGBX64, or Grayscale16 for one channel from Qt 5.13
+	QImage toDeepImage() const;
+#endif
+};
+
+template <class T>
+PlanarImage<T> PlanarImage<T>::fromImage(const QImage& img)
+{
+	const float scale8 = PlaneTraits<T>::white / 255.f;
+	if (img.format() == QImage::Format_Grayscale8)
+	{
+		PlanarImage result(img.width(), img.height(), 1);
+		for (int y = 0; y < img.height(); y++)
+		{
+			const uchar* src = img.constScanLine(y);
+			T* dst = result.row(0, y);
+			for (int x = 0; x < img.width(); x++)
+				dst[x] = PlaneTraits<T>::store(src[x] * scale8);
+		}
+		return result;
+	}
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+	if (img.format() == QImage::Format_Grayscale16)
+	{
+		const float scale16 = PlaneTraits<T>::white / 65535.f;
+		PlanarImage result(img.width(), img.height(), 1);
+		for (int y = 0; y < img.height(); y++)
+		{
+			const quint16* src = reinterpret_cast<const quint16*>(img.constScanLine(y));
+			T* dst = result.row(0, y);
+			for (int x = 0; x < img.width(); x++)
+				dst[x] = PlaneTraits<T>::store(src[x] * scale16);
+		}
+		return result;
+	}
+#endif
+	PlanarImage result(img.width(), img.height(), 3);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+	if (img.depth() == 64)
+	{
+		const float scale16 = PlaneTraits<T>::white / 65535.f;
+		QImage src = img.format() == QImage::Format_RGBX64 || img.format() == QImage::Format_RGBA64 ? img : img.convertToFormat(QImage::Format_RGBA64);
+		for (int y = 0; y < src.height(); y++)
+		{
+			const QRgba64* line = reinterpret_cast<const QRgba64*>(src.constScanLine(y));
+			T* r = result.row(0, y), * g = result.row(1, y), * b = result.row(2, y);
+			for (int x = 0; x < src.width(); x++)
+			{
+				r[x] = PlaneTraits<T>::store(line[x].red() * scale16);
+				g[x] = PlaneTraits<T>::store(line[x].green() * scale16);
+				b[x] = PlaneTraits<T>::store(line[x].blue() * scale16);
+			}
+		}
+		return result;
+	}
+#endif
+	QImage src = img.format() == workingFormat(img) ? img : img.convertToFormat(workingFormat(img));
+	for (int y = 0; y < src.height(); y++)
+	{
+		const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+		T* r = result.row(0, y), * g = result.row(1, y), * b = result.row(2, y);
+		for (int x = 0; x < src.width(); x++)
+		{
+			r[x] = PlaneTraits<T>::store(qRed(line[x]) * scale8);
+			g[x] = PlaneTraits<T>::store(qGreen(line[x]) * scale8);
+			b[x] = PlaneTraits<T>::store(qBlue(line[x]) * scale8);
+		}
+	}
+	return result;
+}
+
+template <class T>
+QImage PlanarImage<T>::toImage() const
+{
+	const float scale = 255.f / PlaneTraits<T>::white;
+	auto narrow = [scale](T v) { return static_cast<int>(tclamp(v * scale + 0.5f, 255.f, 0.f)); };
+	QImage result(w, h, planes == 1 ? QImage::Format_Grayscale8 : QImage::Format_RGB32);
+	for (int y = 0; y < h; y++)
+	{
+		if (planes == 1)
+		{
+			uchar* dst = result.scanLine(y);
+			const T* src = row(0, y);
+			for (int x = 0; x < w; x++)
+				dst[x] = static_cast<uchar>(narrow(src[x]));
+			continue;
+		}
+		QRgb* dst = reinterpret_cast<QRgb*>(result.scanLine(y));
+		const T* r = row(0, y), * g = row(1, y), * b = row(2, y);
+		for (int x = 0; x < w; x++)
+			dst[x] = qRgb(narrow(r[x]), narrow(g[x]), narrow(b[x]));
+	}
+	return result;
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+template <class T>
+QImage PlanarImage<T>::toDeepImage() const
+{
+	const float scale = 65535.f / PlaneTraits<T>::white;
+	auto widen = [scale](T v) { return static_cast<quint16>(tclamp(v * scale + 0.5f, 65535.f, 0.f)); };
+#if QT_VERSION >= QT_VERSION_CHECK(5, 13, 0)
+	if (planes == 1)
+	{
+		QImage result(w, h, QImage::Format_Grayscale16);
+		for (int y = 0; y < h; y++)
+		{
+			quint16* dst = reinterpret_cast<quint16*>(result.scanLine(y));
+			const T* src = row(0, y);
+			for (int x = 0; x < w; x++)
+				dst[x] = widen(src[x]);
+		}
+		return result;
+	}
+#endif
+	QImage result(w, h, QImage::Format_RGBX64);
+	for (int y = 0; y < h; y++)
+	{
+		QRgba64* dst = reinterpret_cast<QRgba64*>(result.scanLine(y));
+		const T* r = row(0, y), * g = row(planes == 1 ? 0 : 1, y), * b = row(planes == 1 ? 0 : 2, y);
+		for (int x = 0; x < w; x++)
+			dst[x] = qRgba64(widen(r[x]), widen(g[x]), widen(b[x]), 65535);
+	}
+	return result;
+}
+#endif
+
+// One channel with padX / padY samples of border around it, the deep
+// counterpart of PaddedPlane: row(y)[x] is valid for x in [-padX, width + padX)
+// and y in [-padY, height + padY).
+template <class T>
+class PaddedSamples
+{
+	std::vector<T> samples;
+	int padX, padY, stride;
+public:
+	PaddedSamples(const PlanarImage<T>& img, int c, int padX, int padY, const BorderPolicy& border);
+	const T* row(int y) const { return samples.data() + static_cast<std::size_t>(y + padY) * stride + padX; }
+};
+
+template <class T>
+PaddedSamples<T>::PaddedSamples(const PlanarImage<T>& img, int c, int padX, int padY, const BorderPolicy& border)
+	: padX(padX), padY(padY), stride(img.width() + 2 * padX)
+{
+	samples.resize(static_cast<std::size_t>(stride) * (img.height() + 2 * padY));
+	Tracer::countAllocation(samples.size() * sizeof(T));
+	int channel = img.channelCount() == 1 ? qGray(border.color) : c == 0 ? qRed(border.color) : c == 1 ? qGreen(border.color) : qBlue(border.color);
+	T constant = PlaneTraits<T>::store(channel * PlaneTraits<T>::white / 255.f);
+	for (int py = 0; py < img.height() + 2 * padY; py++)
+	{
+		T* dst = samples.data() + static_cast<std::size_t>(py) * stride;
+		int sy = borderIndex(py - padY, img.height(), border.mode);
+		if (sy < 0)
+		{
+			std::fill(dst, dst + stride, constant);
+			continue;
+		}
+		const T* line = img.row(c, sy);
+		std::copy(line, line + img.width(), dst + padX);
+		for (int px = 0; px < padX; px++)
+		{
+			int left = borderIndex(px - padX, img.width(), border.mode);
+			int right = borderIndex(img.width() + px, img.width(), border.mode);
+			dst[px] = left < 0 ? constant : line[left];
+			dst[padX + img.width() + px] = right < 0 ? constant : line[right];
+		}
+	}
+}
+
+// Row primitives of the engines, one SIMD kernel per sample type:
+// accumulate adds w * src to a float row, store narrows it back, and
+// maxRow / minRow fold a source row into dst.
+template <class T> struct PlanarRows;
+
+template <> struct PlanarRows<float>
+{
+	static void accumulate(const float* src, float w, float* acc, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		const __m128 weight = _mm_set1_ps(w);
+		for (; x + 4 <= n; x += 4)
+			_mm_storeu_ps(acc + x, _mm_add_ps(_mm_loadu_ps(acc + x), _mm_mul_ps(_mm_loadu_ps(src + x), weight)));
+#endif
+		for (; x < n; x++)
+			acc[x] += src[x] * w;
+	}
+	static void store(const float* acc, float* dst, int n) { std::memcpy(dst, acc, n * sizeof(float)); }
+	static void maxRow(const float* src, float* dst, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		for (; x + 4 <= n; x += 4)
+			_mm_storeu_ps(dst + x, _mm_max_ps(_mm_loadu_ps(dst + x), _mm_loadu_ps(src + x)));
+#endif
+		for (; x < n; x++)
+			dst[x] = std::max(dst[x], src[x]);
+	}
+	static void minRow(const float* src, float* dst, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		for (; x + 4 <= n; x += 4)
+			_mm_storeu_ps(dst + x, _mm_min_ps(_mm_loadu_ps(dst + x), _mm_loadu_ps(src + x)));
+#endif
+		for (; x < n; x++)
+			dst[x] = std::min(dst[x], src[x]);
+	}
+};
+
+// SSE2 has no unsigned 16-bit min / max or saturating 32 -> u16 pack, so
+// both go through signed lanes offset by 0x8000
+template <> struct PlanarRows<quint16>
+{
+	static void accumulate(const quint16* src, float w, float* acc, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		const __m128 weight = _mm_set1_ps(w);
+		const __m128i zero = _mm_setzero_si128();
+		for (; x + 8 <= n; x += 8)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+			__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+			__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+			_mm_storeu_ps(acc + x, _mm_add_ps(_mm_loadu_ps(acc + x), _mm_mul_ps(lo, weight)));
+			_mm_storeu_ps(acc + x + 4, _mm_add_ps(_mm_loadu_ps(acc + x + 4), _mm_mul_ps(hi, weight)));
+		}
+#endif
+		for (; x < n; x++)
+			acc[x] += src[x] * w;
+	}
+	static void store(const float* acc, quint16* dst, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(65535.f), round = _mm_set1_ps(0.5f);
+		const __m128i offset = _mm_set1_epi32(0x8000), sign = _mm_set1_epi16(static_cast<short>(0x8000));
+		auto lane = [&](const float* p) { return _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), zero), top), round)), offset); };
+		for (; x + 8 <= n; x += 8)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_xor_si128(_mm_packs_epi32(lane(acc + x), lane(acc + x + 4)), sign));
+#endif
+		for (; x < n; x++)
+			dst[x] = PlaneTraits<quint16>::store(acc[x]);
+	}
+	static void maxRow(const quint16* src, quint16* dst, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		const __m128i sign = _mm_set1_epi16(static_cast<short>(0x8000));
+		for (; x + 8 <= n; x += 8)
+		{
+			__m128i a = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x)), sign);
+			__m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)), sign);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_xor_si128(_mm_max_epi16(a, b), sign));
+		}
+#endif
+		for (; x < n; x++)
+			dst[x] = std::max(dst[x], src[x]);
+	}
+	static void minRow(const quint16* src, quint16* dst, int n)
+	{
+		int x = 0;
+#ifdef COLORSPACE_SSE2
+		const __m128i sign = _mm_set1_epi16(static_cast<short>(0x8000));
+		for (; x + 8 <= n; x += 8)
+		{
+			__m128i a = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x)), sign);
+			__m128i b = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)), sign);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_xor_si128(_mm_min_epi16(a, b), sign));
+		}
+#endif
+		for (; x < n; x++)
+			dst[x] = std::min(dst[x], src[x]);
+	}
+};
+
+// Correlation with a tap list, one source row per tap added into a float row
+template <class T>
+PlanarImage<T> correlatePlanar(const PlanarImage<T>& img, const std::vector<KernelTap>& taps, int padX, int padY, const BorderPolicy& border)
+{
+	TraceScope scope("planar", "correlate");
+	scope.addPixels(qint64(img.width()) * img.height() * img.channelCount());
+	PlanarImage<T> result(img.width(), img.height(), img.channelCount());
+	std::vector<float> acc(img.width());
+	for (int c = 0; c < img.channelCount(); c++)
+	{
+		PaddedSamples<T> src(img, c, padX, padY, border);
+		for (int y = 0; y < img.height(); y++)
+		{
+			std::fill(acc.begin(), acc.end(), 0.f);
+			for (const KernelTap& tap : taps)
+				PlanarRows<T>::accumulate(src.row(y + tap.dy) + tap.dx, tap.weight, acc.data(), img.width());
+			PlanarRows<T>::store(acc.data(), result.row(c, y), img.width());
+		}
+	}
+	return result;
+}
+
+template <class T>
+PlanarImage<T> convolvePlanar(const PlanarImage<T>& img, const Kernel& kernel, const BorderPolicy& border = BorderPolicy())
+{
+	Kernel compacted(kernel);
+	int radius = static_cast<int>(kernel.getRadius());
+	return correlatePlanar(img, compacted.getTaps(), radius, radius, border);
+}
+
+// Separable Gaussian of radius 3 sigma, a row pass then a column pass
+template <class T>
+PlanarImage<T> gaussianPlanar(const PlanarImage<T>& img, float sigma, const BorderPolicy& border = BorderPolicy())
+{
+	int radius = static_cast<int>(std::max(1.f, std::ceil(3 * sigma)));
+	std::vector<KernelTap> rows, columns;
+	float norm = 0;
+	for (int i = -radius; i <= radius; i++)
+		norm += std::exp(-(i * i) / (2 * sigma * sigma));
+	for (int i = -radius; i <= radius; i++)
+	{
+		float weight = std::exp(-(i * i) / (2 * sigma * sigma)) / norm;
+		rows.push_back({ i, 0, weight });
+		columns.push_back({ 0, i, weight });
+	}
+	return correlatePlanar(correlatePlanar(img, rows, radius, 0, border), columns, 0, radius, border);
+}
+
+// Dilation (max) or erosion (min) over the nonzero taps of mask
+template <class T>
+PlanarImage<T> morphologyPlanar(const PlanarImage<T>& img, const Kernel& mask, bool dilate, const BorderPolicy& border = BorderPolicy())
+{
+	TraceScope scope("planar", dilate ? "dilate" : "erode");
+	scope.addPixels(qint64(img.width()) * img.height() * img.channelCount());
+	Kernel compacted(mask);
+	const std::vector<KernelTap>& taps = compacted.getTaps();
+	int radius = static_cast<int>(mask.getRadius());
+	PlanarImage<T> result(img.width(), img.height(), img.channelCount());
+	for (int c = 0; c < img.channelCount(); c++)
+	{
+		PaddedSamples<T> src(img, c, radius, radius, border);
+		for (int y = 0; y < img.height(); y++)
+		{
+			T* dst = result.row(c, y);
+			// An empty mask gives what the 8-bit filters start from
+			std::fill(dst, dst + img.width(), dilate ? T(0) : PlaneTraits<T>::store(PlaneTraits<T>::white));
+			for (const KernelTap& tap : taps)
+			{
+				const T* line = src.row(y + tap.dy) + tap.dx;
+				if (dilate)
+					PlanarRows<T>::maxRow(line, dst, img.width());
+				else
+					PlanarRows<T>::minRow(line, dst, img.width());
+			}
+		}
+	}
+	return result;
+}
+
+template <class T>
+PlanarImage<T> medianPlanar(const PlanarImage<T>& img, int radius, const BorderPolicy& border = BorderPolicy())
+{
+	TraceScope scope("planar", "median");
+	scope.addPixels(qint64(img.width()) * img.height() * img.channelCount());
+	PlanarImage<T> result(img.width(), img.height(), img.channelCount());
+	int size = 2 * radius + 1;
+	std::vector<T> window(size * size);
+	std::size_t mid = window.size() / 2;
+	for (int c = 0; c < img.channelCount(); c++)
+	{
+		PaddedSamples<T> src(img, c, radius, radius, border);
+		for (int y = 0; y < img.height(); y++)
+		{
+			T* dst = result.row(c, y);
+			for (int x = 0; x < img.width(); x++)
+			{
+				auto it = window.begin();
+				for (int i = -radius; i <= radius; i++)
+					it = std::copy(src.row(y + i) + x - radius, src.row(y + i) + x + radius + 1, it);
+				std::nth_element(window.begin(), window.begin() + mid, window.end());
+				dst[x] = window[mid];
+			}
+		}
+	}
+	return result;
+}
+
+struct ChannelStats
+{
+	double mean = 0;
+	float min = 0, max = 0;
+};
+
+template <class T>
+std::vector<ChannelStats> planarStats(const PlanarImage<T>& img)
+{
+	std::vector<ChannelStats> stats(img.channelCount());
+	if (img.isNull())
+		return stats;
+	for (int c = 0; c < img.channelCount(); c++)
+	{
+		double sum = 0;
+		T low = img.row(c, 0)[0], high = low;
+		for (int y = 0; y < img.height(); y++)
+		{
+			const T* line = img.row(c, y);
+			double rowSum = 0;
+			for (int x = 0; x < img.width(); x++)
+			{
+				rowSum += line[x];
+				low = std::min(low, line[x]);
+				high = std::max(high, line[x]);
+			}
+			sum += rowSum;
+		}
+		stats[c].mean = sum / (double(img.width()) * img.height());
+		stats[c].min = low;
+		stats[c].max = high;
+	}
+	return stats;
+}
+
+// GreyWorldFilter: every channel scaled so its mean meets the mean of all three
+template <class T>
+void greyWorldPlanar(PlanarImage<T>& img)
+{
+	std::vector<ChannelStats> stats = planarStats(img);
+	double avg = 0;
+	for (const ChannelStats& s : stats)
+		avg += s.mean / stats.size();
+	for (int c = 0; c < img.channelCount(); c++)
+	{
+		float gain = stats[c].mean > 0 ? static_cast<float>(avg / stats[c].mean) : 1.f;
+		for (int y = 0; y < img.height(); y++)
+		{
+			T* line = img.row(c, y);
+			for (int x = 0; x < img.width(); x++)
+				line[x] = PlaneTraits<T>::store(line[x] * gain);
+		}
+	}
+}
+
+// HistogrammFilter: luma stretched over the full range into one channel.
+// As there, the range starts at 0 rather than at the darkest pixel.
+template <class T>
+PlanarImage<T> stretchPlanar(const PlanarImage<T>& img)
+{
+	auto luma = [&img](int x, int y)
+	{
+		return img.channelCount() == 1 ? float(img.row(0, y)[x])
+			: LumaR * img.row(0, y)[x] + LumaG * img.row(1, y)[x] + LumaB * img.row(2, y)[x];
+	};
+	float low = 0, high = 0;
+	for (int y = 0; y < img.height(); y++)
+		for (int x = 0; x < img.width(); x++)
+		{
+			low = std::min(low, luma(x, y));
+			high = std::max(high, luma(x, y));
+		}
+	float gain = high > low ? PlaneTraits<T>::white / (high - low) : 0.f;
+	PlanarImage<T> result(img.width(), img.height(), 1);
+	for (int y = 0; y < img.height(); y++)
+	{
+		T* dst = result.row(0, y);
+		for (int x = 0; x < img.width(); x++)
+			dst[x] = PlaneTraits<T>::store((luma(x, y) - low) * gain);
+	}
+	return result;
+}
+
+// Runs filter on a deep image without going through 8 bits. Matrix filters
+// (convolution, dilation, erosion), both Gaussians, median, grey world,
+// histogram stretch and pipelines made of them are supported; for anything
+// else it returns false and leaves img as it was.
+template <class T>
+bool processPlanar(const Filter& filter, PlanarImage<T>& img)
+{
+	if (const Pipeline* pipeline = dynamic_cast<const Pipeline*>(&filter))
+	{
+		PlanarImage<T> result = img;
+		for (std::size_t i = 0; i < pipeline->size(); i++)
+			if (!processPlanar(pipeline->stage(i), result))
+				return false;
+		img = std::move(result);
+		return true;
+	}
+	if (const MatrixFilter* matrix = dynamic_cast<const MatrixFilter*>(&filter))
+	{
+		if (const MotionBlurFilter* motion = dynamic_cast<const MotionBlurFilter*>(matrix))
+			img = convolvePlanar(img, motion->denseKernel(), matrix->getBorder());
+		else if (matrix->isLinear())
+			img = convolvePlanar(img, matrix->getKernel(), matrix->getBorder());
+		else if (dynamic_cast<const DilationFilter*>(matrix) || dynamic_cast<const ErosionFilter*>(matrix))
+			img = morphologyPlanar(img, matrix->getKernel(), dynamic_cast<const DilationFilter*>(matrix) != nullptr, matrix->getBorder());
+		else
+			return false;
+		return true;
+	}
+	if (const RecursiveGaussianFilter* gaussian = dynamic_cast<const RecursiveGaussianFilter*>(&filter))
+		img = gaussianPlanar(img, gaussian->getSigma(), gaussian->getBorder());
+	else if (const MedianFilter* median = dynamic_cast<const MedianFilter*>(&filter))
+		img = medianPlanar(img, median->getRadius(), median->getBorder());
+	else if (dynamic_cast<const GreyWorldFilter*>(&filter))
+		greyWorldPlanar(img);
+	else if (dynamic_cast<const HistogrammFilter*>(&filter))
+		img = stretchPlanar(img);
+	else
+		return false;
+	return true;
+}
@@ -0,0 +1,304 @@
+﻿#pragma once
+#include <QImage>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Async.h"
+#include "Filter.h"
+
+// Gaussian pyramid: level 0 is the image, every further level is blurred
+// with the 5-tap binomial kernel (1 4 6 4 1) / 16 and decimated by two.
+// Grayscale8 stays grey, anything else is kept in workingFormat; channels
+// are filtered byte by byte, alpha included.
+class GaussianPyramid
+{
+	std::vector<QImage> levels;
+public:
+	GaussianPyramid() = default;
+	// Halves until the longer side would drop below minSide
+	explicit GaussianPyramid(const QImage& img, int minSide = 64);
+	int count() const { return static_cast<int>(levels.size()); }
+	const QImage& level(int i) const { return levels[i]; }
+	// Coarsest level whose longer side is still at least side
+	int levelFor(int side) const;
+	// Scale of level i relative to level 0
+	static float factor(int level) { return std::ldexp(1.f, -level); }
+
+	static QImage reduce(const QImage& img);
+	// Bilinear upsampling to size, pixel centres aligned
+	static QImage expand(const QImage& img, const QSize& size);
+};
+
+// Band-pass decomposition: band i = level i - expand(level i + 1), with the
+// coarsest Gaussian level on top. collapse() restores level 0 exactly.
+class LaplacianPyramid
+{
+	std::vector<std::vector<float>> bands;	// bytes of each pixel, as laid out in the scanlines
+	std::vector<QSize> sizes;
+	QImage top;
+public:
+	LaplacianPyramid() = default;
+	explicit LaplacianPyramid(const GaussianPyramid& gaussian);
+	int count() const { return static_cast<int>(bands.size()) + 1; }
+	const std::vector<float>& band(int i) const { return bands[i]; }
+	std::vector<float>& band(int i) { return bands[i]; }
+	const QImage& coarsest() const { return top; }
+	QImage collapse() const;
+};
+
+inline GaussianPyramid::GaussianPyramid(const QImage& img, int minSide)
+{
+	QImage base = img.format() == QImage::Format_Grayscale8 || img.format() == workingFormat(img) ? img : img.convertToFormat(workingFormat(img));
+	levels.push_back(base);
+	while (std::max(levels.back().width(), levels.back().height()) / 2 >= minSide)
+		levels.push_back(reduce(levels.back()));
+}
+
+inline int GaussianPyramid::levelFor(int side) const
+{
+	int result = 0;
+	while (result + 1 < count() && std::max(levels[result + 1].width(), levels[result + 1].height()) >= side)
+		result++;
+	return result;
+}
+
+inline QImage GaussianPyramid::reduce(const QImage& img)
+{
+	static const int weights[5] = { 1, 4, 6, 4, 1 };
+	TraceScope scope("pyramid", "reduce");
+	int width = img.width(), height = img.height();
+	int bpp = img.depth() / 8;
+	QImage result((width + 1) / 2, (height + 1) / 2, img.format());
+	Tracer::countAllocation(result.sizeInBytes());
+	scope.addPixels(qint64(width) * height);
+	std::vector<int> column(static_cast<std::size_t>(width) * bpp);
+	for (int y = 0; y < result.height(); y++)
+	{
+		// Vertical pass over the five source rows around 2y, edges replicated
+		std::fill(column.begin(), column.end(), 0);
+		for (int k = 0; k < 5; k++)
+		{
+			const uchar* line = img.constScanLine(std::min(std::max(2 * y + k - 2, 0), height - 1));
+			for (std::size_t i = 0; i < column.size(); i++)
+				column[i] += weights[k] * line[i];
+		}
+		uchar* dst = result.scanLine(y);
+		for (int x = 0; x < result.width(); x++)
+			for (int c = 0; c < bpp; c++)
+			{
+				int sum = 0;
+				for (int k = 0; k < 5; k++)
+					sum += weights[k] * column[std::min(std::max(2 * x + k - 2, 0), width - 1) * bpp + c];
+				dst[x * bpp + c] = static_cast<uchar>((sum + 128) >> 8);
+			}
+	}
+	return result;
+}
+
+inline QImage GaussianPyramid::expand(const QImage& img, const QSize& size)
+{
+	TraceScope scope("pyramid", "expand");
+	int bpp = img.depth() / 8;
+	QImage result(size, img.format());
+	Tracer::countAllocation(result.sizeInBytes());
+	scope.addPixels(qint64(size.width()) * size.height());
+	float sx = float(img.width()) / size.width(), sy = float(img.height()) / size.height();
+	std::vector<int> x0(size.width()), x1(size.width());
+	std::vector<float> fx(size.width());
+	for (int x = 0; x < size.width(); x++)
+	{
+		float u = std::min(std::max((x + 0.5f) * sx - 0.5f, 0.f), float(img.width() - 1));
+		x0[x] = static_cast<int>(u);
+		x1[x] = std::min(x0[x] + 1, img.width() - 1);
+		fx[x] = u - x0[x];
+	}
+	for (int y = 0; y < size.height(); y++)
+	{
+		float v = std::min(std::max((y + 0.5f) * sy - 0.5f, 0.f), float(img.height() - 1));
+		int y0 = static_cast<int>(v);
+		float fy = v - y0;
+		const uchar* a = img.constScanLine(y0);
+		const uchar* b = img.constScanLine(std::min(y0 + 1, img.height() - 1));
+		uchar* dst = result.scanLine(y);
+		for (int x = 0; x < size.width(); x++)
+			for (int c = 0; c < bpp; c++)
+			{
+				float top = a[x0[x] * bpp + c] + (a[x1[x] * bpp + c] - a[x0[x] * bpp + c]) * fx[x];
+				float bottom = b[x0[x] * bpp + c] + (b[x1[x] * bpp + c] - b[x0[x] * bpp + c]) * fx[x];
+				dst[x * bpp + c] = static_cast<uchar>(top + (bottom - top) * fy + 0.5f);
+			}
+	}
+	return result;
+}
+
+inline LaplacianPyramid::LaplacianPyramid(const GaussianPyramid& gaussian)
+{
+	for (int i = 0; i + 1 < gaussian.count(); i++)
+	{
+		const QImage& fine = gaussian.level(i);
+		QImage predicted = GaussianPyramid::expand(gaussian.level(i + 1), fine.size());
+		int rowBytes = fine.width() * fine.depth() / 8;
+		std::vector<float> band(static_cast<std::size_t>(rowBytes) * fine.height());
+		for (int y = 0; y < fine.height(); y++)
+		{
+			const uchar* f = fine.constScanLine(y);
+			const uchar* p = predicted.constScanLine(y);
+			float* dst = band.data() + static_cast<std::size_t>(y) * rowBytes;
+			for (int i = 0; i < rowBytes; i++)
+				dst[i] = float(f[i]) - p[i];
+		}
+		bands.push_back(std::move(band));
+		sizes.push_back(fine.size());
+	}
+	top = gaussian.level(gaussian.count() - 1);
+}
+
+inline QImage LaplacianPyramid::collapse() const
+{
+	QImage result = top;
+	for (std::size_t i = bands.size(); i-- > 0;)
+	{
+		result = GaussianPyramid::expand(result, sizes[i]);
+		int rowBytes = result.width() * result.depth() / 8;
+		for (int y = 0; y < result.height(); y++)
+		{
+			uchar* dst = result.scanLine(y);
+			const float* band = bands[i].data() + static_cast<std::size_t>(y) * rowBytes;
+			for (int x = 0; x < rowBytes; x++)
+				dst[x] = static_cast<uchar>(tclamp(dst[x] + band[x] + 0.5f, 255.f, 0.f));
+		}
+	}
+	return result;
+}
+
+// Pyramids of the last few images, keyed by QImage::cacheKey(), so that
+// re-filtering the same image with tweaked parameters skips the reduction
+class PyramidCache
+{
+	std::mutex mutex;
+	std::list<std::pair<qint64, std::shared_ptr<const GaussianPyramid>>> entries;	// most recent first
+	std::size_t capacity;
+	int minSide;
+public:
+	explicit PyramidCache(std::size_t capacity = 4, int minSide = 64) : capacity(capacity), minSide(minSide) {}
+	std::shared_ptr<const GaussianPyramid> get(const QImage& img);
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.clear();
+	}
+};
+
+inline std::shared_ptr<const GaussianPyramid> PyramidCache::get(const QImage& img)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto it = entries.begin(); it != entries.end(); ++it)
+			if (it->first == img.cacheKey())
+			{
+				entries.splice(entries.begin(), entries, it);
+				return it->second;
+			}
+	}
+	auto pyramid = std::make_shared<const GaussianPyramid>(img, minSide);
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.emplace_front(img.cacheKey(), pyramid);
+	if (entries.size() > capacity)
+		entries.pop_back();
+	return pyramid;
+}
+
+// Interactive preview of a filter on a large image. request() filters the
+// pyramid level nearest to previewSide in the calling thread and returns
+// it; the finer levels are then filtered coarse to fine on the scheduler,
+// each with the filter scaled to its octave, and handed to the update
+// callback. A new request() cancels the refinement still in flight, while
+// the pyramid of an unchanged image is reused.
+class ProgressivePreview
+{
+public:
+	// level 0 is full resolution; called on a worker thread, never with a
+	// coarser level after a finer one of the same request
+	typedef std::function<void(const QImage& image, int level)> UpdateCallback;
+private:
+	struct Request
+	{
+		std::mutex mutex;
+		int finest;
+		bool cancelled = false;
+		UpdateCallback update;
+	};
+	JobScheduler& scheduler;
+	PyramidCache pyramids;
+	int previewSide;
+	std::shared_ptr<Request> current;
+	std::vector<JobScheduler::Handle> pending;
+public:
+	ProgressivePreview(JobScheduler& scheduler, int previewSide = 512, std::size_t cachedImages = 4)
+		: scheduler(scheduler), pyramids(cachedImages, previewSide), previewSide(previewSide) {}
+	~ProgressivePreview() { cancel(); }
+	ProgressivePreview(const ProgressivePreview&) = delete;
+	ProgressivePreview& operator=(const ProgressivePreview&) = delete;
+
+	QImage request(const QImage& img, std::shared_ptr<const Filter> filter, UpdateCallback update);
+	void cancel();
+	// filter with its parameters scaled to the given pyramid level
+	static std::shared_ptr<const Filter> forLevel(const std::shared_ptr<const Filter>& filter, int level)
+	{
+		if (level == 0)
+			return filter;
+		auto scaled = filter->scaled(GaussianPyramid::factor(level));
+		return scaled ? scaled : filter;
+	}
+};
+
+inline QImage ProgressivePreview::request(const QImage& img, std::shared_ptr<const Filter> filter, UpdateCallback update)
+{
+	cancel();
+	auto pyramid = pyramids.get(img);
+	int coarse = pyramid->levelFor(previewSide);
+	QImage preview = forLevel(filter, coarse)->process(pyramid->level(coarse));
+
+	auto state = std::make_shared<Request>();
+	state->finest = coarse;
+	state->update = std::move(update);
+	current = state;
+	for (int level = coarse - 1; level >= 0; level--)
+	{
+		auto scaled = forLevel(filter, level);
+		JobOptions options;
+		options.priority = level > 0 ? JobPriority::Interactive : JobPriority::Normal;
+		options.completion = [state, level](const JobResult& result)
+		{
+			if (!result.succeeded())
+				return;
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (state->cancelled || level >= state->finest)
+				return;
+			state->finest = level;
+			if (state->update)
+				state->update(result.image, level);
+		};
+		// The scheduler hands images straight to processRegion, so colour filters get colour input
+		const QImage& source = pyramid->level(level);
+		pending.push_back(scheduler.submit(source.format() == QImage::Format_Grayscale8 && !scaled->supportsGray()
+			? source.convertToFormat(QImage::Format_RGB32) : source, scaled, options));
+	}
+	return preview;
+}
+
+inline void ProgressivePreview::cancel()
+{
+	for (auto& handle : pending)
+		handle.cancel();
+	pending.clear();
+	// A job past its last strip can still complete; its result is dropped
+	if (current)
+	{
+		std::lock_guard<std::mutex> lock(current->mutex);
+		current->cancelled = true;
+	}
+	current = nullptr;
+}
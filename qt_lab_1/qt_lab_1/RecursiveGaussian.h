@@ -0,0 +1,171 @@
+﻿#pragma once
+#include <QImage>
+#include <vector>
+#include <cmath>
+#include "Border.h"
+
+// Third-order recursive Gaussian of Young and van Vliet ("Recursive
+// implementation of the Gaussian filter", 1995). A causal and an
+// anti-causal pass along rows, then along columns; the cost per pixel does
+// not depend on sigma. Defined for sigma >= 0.5, but only close to the true
+// Gaussian from about sigma 2 on.
+struct YoungVanVliet
+{
+	float B, b1, b2, b3;	// b1..b3 already divided by b0
+
+	explicit YoungVanVliet(float sigma)
+	{
+		double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+		double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+		b1 = static_cast<float>((2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0);
+		b2 = static_cast<float>(-(1.4281 * q * q + 1.26661 * q * q * q) / b0);
+		b3 = static_cast<float>(0.422205 * q * q * q / b0);
+		B = 1 - (b1 + b2 + b3);
+	}
+};
+
+class RecursiveGaussian
+{
+	typedef std::vector<float> Plane;
+	int width = 0, height = 0, channels = 0;
+	Plane planes[3];
+
+	void blurRows(const YoungVanVliet& c, int margin, const BorderPolicy& border);
+	void blurColumns(const YoungVanVliet& c, int margin, const BorderPolicy& border);
+public:
+	// Grayscale8 stays single-channel, everything else comes back in workingFormat
+	QImage process(const QImage& img, float sigma, const BorderPolicy& border = BorderPolicy());
+	// How far the border is extended before the passes start
+	static int margin(float sigma) { return static_cast<int>(std::ceil(4 * sigma)) + 3; }
+};
+
+inline void RecursiveGaussian::blurRows(const YoungVanVliet& c, int margin, const BorderPolicy& border)
+{
+	int span = width + 2 * margin;
+	std::vector<float> line(span);
+	for (int ch = 0; ch < channels; ch++)
+	{
+		float constant = channels == 1 ? float(qGray(border.color)) : float((border.color >> (16 - 8 * ch)) & 0xff);
+		for (int y = 0; y < height; y++)
+		{
+			float* row = planes[ch].data() + static_cast<std::size_t>(y) * width;
+			for (int i = 0; i < span; i++)
+			{
+				int x = borderIndex(i - margin, width, border.mode);
+				line[i] = x < 0 ? constant : row[x];
+			}
+			float w1 = line[0], w2 = line[0], w3 = line[0];
+			for (int i = 0; i < span; i++)
+			{
+				float w = c.B * line[i] + c.b1 * w1 + c.b2 * w2 + c.b3 * w3;
+				w3 = w2;
+				w2 = w1;
+				w1 = line[i] = w;
+			}
+			w1 = w2 = w3 = line[span - 1];
+			for (int i = span - 1; i >= 0; i--)
+			{
+				float w = c.B * line[i] + c.b1 * w1 + c.b2 * w2 + c.b3 * w3;
+				w3 = w2;
+				w2 = w1;
+				w1 = line[i] = w;
+			}
+			std::copy(line.begin() + margin, line.begin() + margin + width, row);
+		}
+	}
+}
+
+// All columns at once, row by row, so every pass streams through memory
+inline void RecursiveGaussian::blurColumns(const YoungVanVliet& c, int margin, const BorderPolicy& border)
+{
+	int span = height + 2 * margin;
+	std::vector<float> buffer(static_cast<std::size_t>(span) * width);
+	Tracer::countAllocation(buffer.size() * sizeof(float));
+	for (int ch = 0; ch < channels; ch++)
+	{
+		float constant = channels == 1 ? float(qGray(border.color)) : float((border.color >> (16 - 8 * ch)) & 0xff);
+		Plane& plane = planes[ch];
+		for (int r = 0; r < span; r++)
+		{
+			int y = borderIndex(r - margin, height, border.mode);
+			float* dst = buffer.data() + static_cast<std::size_t>(r) * width;
+			if (y < 0)
+				std::fill(dst, dst + width, constant);
+			else
+				std::copy_n(plane.data() + static_cast<std::size_t>(y) * width, width, dst);
+		}
+		// Rows before the first and after the last are taken to be in steady state
+		for (int r = 1; r < span; r++)
+		{
+			float* w0 = buffer.data() + static_cast<std::size_t>(r) * width;
+			const float* w1 = buffer.data() + static_cast<std::size_t>(std::max(r - 1, 0)) * width;
+			const float* w2 = buffer.data() + static_cast<std::size_t>(std::max(r - 2, 0)) * width;
+			const float* w3 = buffer.data() + static_cast<std::size_t>(std::max(r - 3, 0)) * width;
+			for (int x = 0; x < width; x++)
+				w0[x] = c.B * w0[x] + c.b1 * w1[x] + c.b2 * w2[x] + c.b3 * w3[x];
+		}
+		for (int r = span - 2; r >= 0; r--)
+		{
+			float* w0 = buffer.data() + static_cast<std::size_t>(r) * width;
+			const float* w1 = buffer.data() + static_cast<std::size_t>(std::min(r + 1, span - 1)) * width;
+			const float* w2 = buffer.data() + static_cast<std::size_t>(std::min(r + 2, span - 1)) * width;
+			const float* w3 = buffer.data() + static_cast<std::size_t>(std::min(r + 3, span - 1)) * width;
+			for (int x = 0; x < width; x++)
+				w0[x] = c.B * w0[x] + c.b1 * w1[x] + c.b2 * w2[x] + c.b3 * w3[x];
+		}
+		for (int y = 0; y < height; y++)
+			std::copy_n(buffer.data() + static_cast<std::size_t>(y + margin) * width, width, plane.data() + static_cast<std::size_t>(y) * width);
+	}
+}
+
+inline QImage RecursiveGaussian::process(const QImage& img, float sigma, const BorderPolicy& border)
+{
+	bool gray = img.format() == QImage::Format_Grayscale8;
+	QImage::Format format = gray ? QImage::Format_Grayscale8 : img.format() == QImage::Format_RGB32 ? QImage::Format_RGB32 : QImage::Format_ARGB32;
+	if (img.isNull() || sigma < 0.5f)
+		return img.convertToFormat(format);
+	width = img.width();
+	height = img.height();
+	channels = gray ? 1 : 3;
+	QImage src = gray ? img : img.convertToFormat(QImage::Format_ARGB32);
+	for (int ch = 0; ch < channels; ch++)
+		planes[ch].resize(static_cast<std::size_t>(width) * height);
+	Tracer::countAllocation(channels * planes[0].size() * sizeof(float));
+	for (int y = 0; y < height; y++)
+	{
+		const uchar* line = src.constScanLine(y);
+		for (int x = 0; x < width; x++)
+		{
+			std::size_t idx = static_cast<std::size_t>(y) * width + x;
+			if (gray)
+				planes[0][idx] = line[x];
+			else
+			{
+				QRgb c = reinterpret_cast<const QRgb*>(line)[x];
+				planes[0][idx] = qRed(c);
+				planes[1][idx] = qGreen(c);
+				planes[2][idx] = qBlue(c);
+			}
+		}
+	}
+
+	YoungVanVliet coefficients(sigma);
+	blurRows(coefficients, margin(sigma), border);
+	blurColumns(coefficients, margin(sigma), border);
+
+	QImage result(width, height, format);
+	auto channel = [](float v) { return static_cast<int>(std::max(0.f, std::min(255.f, v)) + 0.5f); };
+	for (int y = 0; y < height; y++)
+	{
+		uchar* line = result.scanLine(y);
+		for (int x = 0; x < width; x++)
+		{
+			std::size_t idx = static_cast<std::size_t>(y) * width + x;
+			if (gray)
+				line[x] = static_cast<uchar>(channel(planes[0][idx]));
+			else
+				reinterpret_cast<QRgb*>(line)[x] = qRgb(channel(planes[0][idx]), channel(planes[1][idx]), channel(planes[2][idx]));
+		}
+	}
+	return result;
+}
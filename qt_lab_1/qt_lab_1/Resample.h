@@ -0,0 +1,350 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "Filter.h"
+
+enum class ResampleKernel
+{
+	Area,		// exact pixel coverage; the usual choice for downscaling
+	Bilinear,
+	Lanczos3
+};
+
+// Weights of one axis: output i reads taps source samples from start[i]
+class ResampleAxis
+{
+public:
+	int taps = 0;
+	std::vector<int> start;
+	std::vector<float> weights;	// taps per output sample
+
+	ResampleAxis() = default;
+	// prefilter: odd-length taps convolved with the source before resampling
+	ResampleAxis(int source, int target, ResampleKernel kernel, const std::vector<float>& prefilter = std::vector<float>());
+	const float* at(int i) const { return weights.data() + static_cast<std::size_t>(i) * taps; }
+};
+
+inline ResampleAxis::ResampleAxis(int source, int target, ResampleKernel kernel, const std::vector<float>& prefilter)
+{
+	const double pi = 3.14159265358979323846;
+	double scale = double(target) / source;
+	// Stretching the kernel when shrinking makes it the anti-alias filter too
+	double stretch = std::max(1.0, 1 / scale);
+	double support = kernel == ResampleKernel::Lanczos3 ? 3 : 1;
+	int half = static_cast<int>(prefilter.size() / 2);
+	std::vector<std::vector<float>> rows(target);
+	std::vector<int> lows(target);
+	for (int i = 0; i < target; i++)
+	{
+		double centre = (i + 0.5) / scale;
+		int lo, hi;
+		std::vector<double> w;
+		if (kernel == ResampleKernel::Area)
+		{
+			double begin = i / scale, end = (i + 1) / scale;
+			lo = static_cast<int>(std::floor(begin));
+			hi = std::max(lo, static_cast<int>(std::ceil(end)) - 1);
+			for (int j = lo; j <= hi; j++)
+				w.push_back(std::max(0.0, std::min(end, j + 1.0) - std::max(begin, double(j))));
+		}
+		else
+		{
+			lo = static_cast<int>(std::floor(centre - 0.5 - support * stretch));
+			hi = static_cast<int>(std::ceil(centre - 0.5 + support * stretch));
+			for (int j = lo; j <= hi; j++)
+			{
+				double t = std::fabs(j + 0.5 - centre) / stretch;
+				double value = 0;
+				if (kernel == ResampleKernel::Bilinear)
+					value = std::max(0.0, 1 - t);
+				else if (t < 1e-9)
+					value = 1;
+				else if (t < 3)
+					value = 3 * std::sin(pi * t) * std::sin(pi * t / 3) / (pi * pi * t * t);
+				w.push_back(value);
+			}
+		}
+		double sum = 0;
+		for (double value : w)
+			sum += value;
+		for (double& value : w)
+			value /= sum;
+		// Fold the prefilter in (keeping its gain), then the samples past the edges onto the edges
+		std::vector<double> fused(w.size() + 2 * half, 0.0);
+		for (std::size_t j = 0; j < w.size(); j++)
+			for (int k = 0; k < static_cast<int>(prefilter.size()); k++)
+				fused[j + k] += w[j] * prefilter[k];
+		if (prefilter.empty())
+			fused = w;
+		lo -= half;
+		int first = std::max(0, std::min(lo, source - 1));
+		int last = std::min(source - 1, std::max(lo + static_cast<int>(fused.size()) - 1, 0));
+		std::vector<float> row(last - first + 1, 0.f);
+		for (std::size_t j = 0; j < fused.size(); j++)
+		{
+			int index = std::min(std::max(lo + static_cast<int>(j), 0), source - 1);
+			row[index - first] += static_cast<float>(fused[j]);
+		}
+		rows[i] = std::move(row);
+		lows[i] = first;
+		taps = std::max(taps, static_cast<int>(rows[i].size()));
+	}
+	taps = std::min(taps, source);
+	start.resize(target);
+	weights.assign(static_cast<std::size_t>(target) * taps, 0.f);
+	for (int i = 0; i < target; i++)
+	{
+		// Every output reads a full window of taps, so shift windows off the far edge
+		start[i] = std::min(lows[i], source - taps);
+		float* dst = weights.data() + static_cast<std::size_t>(i) * taps;
+		for (std::size_t j = 0; j < rows[i].size(); j++)
+			dst[lows[i] - start[i] + j] = rows[i][j];
+	}
+}
+
+// Separable resize, optionally fused with a blur before it and point
+// filters after it: the blur is folded into the resampling weights and the
+// point filters run on each output band while it is in cache, so the
+// source is read once. Rows are split into bands, one per thread; each
+// band runs the horizontal pass over the source rows it needs and then
+// the vertical pass. The prefilter sees replicated edges whatever its own
+// border policy.
+class Resampler
+{
+	QSize size;
+	ResampleKernel kernel;
+	int threads;
+	std::vector<float> prefilterX, prefilterY;
+	std::vector<std::shared_ptr<const PointFilter>> after;
+
+	void horizontal(const QImage& src, int y, const ResampleAxis& axis, float* dst) const;
+	void vertical(const std::vector<float>& rows, int firstRow, int rowFloats, const ResampleAxis& axis, int y, uchar* dst) const;
+public:
+	Resampler(const QSize& size, ResampleKernel kernel = ResampleKernel::Lanczos3, int threads = 0)
+		: size(size), kernel(kernel), threads(threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))) {}
+	// Takes a blur: a MatrixFilter whose kernel is separable with no negative
+	// taps (Gaussian, box) or a RecursiveGaussianFilter. Anything else is
+	// refused and has to run on its own; edge detectors in particular clip
+	// before resampling and cannot be folded in.
+	bool setPrefilter(const Filter& filter);
+	static bool separableTaps(const Kernel& kernel, std::vector<float>& columns, std::vector<float>& rows);
+	Resampler& then(std::shared_ptr<const PointFilter> filter)
+	{
+		after.push_back(std::move(filter));
+		return *this;
+	}
+	QImage process(const QImage& img) const;
+};
+
+inline bool Resampler::separableTaps(const Kernel& kernel, std::vector<float>& columns, std::vector<float>& rows)
+{
+	int n = static_cast<int>(kernel.getSize());
+	int pivot = 0;
+	for (int i = 1; i < n * n; i++)
+		if (std::fabs(kernel[i]) > std::fabs(kernel[pivot]))
+			pivot = i;
+	float peak = kernel[pivot];
+	if (peak == 0)
+		return false;
+	int pr = pivot / n, pc = pivot % n;
+	columns.resize(n);
+	rows.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		columns[i] = kernel[i * n + pc] / peak;
+		rows[i] = kernel[pr * n + i];
+	}
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+			if (std::fabs(kernel[i * n + j] - columns[i] * rows[j]) > 1e-5f * std::fabs(peak))
+				return false;
+	return true;
+}
+
+inline bool Resampler::setPrefilter(const Filter& filter)
+{
+	if (const RecursiveGaussianFilter* gaussian = dynamic_cast<const RecursiveGaussianFilter*>(&filter))
+	{
+		float sigma = gaussian->getSigma();
+		int radius = static_cast<int>(std::ceil(3 * sigma));
+		prefilterX.resize(2 * radius + 1);
+		float norm = 0;
+		for (int i = -radius; i <= radius; i++)
+			norm += prefilterX[i + radius] = std::exp(-i * i / (2 * sigma * sigma));
+		for (float& tap : prefilterX)
+			tap /= norm;
+		prefilterY = prefilterX;
+		return true;
+	}
+	const MatrixFilter* matrix = dynamic_cast<const MatrixFilter*>(&filter);
+	if (!matrix || !matrix->isLinear() || dynamic_cast<const MotionBlurFilter*>(&filter))
+		return false;
+	const Kernel& taps = matrix->getKernel();
+	for (std::size_t i = 0; i < taps.getSize() * taps.getSize(); i++)
+		if (taps[i] < 0)
+			return false;
+	std::vector<float> columns, rows;
+	if (!separableTaps(taps, columns, rows))
+		return false;
+	prefilterY = columns;
+	prefilterX = rows;
+	return true;
+}
+
+inline void Resampler::horizontal(const QImage& src, int y, const ResampleAxis& axis, float* dst) const
+{
+	const uchar* line = src.constScanLine(y);
+	if (src.format() == QImage::Format_Grayscale8)
+	{
+		for (std::size_t x = 0; x < axis.start.size(); x++)
+		{
+			const float* w = axis.at(static_cast<int>(x));
+			const uchar* s = line + axis.start[x];
+			float sum = 0;
+			for (int k = 0; k < axis.taps; k++)
+				sum += w[k] * s[k];
+			dst[x] = sum;
+		}
+		return;
+	}
+	for (std::size_t x = 0; x < axis.start.size(); x++)
+	{
+		const float* w = axis.at(static_cast<int>(x));
+		const uchar* s = line + 4 * axis.start[x];
+#ifdef COLORSPACE_SSE2
+		// One pixel's four bytes widened to four floats per tap
+		const __m128i zero = _mm_setzero_si128();
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < axis.taps; k++)
+		{
+			int bytes;
+			std::memcpy(&bytes, s + 4 * k, 4);
+			__m128i pixel = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(pixel), _mm_set1_ps(w[k])));
+		}
+		_mm_storeu_ps(dst + 4 * x, sum);
+#else
+		float sum[4] = { 0, 0, 0, 0 };
+		for (int k = 0; k < axis.taps; k++)
+			for (int c = 0; c < 4; c++)
+				sum[c] += w[k] * s[4 * k + c];
+		std::copy(sum, sum + 4, dst + 4 * x);
+#endif
+	}
+}
+
+inline void Resampler::vertical(const std::vector<float>& rows, int firstRow, int rowFloats, const ResampleAxis& axis, int y, uchar* dst) const
+{
+	const float* w = axis.at(y);
+	const float* base = rows.data() + static_cast<std::size_t>(axis.start[y] - firstRow) * rowFloats;
+	int i = 0;
+#ifdef COLORSPACE_SSE2
+	for (; i + 4 <= rowFloats; i += 4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < axis.taps; k++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(base + static_cast<std::size_t>(k) * rowFloats + i), _mm_set1_ps(w[k])));
+		sum = _mm_min_ps(_mm_max_ps(sum, _mm_setzero_ps()), _mm_set1_ps(255.f));
+		__m128i value = _mm_cvtps_epi32(sum);	// rounds to nearest
+		value = _mm_packs_epi32(value, value);
+		int packed = _mm_cvtsi128_si32(_mm_packus_epi16(value, value));
+		std::memcpy(dst + i, &packed, 4);
+	}
+#endif
+	for (; i < rowFloats; i++)
+	{
+		float sum = 0;
+		for (int k = 0; k < axis.taps; k++)
+			sum += w[k] * base[static_cast<std::size_t>(k) * rowFloats + i];
+		dst[i] = static_cast<uchar>(tclamp(sum, 255.f, 0.f) + 0.5f);
+	}
+}
+
+// Back from premultiplied alpha in place; overshooting kernels can leave a
+// channel above its alpha, which is clamped
+inline void unpremultiplyRow(QRgb* row, int width)
+{
+	for (int x = 0; x < width; x++)
+	{
+		int alpha = qAlpha(row[x]);
+		if (alpha == 255)
+			continue;
+		if (alpha == 0)
+		{
+			row[x] = 0;
+			continue;
+		}
+		auto channel = [alpha](int value) { return std::min(255, (value * 255 + alpha / 2) / alpha); };
+		row[x] = qRgba(channel(qRed(row[x])), channel(qGreen(row[x])), channel(qBlue(row[x])), alpha);
+	}
+}
+
+inline QImage Resampler::process(const QImage& img) const
+{
+	TraceScope scope("resample", "resample");
+	scope.addPixels(qint64(img.width()) * img.height());
+	if (img.isNull() || size.isEmpty())
+		return QImage();
+	bool gray = img.format() == QImage::Format_Grayscale8;
+	for (const auto& filter : after)
+		gray = gray && filter->supportsGray();
+	QImage::Format format = gray ? QImage::Format_Grayscale8 : workingFormat(img);
+	// With alpha, both passes run on premultiplied pixels so that the colour
+	// of transparent pixels does not bleed into their neighbours; each band
+	// is converted back before the point filters see it
+	bool premultiplied = format == QImage::Format_ARGB32;
+	QImage src = premultiplied ? img.convertToFormat(QImage::Format_ARGB32_Premultiplied)
+		: img.format() == format ? img : img.convertToFormat(format);
+	int channels = gray ? 1 : 4;
+
+	ResampleAxis axisX(src.width(), size.width(), kernel, prefilterX);
+	ResampleAxis axisY(src.height(), size.height(), kernel, prefilterY);
+	QImage result(size, format);
+	Tracer::countAllocation(result.sizeInBytes());
+	int rowFloats = size.width() * channels;
+	uchar* bits = result.bits();
+	int bytesPerLine = result.bytesPerLine();
+
+	int bands = std::min(threads, std::max(1, size.height() / 16));
+	auto work = [&](int band)
+	{
+		int y0 = size.height() * band / bands, y1 = size.height() * (band + 1) / bands;
+		if (y0 >= y1)
+			return;
+		int first = axisY.start[y0], last = axisY.start[y0];
+		for (int y = y0; y < y1; y++)
+			last = std::max(last, axisY.start[y] + axisY.taps - 1);
+		std::vector<float> rows(static_cast<std::size_t>(last - first + 1) * rowFloats);
+		for (int y = first; y <= last; y++)
+			horizontal(src, y, axisX, rows.data() + static_cast<std::size_t>(y - first) * rowFloats);
+		for (int y = y0; y < y1; y++)
+		{
+			uchar* line = bits + static_cast<std::size_t>(y) * bytesPerLine;
+			vertical(rows, first, rowFloats, axisY, y, line);
+			if (premultiplied)
+				unpremultiplyRow(reinterpret_cast<QRgb*>(line), size.width());
+		}
+		if (after.empty())
+			return;
+		QImage view(bits + static_cast<std::size_t>(y0) * bytesPerLine, size.width(), y1 - y0, bytesPerLine, format);
+		for (const auto& filter : after)
+			filter->processRegion(view, view.rect(), view);
+	};
+	std::vector<std::thread> pool;
+	for (int band = 1; band < bands; band++)
+		pool.emplace_back(work, band);
+	work(0);
+	for (std::thread& thread : pool)
+		thread.join();
+	return result;
+}
+
+// QImage::scaled counterpart
+inline QImage resampleImage(const QImage& img, const QSize& size, ResampleKernel kernel = ResampleKernel::Lanczos3)
+{
+	return Resampler(size, kernel).process(img);
+}
@@ -0,0 +1,226 @@
+﻿#pragma once
+#include <QDir>
+#include <QFileInfo>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "Filter.h"
+#include "TiledImage.h"
+
+struct CacheStats
+{
+	std::uint64_t hits = 0, misses = 0, evictions = 0;
+	std::uint64_t diskHits = 0, diskWrites = 0;
+	std::size_t bytes = 0, entries = 0;
+};
+
+// Filter outputs keyed by the filter class, its hashParams() and an XXH64
+// of the input pixels. The memory tier is an LRU bounded by a byte budget;
+// with a directory set, every result is also written there as a TiledImage
+// and memory misses are looked up on disk before computing. The disk tier
+// is never trimmed automatically, see clearDisk(). Non-deterministic
+// filters always bypass the cache.
+class ResultCache
+{
+	struct Entry
+	{
+		std::uint64_t key;
+		QImage image;
+	};
+	std::size_t budget;
+	QString directory;
+	std::list<Entry> lru;	// most recently used first
+	std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index;
+	CacheStats counters;
+	mutable std::mutex mutex;
+
+	QString diskPath(std::uint64_t key) const
+	{
+		return QDir(directory).filePath(QString::number(key, 16).rightJustified(16, '0') + ".qlti");
+	}
+	void insertLocked(std::uint64_t key, const QImage& image);
+	bool loadFromDisk(std::uint64_t key, QImage& image) const;
+	void storeToDisk(std::uint64_t key, const QImage& image);
+public:
+	explicit ResultCache(std::size_t budgetBytes = std::size_t(256) << 20, const QString& diskDirectory = QString())
+		: budget(budgetBytes), directory(diskDirectory)
+	{
+		if (!directory.isEmpty())
+			QDir().mkpath(directory);
+	}
+
+	static std::uint64_t key(const Filter& filter, const QImage& img)
+	{
+		ParamHash hash(imageHash(img));
+		hash.add(className(typeid(filter)));
+		filter.hashParams(hash);
+		return hash.value();
+	}
+
+	// filter.process(img), or the stored result of an identical earlier call
+	QImage process(const Filter& filter, const QImage& img);
+	bool lookup(std::uint64_t key, QImage& image);
+	void insert(std::uint64_t key, const QImage& image);
+
+	void setBudget(std::size_t bytes);
+	std::size_t getBudget() const { return budget; }
+	CacheStats stats() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return counters;
+	}
+	void clear();
+	void clearDisk();
+};
+
+inline QImage ResultCache::process(const Filter& filter, const QImage& img)
+{
+	if (!filter.isDeterministic())
+		return filter.process(img);
+	std::uint64_t k;
+	{
+		TraceScope scope("cache", "hash");
+		scope.addPixels(qint64(img.width()) * img.height());
+		k = key(filter, img);
+	}
+	QImage result;
+	if (lookup(k, result))
+		return result;
+	result = filter.process(img);
+	insert(k, result);
+	return result;
+}
+
+inline bool ResultCache::lookup(std::uint64_t key, QImage& image)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = index.find(key);
+		if (it != index.end())
+		{
+			lru.splice(lru.begin(), lru, it->second);
+			image = it->second->image;
+			counters.hits++;
+			return true;
+		}
+	}
+	if (!directory.isEmpty() && loadFromDisk(key, image))
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		counters.diskHits++;
+		insertLocked(key, image);
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	counters.misses++;
+	return false;
+}
+
+inline void ResultCache::insert(std::uint64_t key, const QImage& image)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		insertLocked(key, image);
+	}
+	if (!directory.isEmpty())
+		storeToDisk(key, image);
+}
+
+inline void ResultCache::insertLocked(std::uint64_t key, const QImage& image)
+{
+	auto it = index.find(key);
+	if (it != index.end())
+	{
+		counters.bytes -= it->second->image.sizeInBytes();
+		lru.erase(it->second);
+		index.erase(it);
+	}
+	std::size_t size = image.sizeInBytes();
+	if (size > budget)
+		return;
+	lru.push_front(Entry{ key, image });
+	index[key] = lru.begin();
+	counters.bytes += size;
+	while (counters.bytes > budget)
+	{
+		const Entry& last = lru.back();
+		counters.bytes -= last.image.sizeInBytes();
+		index.erase(last.key);
+		lru.pop_back();
+		counters.evictions++;
+	}
+	counters.entries = lru.size();
+}
+
+inline void ResultCache::setBudget(std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	budget = bytes;
+	while (counters.bytes > budget)
+	{
+		counters.bytes -= lru.back().image.sizeInBytes();
+		index.erase(lru.back().key);
+		lru.pop_back();
+		counters.evictions++;
+	}
+	counters.entries = lru.size();
+}
+
+inline bool ResultCache::loadFromDisk(std::uint64_t key, QImage& image) const
+{
+	QString path = diskPath(key);
+	if (!QFileInfo::exists(path))
+		return false;
+	TiledImage tiled;
+	if (!tiled.open(path))
+		return false;
+	TraceScope scope("cache", "disk read");
+	image = tiled.toImage();
+	scope.addBytes(image.sizeInBytes());
+	return true;
+}
+
+inline void ResultCache::storeToDisk(std::uint64_t key, const QImage& image)
+{
+	// TiledImage keeps only these formats; anything else would come back converted
+	QImage::Format format = image.format();
+	if (format != QImage::Format_RGB32 && format != QImage::Format_ARGB32 && format != QImage::Format_Grayscale8)
+		return;
+	TraceScope scope("cache", "disk write");
+	scope.addBytes(image.sizeInBytes());
+	// Written under a temporary name so that readers never map a partial file
+	QString path = diskPath(key), temporary = path + ".tmp";
+	{
+		TiledImage tiled;
+		if (!tiled.create(temporary, image.size(), image.format()) || !tiled.write(image))
+		{
+			QFile::remove(temporary);
+			return;
+		}
+	}
+	QFile::remove(path);
+	if (QFile::rename(temporary, path))
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		counters.diskWrites++;
+	}
+}
+
+inline void ResultCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	lru.clear();
+	index.clear();
+	counters.bytes = 0;
+	counters.entries = 0;
+}
+
+inline void ResultCache::clearDisk()
+{
+	if (directory.isEmpty())
+		return;
+	QDir dir(directory);
+	for (const QString& name : dir.entryList(QStringList() << "*.qlti", QDir::Files))
+		dir.remove(name);
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+#include "Batch.h"
+#include "FilterChain.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+// Consistency checks behind -selfcheck. Each one reports what went wrong
+// to out and returns false; img is any picture with some detail in it.
+
+// Largest difference of any channel, 256 for images of different sizes
+inline int maxDifference(const QImage& a, const QImage& b)
+{
+	if (a.size() != b.size())
+		return 256;
+	QImage left = a.convertToFormat(QImage::Format_ARGB32), right = b.convertToFormat(QImage::Format_ARGB32);
+	int result = 0;
+	for (int y = 0; y < left.height(); y++)
+	{
+		const QRgb* p = reinterpret_cast<const QRgb*>(left.constScanLine(y));
+		const QRgb* q = reinterpret_cast<const QRgb*>(right.constScanLine(y));
+		for (int x = 0; x < left.width(); x++)
+			result = std::max({ result, std::abs(qRed(p[x]) - qRed(q[x])), std::abs(qGreen(p[x]) - qGreen(q[x])),
+				std::abs(qBlue(p[x]) - qBlue(q[x])), std::abs(qAlpha(p[x]) - qAlpha(q[x])) });
+	}
+	return result;
+}
+
+// Radius 1 kernels have nothing smaller to be binned into: the pyramid
+// preview and the budget downgrade must get them back unchanged
+inline bool checkScaledKernels(const QImage& img, std::ostream& out = std::cout)
+{
+	bool ok = true;
+	for (const char* spec : { "blur:1", "emboss", "sobel", "median:1", "dilate:1", "blur:1,emboss" })
+	{
+		auto filter = parseFilterChain(spec);
+		auto scaled = filter->scaled(0.5f);
+		int difference = scaled ? maxDifference(scaled->process(img), filter->process(img)) : 0;
+		if (difference)
+		{
+			out << spec << ": scaled(0.5) changes the result by up to " << difference << "\n";
+			ok = false;
+		}
+	}
+	auto gauss = std::dynamic_pointer_cast<const MatrixFilter>(GaussianFilter(1, 1.f).scaled(0.5f));
+	if (!gauss || gauss->getKernel().getRadius() < 1)
+	{
+		out << "GaussianFilter(1): scaled(0.5) loses the kernel\n";
+		ok = false;
+	}
+	return ok;
+}
+
+// Whole-image statistics must stay per image when BatchProcessor runs one
+// filter instance on many images from several threads
+inline bool checkBatchStatistics(const QImage& img, std::ostream& out = std::cout)
+{
+	QImage base = img.convertToFormat(QImage::Format_RGB32);
+	std::vector<QImage> images;
+	for (int i = 0; i < 32; i++)
+	{
+		// Neighbours with very different averages and ranges
+		QImage variant = i % 2 ? InvertFilter().process(base) : base.copy();
+		if (i % 4 >= 2)
+			variant = BrightFilter().process(variant);
+		images.push_back(variant);
+	}
+	ImageBatch batch = ImageBatch::pack(images);
+	BatchProcessor processor(4);
+	bool ok = true;
+	GreyWorldFilter greyWorld;
+	HistogrammFilter histogram;
+	for (const Filter* filter : { static_cast<const Filter*>(&greyWorld), static_cast<const Filter*>(&histogram) })
+		for (int round = 0; round < 4; round++)
+		{
+			std::vector<QImage> results = processor.run(*filter, batch).unpack();
+			int mismatches = 0;
+			for (std::size_t i = 0; i < images.size(); i++)
+				if (maxDifference(results[i], filter->process(images[i])))
+					mismatches++;
+			if (mismatches)
+			{
+				out << className(typeid(*filter)) << ": " << mismatches << " of " << images.size() << " batched images differ from process()\n";
+				ok = false;
+				break;
+			}
+		}
+	return ok;
+}
+
+// All checks; true when every one passed
+inline bool runSelfCheck(const QImage& img, std::ostream& out = std::cout)
+{
+	bool ok = true;
+	ok = checkScaledKernels(img, out) && ok;
+	ok = checkBatchStatistics(img, out) && ok;
+	out << (ok ? "self-check passed" : "self-check FAILED") << "\n";
+	return ok;
+}
@@ -0,0 +1,245 @@
+﻿#pragma once
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include "Filter.h"
+
+// Sequential row sources and sinks, so images larger than memory can be
+// filtered strip by strip. Rows are exchanged as 32-bit QRgb scanlines.
+class RowReader
+{
+public:
+	virtual ~RowReader() = default;
+	virtual int width() const = 0;
+	virtual int height() const = 0;
+	// Reads the next count rows into lines [first, first + count) of dst
+	virtual bool readRows(QImage& dst, int first, int count) = 0;
+};
+
+class RowWriter
+{
+public:
+	virtual ~RowWriter() = default;
+	// Appends lines [first, first + count) of src
+	virtual bool writeRows(const QImage& src, int first, int count) = 0;
+};
+
+// Binary PPM (P6, 8-bit RGB) and PGM (P5, 8-bit grey)
+class PpmReader : public RowReader
+{
+	std::ifstream file;
+	int w = 0, h = 0, channels = 3;
+	std::vector<uchar> buffer;
+public:
+	bool open(const std::string& path);
+	int width() const override { return w; }
+	int height() const override { return h; }
+	bool readRows(QImage& dst, int first, int count) override;
+};
+
+class PpmWriter : public RowWriter
+{
+	std::ofstream file;
+	std::vector<uchar> buffer;
+public:
+	bool open(const std::string& path, int width, int height);
+	bool writeRows(const QImage& src, int first, int count) override;
+};
+
+// Headerless rows of QRgb values; the size has to be known up front
+class RawReader : public RowReader
+{
+	std::ifstream file;
+	int w = 0, h = 0;
+public:
+	bool open(const std::string& path, int width, int height);
+	int width() const override { return w; }
+	int height() const override { return h; }
+	bool readRows(QImage& dst, int first, int count) override;
+};
+
+class RawWriter : public RowWriter
+{
+	std::ofstream file;
+public:
+	bool open(const std::string& path);
+	bool writeRows(const QImage& src, int first, int count) override;
+};
+
+inline bool PpmReader::open(const std::string& path)
+{
+	file.open(path, std::ios::binary);
+	if (!file)
+		return false;
+	std::string magic;
+	file >> magic;
+	if (magic != "P6" && magic != "P5")
+		return false;
+	channels = magic == "P6" ? 3 : 1;
+	int fields[3];
+	for (int i = 0; i < 3; i++)
+	{
+		file >> std::ws;
+		while (file.peek() == '#')
+		{
+			file.ignore(1 << 16, '\n');
+			file >> std::ws;
+		}
+		file >> fields[i];
+	}
+	file.get();
+	w = fields[0];
+	h = fields[1];
+	if (!file || fields[2] != 255 || w <= 0 || h <= 0)
+		return false;
+	buffer.resize(static_cast<std::size_t>(w) * channels);
+	return true;
+}
+
+inline bool PpmReader::readRows(QImage& dst, int first, int count)
+{
+	for (int y = first; y < first + count; y++)
+	{
+		if (!file.read(reinterpret_cast<char*>(buffer.data()), buffer.size()))
+			return false;
+		QRgb* line = reinterpret_cast<QRgb*>(dst.scanLine(y));
+		if (channels == 3)
+			for (int x = 0; x < w; x++)
+				line[x] = qRgb(buffer[3 * x], buffer[3 * x + 1], buffer[3 * x + 2]);
+		else
+			for (int x = 0; x < w; x++)
+				line[x] = qRgb(buffer[x], buffer[x], buffer[x]);
+	}
+	return true;
+}
+
+inline bool PpmWriter::open(const std::string& path, int width, int height)
+{
+	file.open(path, std::ios::binary);
+	if (!file)
+		return false;
+	file << "P6\n" << width << " " << height << "\n255\n";
+	buffer.resize(static_cast<std::size_t>(width) * 3);
+	return static_cast<bool>(file);
+}
+
+inline bool PpmWriter::writeRows(const QImage& src, int first, int count)
+{
+	for (int y = first; y < first + count; y++)
+	{
+		const QRgb* line = reinterpret_cast<const QRgb*>(src.constScanLine(y));
+		for (int x = 0; x < src.width(); x++)
+		{
+			buffer[3 * x] = qRed(line[x]);
+			buffer[3 * x + 1] = qGreen(line[x]);
+			buffer[3 * x + 2] = qBlue(line[x]);
+		}
+		file.write(reinterpret_cast<const char*>(buffer.data()), src.width() * 3);
+	}
+	return static_cast<bool>(file);
+}
+
+inline bool RawReader::open(const std::string& path, int width, int height)
+{
+	file.open(path, std::ios::binary);
+	w = width;
+	h = height;
+	return static_cast<bool>(file);
+}
+
+inline bool RawReader::readRows(QImage& dst, int first, int count)
+{
+	for (int y = first; y < first + count; y++)
+		if (!file.read(reinterpret_cast<char*>(dst.scanLine(y)), w * sizeof(QRgb)))
+			return false;
+	return true;
+}
+
+inline bool RawWriter::open(const std::string& path)
+{
+	file.open(path, std::ios::binary);
+	return static_cast<bool>(file);
+}
+
+inline bool RawWriter::writeRows(const QImage& src, int first, int count)
+{
+	for (int y = first; y < first + count; y++)
+		file.write(reinterpret_cast<const char*>(src.constScanLine(y)), src.width() * sizeof(QRgb));
+	return static_cast<bool>(file);
+}
+
+// Runs a local filter (or Pipeline) over a RowReader strip by strip. Only
+// stripHeight rows plus the filter's top/bottom margins are held in memory,
+// in a rolling window that keeps the overlap between neighbouring strips.
+// The first and last strips see the real image edge, so Replicate, Reflect
+// and Constant borders match an in-memory run; Wrap cannot see the opposite
+// edge and behaves like Reflect there. Filters that resample along
+// sub-pixel paths (FFT convolution, directional MotionBlurFilter) may
+// differ from an in-memory run by a level or two.
+class StreamProcessor
+{
+	const Filter& filter;
+	int stripHeight;
+	std::size_t peakBytes = 0;
+public:
+	StreamProcessor(const Filter& filter, int stripHeight = 64) : filter(filter), stripHeight(std::max(1, stripHeight)) {}
+	bool run(RowReader& in, RowWriter& out);
+	// Pixel buffers held at once by the last run()
+	std::size_t peakBufferBytes() const { return peakBytes; }
+};
+
+inline bool StreamProcessor::run(RowReader& in, RowWriter& out)
+{
+	if (!filter.isLocal())
+	{
+		std::cerr << "StreamProcessor: filter needs the whole image and cannot be streamed" << std::endl;
+		return false;
+	}
+	int width = in.width(), height = in.height();
+	QMargins margins = filter.margins();
+	int capacity = stripHeight + margins.top() + margins.bottom();
+	QImage window(width, capacity, QImage::Format_RGB32);
+	QImage output(width, capacity, QImage::Format_RGB32);
+	peakBytes = window.sizeInBytes() + output.sizeInBytes();
+	Tracer::countAllocation(peakBytes);
+	int bytesPerLine = window.bytesPerLine();
+
+	// Input rows [windowBegin, windowEnd) are stored at window lines [0, windowEnd - windowBegin)
+	int windowBegin = 0, windowEnd = 0;
+	for (int y0 = 0; y0 < height; y0 += stripHeight)
+	{
+		int rows = std::min(stripHeight, height - y0);
+		int needBegin = std::max(0, y0 - margins.top());
+		int needEnd = std::min(height, y0 + rows + margins.bottom());
+
+		int keep = std::max(0, windowEnd - needBegin);
+		if (keep > 0 && needBegin > windowBegin)
+			std::memmove(window.scanLine(0), window.scanLine(needBegin - windowBegin), static_cast<std::size_t>(keep) * bytesPerLine);
+		windowBegin = needBegin;
+		windowEnd = windowBegin + keep;
+		if (needEnd > windowEnd)
+		{
+			TraceScope scope("io", "read rows");
+			scope.addPixels(qint64(width) * (needEnd - windowEnd));
+			if (!in.readRows(window, windowEnd - windowBegin, needEnd - windowEnd))
+				return false;
+		}
+		windowEnd = needEnd;
+
+		int lines = windowEnd - windowBegin;
+		const QImage view(window.constBits(), width, lines, bytesPerLine, QImage::Format_RGB32);
+		QImage target(output.bits(), width, lines, bytesPerLine, QImage::Format_RGB32);
+		{
+			TraceScope scope("tile", "strip");
+			scope.addPixels(qint64(width) * rows);
+			scope.addBytes(qint64(bytesPerLine) * (lines + rows));
+			filter.processRegion(view, QRect(0, y0 - windowBegin, width, rows), target);
+		}
+		TraceScope scope("io", "write rows");
+		scope.addPixels(qint64(width) * rows);
+		if (!out.writeRows(target, y0 - windowBegin, rows))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,291 @@
+﻿#pragma once
+#include <QFile>
+#include <QImage>
+#include <QString>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include "Filter.h"
+
+// Uncompressed tiled image file meant to be memory-mapped.
+//
+//   header (64 bytes) | tile offset table (uint64 per tile) | tiles
+//
+// Every tile starts on an `alignment` boundary and always holds a full
+// tileWidth x tileHeight block (edge tiles are padded), rows packed at
+// tileWidth * bytesPerPixel. Values are in native byte order. Several
+// processes can map the same file and share its pages.
+struct TiledImageHeader
+{
+	char magic[4];			// "QLTI"
+	std::uint32_t version;
+	std::uint32_t width, height;
+	std::uint32_t tileWidth, tileHeight;
+	std::uint32_t tilesX, tilesY;
+	std::uint32_t format;		// QImage::Format of the pixels
+	std::uint32_t bytesPerPixel;
+	std::uint32_t alignment;
+	std::uint32_t reserved[5];
+};
+static_assert(sizeof(TiledImageHeader) == 64, "TiledImageHeader must stay 64 bytes");
+
+class TiledImage
+{
+	QFile file;
+	uchar* map = nullptr;
+	bool writable = false;
+
+	const TiledImageHeader& header() const { return *reinterpret_cast<const TiledImageHeader*>(map); }
+	const std::uint64_t* offsets() const { return reinterpret_cast<const std::uint64_t*>(map + sizeof(TiledImageHeader)); }
+	int tileStride() const { return header().tileWidth * header().bytesPerPixel; }
+	// The header is consistent and the offset table and every tile lie inside the file
+	bool isValid(qint64 fileSize) const;
+public:
+	static const std::uint32_t Version = 1;
+
+	TiledImage() = default;
+	TiledImage(const TiledImage&) = delete;
+	TiledImage& operator=(const TiledImage&) = delete;
+	~TiledImage() { close(); }
+
+	// Creates (or truncates) a file of the given geometry and maps it read-write
+	bool create(const QString& path, const QSize& size, QImage::Format format, const QSize& tile = QSize(256, 256), int alignment = 4096);
+	bool open(const QString& path, bool readWrite = false);
+	void close();
+	bool isOpen() const { return map != nullptr; }
+
+	QSize size() const { return QSize(header().width, header().height); }
+	QSize tileSize() const { return QSize(header().tileWidth, header().tileHeight); }
+	int tilesX() const { return header().tilesX; }
+	int tilesY() const { return header().tilesY; }
+	QImage::Format format() const { return static_cast<QImage::Format>(header().format); }
+	QRect tileRect(int tx, int ty) const;
+
+	// Views straight into the mapping; valid until close(). Edge tiles are cropped to the image.
+	QImage tile(int tx, int ty) const;
+	QImage tile(int tx, int ty);
+
+	QImage region(const QRect& rect) const;
+	QImage toImage() const { return region(QRect(QPoint(0, 0), size())); }
+	bool write(const QImage& img, const QPoint& pos = QPoint());
+
+	// Tile by tile into out, which must already be created with the same geometry.
+	// Filters without margins read and write the mapped tiles without copying.
+	bool apply(const Filter& filter, TiledImage& out) const;
+
+	static bool importImage(const QString& source, const QString& target, const QSize& tile = QSize(256, 256));
+	bool exportImage(const QString& target, const char* format = nullptr) const;
+};
+
+inline bool TiledImage::create(const QString& path, const QSize& size, QImage::Format format, const QSize& tile, int alignment)
+{
+	close();
+	if (size.isEmpty() || tile.isEmpty() || alignment < 1)
+		return false;
+	if (format != QImage::Format_Grayscale8 && format != QImage::Format_RGB32)
+		format = QImage::Format_ARGB32;
+	TiledImageHeader h = {};
+	std::memcpy(h.magic, "QLTI", 4);
+	h.version = Version;
+	h.width = size.width();
+	h.height = size.height();
+	h.tileWidth = tile.width();
+	h.tileHeight = tile.height();
+	h.tilesX = (size.width() + tile.width() - 1) / tile.width();
+	h.tilesY = (size.height() + tile.height() - 1) / tile.height();
+	h.format = format;
+	h.bytesPerPixel = format == QImage::Format_Grayscale8 ? 1 : 4;
+	h.alignment = alignment;
+
+	auto align = [alignment](std::uint64_t value) { return (value + alignment - 1) / alignment * alignment; };
+	std::uint64_t count = std::uint64_t(h.tilesX) * h.tilesY;
+	std::uint64_t tileBytes = align(std::uint64_t(h.tileWidth) * h.tileHeight * h.bytesPerPixel);
+	std::vector<std::uint64_t> table(count);
+	std::uint64_t offset = align(sizeof(TiledImageHeader) + count * sizeof(std::uint64_t));
+	for (std::uint64_t i = 0; i < count; i++, offset += tileBytes)
+		table[i] = offset;
+
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !file.resize(offset))
+		return false;
+	file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	file.write(reinterpret_cast<const char*>(table.data()), count * sizeof(std::uint64_t));
+	file.flush();
+	map = file.map(0, offset);
+	writable = true;
+	return map != nullptr;
+}
+
+inline bool TiledImage::open(const QString& path, bool readWrite)
+{
+	close();
+	file.setFileName(path);
+	if (!file.open(readWrite ? QIODevice::ReadWrite : QIODevice::ReadOnly))
+		return false;
+	if (file.size() < static_cast<qint64>(sizeof(TiledImageHeader)))
+		return false;
+	map = file.map(0, file.size());
+	writable = readWrite;
+	if (!map)
+		return false;
+	if (std::memcmp(header().magic, "QLTI", 4) != 0 || header().version != Version)
+	{
+		std::cerr << "TiledImage: " << path.toStdString() << " is not a tiled image" << std::endl;
+		close();
+		return false;
+	}
+	if (!isValid(file.size()))
+	{
+		std::cerr << "TiledImage: " << path.toStdString() << " is truncated or corrupt" << std::endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+inline bool TiledImage::isValid(qint64 fileSize) const
+{
+	const TiledImageHeader& h = header();
+	const std::uint64_t limit = std::uint64_t(fileSize);
+	const std::uint32_t maxSide = 1u << 30;
+	if (h.width == 0 || h.height == 0 || h.width > maxSide || h.height > maxSide)
+		return false;
+	if (h.tileWidth == 0 || h.tileHeight == 0 || h.tileWidth > maxSide || h.tileHeight > maxSide)
+		return false;
+	if (h.tilesX != (h.width + h.tileWidth - 1) / h.tileWidth || h.tilesY != (h.height + h.tileHeight - 1) / h.tileHeight)
+		return false;
+	bool gray = h.format == QImage::Format_Grayscale8;
+	if (!gray && h.format != QImage::Format_RGB32 && h.format != QImage::Format_ARGB32)
+		return false;
+	if (h.bytesPerPixel != (gray ? 1u : 4u))
+		return false;
+	// Rows of a tile are indexed with int strides
+	std::uint64_t stride = std::uint64_t(h.tileWidth) * h.bytesPerPixel;
+	if (stride > std::uint64_t(std::numeric_limits<int>::max()))
+		return false;
+	std::uint64_t count = std::uint64_t(h.tilesX) * h.tilesY;
+	if (count > (limit - sizeof(TiledImageHeader)) / sizeof(std::uint64_t))
+		return false;
+	std::uint64_t tableEnd = sizeof(TiledImageHeader) + count * sizeof(std::uint64_t);
+	std::uint64_t tileBytes = stride * h.tileHeight;
+	for (std::uint64_t i = 0; i < count; i++)
+	{
+		std::uint64_t offset = offsets()[i];
+		if (offset < tableEnd || offset % h.bytesPerPixel != 0 || offset > limit || tileBytes > limit - offset)
+			return false;
+	}
+	return true;
+}
+
+inline void TiledImage::close()
+{
+	if (map)
+		file.unmap(map);
+	map = nullptr;
+	file.close();
+}
+
+inline QRect TiledImage::tileRect(int tx, int ty) const
+{
+	QRect rect(tx * header().tileWidth, ty * header().tileHeight, header().tileWidth, header().tileHeight);
+	return rect.intersected(QRect(QPoint(0, 0), size()));
+}
+
+inline QImage TiledImage::tile(int tx, int ty) const
+{
+	QRect rect = tileRect(tx, ty);
+	const uchar* bits = map + offsets()[ty * tilesX() + tx];
+	return QImage(bits, rect.width(), rect.height(), tileStride(), format());
+}
+
+inline QImage TiledImage::tile(int tx, int ty)
+{
+	if (!writable)
+		return static_cast<const TiledImage&>(*this).tile(tx, ty);
+	QRect rect = tileRect(tx, ty);
+	uchar* bits = map + offsets()[ty * tilesX() + tx];
+	return QImage(bits, rect.width(), rect.height(), tileStride(), format());
+}
+
+inline QImage TiledImage::region(const QRect& rect) const
+{
+	QImage result(rect.size(), format());
+	Tracer::countAllocation(result.sizeInBytes());
+	int bpp = header().bytesPerPixel;
+	for (int ty = rect.top() / int(header().tileHeight); ty <= rect.bottom() / int(header().tileHeight); ty++)
+		for (int tx = rect.left() / int(header().tileWidth); tx <= rect.right() / int(header().tileWidth); tx++)
+		{
+			QRect part = tileRect(tx, ty).intersected(rect);
+			QImage view = tile(tx, ty);
+			QRect local = part.translated(-tileRect(tx, ty).topLeft());
+			for (int y = 0; y < part.height(); y++)
+				std::memcpy(result.scanLine(part.top() - rect.top() + y) + (part.left() - rect.left()) * bpp,
+					view.constScanLine(local.top() + y) + local.left() * bpp, part.width() * bpp);
+		}
+	return result;
+}
+
+inline bool TiledImage::write(const QImage& img, const QPoint& pos)
+{
+	if (!writable)
+		return false;
+	QImage src = img.format() == format() ? img : img.convertToFormat(format());
+	QRect rect = QRect(pos, src.size()).intersected(QRect(QPoint(0, 0), size()));
+	int bpp = header().bytesPerPixel;
+	for (int ty = 0; ty < tilesY(); ty++)
+		for (int tx = 0; tx < tilesX(); tx++)
+		{
+			QRect part = tileRect(tx, ty).intersected(rect);
+			if (part.isEmpty())
+				continue;
+			QImage view = tile(tx, ty);
+			QRect local = part.translated(-tileRect(tx, ty).topLeft());
+			for (int y = 0; y < part.height(); y++)
+				std::memcpy(view.scanLine(local.top() + y) + local.left() * bpp,
+					src.constScanLine(part.top() - pos.y() + y) + (part.left() - pos.x()) * bpp, part.width() * bpp);
+		}
+	return true;
+}
+
+inline bool TiledImage::apply(const Filter& filter, TiledImage& out) const
+{
+	if (!out.writable || out.size() != size() || out.tileSize() != tileSize())
+		return false;
+	if (!filter.isLocal())
+		return out.write(filter.process(toImage()));
+	for (int ty = 0; ty < tilesY(); ty++)
+		for (int tx = 0; tx < tilesX(); tx++)
+		{
+			QRect rect = tileRect(tx, ty);
+			QImage target = out.tile(tx, ty);
+			TraceScope scope("tile", "tile");
+			scope.addPixels(qint64(rect.width()) * rect.height());
+			QRect area = filter.requiredRect(rect, size());
+			if (area == rect && filter.outputFormat(tile(tx, ty)) == target.format())
+			{
+				filter.processRegion(tile(tx, ty), QRect(QPoint(0, 0), rect.size()), target);
+				continue;
+			}
+			QImage src = region(area);
+			QImage dst(area.size(), filter.outputFormat(src));
+			QRect local = rect.translated(-area.topLeft());
+			filter.processRegion(src, local, dst);
+			const QImage part(dst.constScanLine(local.top()) + local.left() * dst.depth() / 8, local.width(), local.height(), dst.bytesPerLine(), dst.format());
+			out.write(part, rect.topLeft());
+		}
+	return true;
+}
+
+inline bool TiledImage::importImage(const QString& source, const QString& target, const QSize& tile)
+{
+	QImage img;
+	if (!loadImage(img, source))
+		return false;
+	TiledImage tiled;
+	return tiled.create(target, img.size(), img.format(), tile) && tiled.write(img);
+}
+
+inline bool TiledImage::exportImage(const QString& target, const char* format) const
+{
+	return saveImage(toImage(), target, format);
+}
@@ -0,0 +1,223 @@
+﻿#pragma once
+#include <QImage>
+#include <QString>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#include <cstdlib>
+#endif
+
+// Readable class name for trace labels and reports
+inline std::string className(const std::type_info& type)
+{
+	std::string name = type.name();
+#ifdef __GNUG__
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+	if (status == 0 && demangled)
+		name = demangled;
+	std::free(demangled);
+#else
+	if (name.compare(0, 6, "class ") == 0)
+		name.erase(0, 6);
+#endif
+	return name;
+}
+
+// Collects scoped timings and counters while enabled; when disabled every
+// hook is a single relaxed atomic load. Results are written as Chrome trace
+// JSON (chrome://tracing, Perfetto) or as a per-name summary table.
+class Tracer
+{
+public:
+	struct Event
+	{
+		std::string name;
+		const char* category;
+		qint64 start, duration;	// microseconds since the tracer was created
+		int thread;
+		qint64 pixels, bytes;
+	};
+private:
+	static std::atomic<bool>& flag()
+	{
+		static std::atomic<bool> value(false);
+		return value;
+	}
+	std::mutex mutex;
+	std::vector<Event> events;
+	std::map<std::thread::id, int> threads;
+	std::atomic<qint64> allocations{ 0 }, allocatedBytes{ 0 };
+	const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+	int threadIndex(std::thread::id id)
+	{
+		auto it = threads.find(id);
+		if (it != threads.end())
+			return it->second;
+		int index = static_cast<int>(threads.size()) + 1;
+		threads[id] = index;
+		return index;
+	}
+public:
+	static Tracer& instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+	static bool enabled() { return flag().load(std::memory_order_relaxed); }
+	static void setEnabled(bool value) { flag().store(value); }
+
+	qint64 now() const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+	}
+	void record(Event event)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		event.thread = threadIndex(std::this_thread::get_id());
+		events.push_back(std::move(event));
+	}
+	static void countAllocation(std::size_t bytes)
+	{
+		if (!enabled())
+			return;
+		instance().allocations++;
+		instance().allocatedBytes += bytes;
+	}
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		events.clear();
+		allocations = 0;
+		allocatedBytes = 0;
+	}
+	std::vector<Event> snapshot()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return events;
+	}
+
+	bool writeChromeTrace(const QString& path);
+	void printSummary(std::ostream& out = std::cout);
+};
+
+inline bool Tracer::writeChromeTrace(const QString& path)
+{
+	std::ofstream out(path.toStdString());
+	if (!out)
+		return false;
+	auto escape = [](const std::string& text)
+	{
+		std::string result;
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+				result += '\\';
+			result += c;
+		}
+		return result;
+	};
+	std::vector<Event> list = snapshot();
+	out << "{\"traceEvents\":[\n";
+	for (std::size_t i = 0; i < list.size(); i++)
+	{
+		const Event& e = list[i];
+		out << "{\"name\":\"" << escape(e.name) << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"ts\":" << e.start
+			<< ",\"dur\":" << e.duration << ",\"pid\":1,\"tid\":" << e.thread
+			<< ",\"args\":{\"pixels\":" << e.pixels << ",\"bytes\":" << e.bytes << "}},\n";
+	}
+	out << "{\"name\":\"allocations\",\"ph\":\"C\",\"ts\":" << now() << ",\"pid\":1,\"args\":{\"count\":"
+		<< allocations.load() << ",\"bytes\":" << allocatedBytes.load() << "}}\n]}\n";
+	return static_cast<bool>(out);
+}
+
+inline void Tracer::printSummary(std::ostream& out)
+{
+	struct Row
+	{
+		int calls = 0;
+		qint64 total = 0, longest = 0, pixels = 0, bytes = 0;
+	};
+	std::map<std::string, Row> rows;
+	for (const Event& e : snapshot())
+	{
+		Row& row = rows[std::string(e.category) + ": " + e.name];
+		row.calls++;
+		row.total += e.duration;
+		row.longest = std::max(row.longest, e.duration);
+		row.pixels += e.pixels;
+		row.bytes += e.bytes;
+	}
+	out << std::left << std::setw(40) << "scope" << std::right << std::setw(8) << "calls" << std::setw(12) << "total ms"
+		<< std::setw(12) << "mean ms" << std::setw(12) << "max ms" << std::setw(12) << "Mpix/s" << std::setw(12) << "MB" << "\n";
+	out << std::fixed << std::setprecision(2);
+	for (const auto& entry : rows)
+	{
+		const Row& row = entry.second;
+		double seconds = row.total / 1e6;
+		out << std::left << std::setw(40) << entry.first.substr(0, 39) << std::right << std::setw(8) << row.calls
+			<< std::setw(12) << row.total / 1e3 << std::setw(12) << row.total / 1e3 / row.calls << std::setw(12) << row.longest / 1e3
+			<< std::setw(12) << (seconds > 0 ? row.pixels / 1e6 / seconds : 0.0) << std::setw(12) << row.bytes / 1e6 << "\n";
+	}
+	out << "allocations: " << allocations.load() << " (" << allocatedBytes.load() / 1e6 << " MB)\n";
+	out.unsetf(std::ios::fixed);
+}
+
+// Records the lifetime of the enclosing block as one trace event
+class TraceScope
+{
+	bool active;
+	Tracer::Event event;
+public:
+	TraceScope(const char* category, const char* name) : TraceScope(category) { if (active) event.name = name; }
+	TraceScope(const char* category, const std::type_info& type) : TraceScope(category) { if (active) event.name = className(type); }
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+	~TraceScope()
+	{
+		if (!active)
+			return;
+		event.duration = Tracer::instance().now() - event.start;
+		Tracer::instance().record(std::move(event));
+	}
+	void addPixels(qint64 count) { if (active) event.pixels += count; }
+	void addBytes(qint64 count) { if (active) event.bytes += count; }
+private:
+	explicit TraceScope(const char* category) : active(Tracer::enabled())
+	{
+		if (!active)
+			return;
+		event.category = category;
+		event.start = Tracer::instance().now();
+		event.pixels = event.bytes = 0;
+	}
+};
+
+// QImage::load/save with decode/encode timing
+inline bool loadImage(QImage& img, const QString& path)
+{
+	TraceScope scope("io", "decode");
+	bool ok = img.load(path);
+	scope.addPixels(qint64(img.width()) * img.height());
+	scope.addBytes(img.sizeInBytes());
+	return ok;
+}
+
+inline bool saveImage(const QImage& img, const QString& path, const char* format = nullptr)
+{
+	TraceScope scope("io", "encode");
+	scope.addPixels(qint64(img.width()) * img.height());
+	scope.addBytes(img.sizeInBytes());
+	return img.save(path, format);
+}
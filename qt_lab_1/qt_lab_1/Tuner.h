@@ -0,0 +1,403 @@
+﻿#pragma once
+#include <QImage>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CostModel.h"
+#include "Pipeline.h"
+
+enum class TunedAlgorithm
+{
+	Default,	// whatever the filter picks itself
+	Spatial,	// direct kernel loops
+	FFT,		// block FFT correlation
+	Separable	// Gaussians: the recursive row and column passes
+};
+
+// How one filter runs fastest on this machine: the algorithm, the tiles
+// runPlan() hands to processRegion() and the threads that take them
+struct TuningPlan
+{
+	TunedAlgorithm algorithm = TunedAlgorithm::Default;
+	QSize tile = QSize(0, 64);	// a width of 0 spans the image
+	int threads = 0;			// 0: one per core
+};
+
+// Profile key: filter class and radius, so Gaussian 3 and Gaussian 10 get
+// plans of their own, and for Gaussians also sigma, as the Separable plan
+// only holds from RecursiveGaussianMinSigma up; a pipeline joins the keys
+// of its stages with '+'
+inline std::string tuningKey(const Filter& filter)
+{
+	if (const Pipeline* pipeline = dynamic_cast<const Pipeline*>(&filter))
+	{
+		std::string key;
+		for (std::size_t i = 0; i < pipeline->size(); i++)
+			key += (i ? "+" : "") + tuningKey(pipeline->stage(i));
+		return key;
+	}
+	std::ostringstream key;
+	key << className(typeid(filter)) << "/" << filter.margins().left();
+	if (const GaussianFilter* fir = dynamic_cast<const GaussianFilter*>(&filter))
+		key << "/" << fir->getSigma();
+	else if (const RecursiveGaussianFilter* iir = dynamic_cast<const RecursiveGaussianFilter*>(&filter))
+		key << "/" << iir->getSigma();
+	return key.str();
+}
+
+// Plans by key and the calibrated cost models, kept as text:
+//   host <cores> <simd bits>
+//   model <ns per tap> <ns per FFT point>
+//   costs <point ns> <median sample ns> <recursive ns> <generic ns>
+//   plan <key> <algorithm> <tile width> <tile height> <threads>
+// The SIMD width is the one compiled in. A profile written under another
+// host line is ignored on load, as its timings no longer apply.
+class TuningProfile
+{
+	mutable std::mutex mutex;
+	std::map<std::string, TuningPlan> plans;
+	std::string path;
+public:
+	static TuningProfile& instance()
+	{
+		static TuningProfile profile;
+		return profile;
+	}
+	static std::string host()
+	{
+#ifdef COLORSPACE_SSE2
+		int simd = 128;
+#else
+		int simd = 0;
+#endif
+		return std::to_string(std::max(1u, std::thread::hardware_concurrency())) + " " + std::to_string(simd);
+	}
+	// Remembers path, so plans tuned on first use are written back to it
+	bool load(const std::string& file);
+	bool save() const;
+	bool find(const std::string& key, TuningPlan& plan) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = plans.find(key);
+		if (it == plans.end())
+			return false;
+		plan = it->second;
+		return true;
+	}
+	void set(const std::string& key, const TuningPlan& plan)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		plans[key] = plan;
+	}
+	void setPath(const std::string& file)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		path = file;
+	}
+	std::size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return plans.size();
+	}
+};
+
+inline bool TuningProfile::load(const std::string& file)
+{
+	setPath(file);
+	std::ifstream in(file);
+	if (!in)
+		return false;
+	std::map<std::string, TuningPlan> loaded;
+	ConvolutionCostModel model = ConvolutionCostModel::instance();
+	FilterCostModel costs = FilterCostModel::instance();
+	std::string line;
+	while (std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		std::string tag;
+		fields >> tag;
+		if (tag == "host")
+		{
+			std::string rest;
+			std::getline(fields >> std::ws, rest);
+			if (rest != host())
+				return false;
+		}
+		else if (tag == "model")
+			fields >> model.spatialTap >> model.fftPoint;
+		else if (tag == "costs")
+			fields >> costs.pointPixel >> costs.medianSample >> costs.recursivePixel >> costs.genericPixel;
+		else if (tag == "plan")
+		{
+			std::string key;
+			int algorithm = 0, width = 0, height = 0;
+			TuningPlan plan;
+			if (!(fields >> key >> algorithm >> width >> height >> plan.threads))
+				continue;
+			plan.algorithm = static_cast<TunedAlgorithm>(std::min(std::max(algorithm, 0), 3));
+			plan.tile = QSize(width, height);
+			loaded[key] = plan;
+		}
+	}
+	ConvolutionCostModel::instance() = model;
+	FilterCostModel::instance() = costs;
+	std::lock_guard<std::mutex> lock(mutex);
+	plans = std::move(loaded);
+	return true;
+}
+
+inline bool TuningProfile::save() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (path.empty())
+		return false;
+	std::ofstream out(path);
+	const ConvolutionCostModel& model = ConvolutionCostModel::instance();
+	out << "host " << host() << "\n";
+	const FilterCostModel& costs = FilterCostModel::instance();
+	out << "model " << model.spatialTap << " " << model.fftPoint << "\n";
+	out << "costs " << costs.pointPixel << " " << costs.medianSample << " " << costs.recursivePixel << " " << costs.genericPixel << "\n";
+	for (const auto& entry : plans)
+		out << "plan " << entry.first << " " << static_cast<int>(entry.second.algorithm) << " "
+			<< entry.second.tile.width() << " " << entry.second.tile.height() << " " << entry.second.threads << "\n";
+	return static_cast<bool>(out);
+}
+
+// The filter as the plan wants it run; the filter itself when the plan
+// does not apply to it. Pipeline stages get the plans stored for them.
+inline std::shared_ptr<const Filter> configureFilter(const std::shared_ptr<const Filter>& filter, const TuningPlan& plan,
+	const TuningProfile& profile = TuningProfile::instance())
+{
+	if (const Pipeline* pipeline = dynamic_cast<const Pipeline*>(filter.get()))
+	{
+		auto result = std::make_shared<Pipeline>();
+		for (std::size_t i = 0; i < pipeline->size(); i++)
+		{
+			TuningPlan stagePlan;
+			profile.find(tuningKey(pipeline->stage(i)), stagePlan);
+			result->add(configureFilter(pipeline->sharedStage(i), stagePlan, profile));
+		}
+		return result;
+	}
+	ConvolutionBackend backend = plan.algorithm == TunedAlgorithm::FFT ? ConvolutionBackend::FFT : ConvolutionBackend::Spatial;
+	if (const GaussianFilter* gaussian = dynamic_cast<const GaussianFilter*>(filter.get()))
+	{
+		if (plan.algorithm == TunedAlgorithm::Separable && gaussian->getSigma() >= RecursiveGaussianMinSigma)
+		{
+			auto iir = std::make_shared<RecursiveGaussianFilter>(gaussian->getSigma());
+			iir->setBorder(gaussian->getBorder());
+			return iir;
+		}
+	}
+	else if (const RecursiveGaussianFilter* iir = dynamic_cast<const RecursiveGaussianFilter*>(filter.get()))
+	{
+		if (plan.algorithm != TunedAlgorithm::Spatial && plan.algorithm != TunedAlgorithm::FFT)
+			return filter;
+		auto fir = std::make_shared<GaussianFilter>(static_cast<std::size_t>(std::ceil(3 * iir->getSigma())), iir->getSigma());
+		fir->setBorder(iir->getBorder());
+		fir->setBackend(backend);
+		return fir;
+	}
+	const MatrixFilter* matrix = dynamic_cast<const MatrixFilter*>(filter.get());
+	const MotionBlurFilter* motion = dynamic_cast<const MotionBlurFilter*>(matrix);
+	if (!matrix || !matrix->isLinear() || (motion && motion->isDirectional()) || (plan.algorithm != TunedAlgorithm::Spatial && plan.algorithm != TunedAlgorithm::FFT))
+		return filter;
+	return matrix->withBackend(backend);
+}
+
+// The filter configured by the plans the profile holds for it or for its
+// stages, the filter itself when there are none. Never tunes, so it costs
+// no more than a lookup per stage.
+inline std::shared_ptr<const Filter> tunedFilter(const std::shared_ptr<const Filter>& filter,
+	const TuningProfile& profile = TuningProfile::instance())
+{
+	if (!filter || profile.size() == 0)
+		return filter;
+	TuningPlan plan;
+	if (!profile.find(tuningKey(*filter), plan) && !dynamic_cast<const Pipeline*>(filter.get()))
+		return filter;
+	return configureFilter(filter, plan, profile);
+}
+
+// Filters img in tiles of plan.tile over plan.threads threads. Filters
+// that need the whole image, or narrow it to grey, go through process().
+inline QImage runPlan(const Filter& filter, const QImage& img, const TuningPlan& plan)
+{
+	if (!filter.isLocal() || filter.producesGray())
+		return filter.process(img);
+	TraceScope scope("tuned", typeid(filter));
+	scope.addPixels(qint64(img.width()) * img.height());
+	const QImage src = img.format() == QImage::Format_Grayscale8 && !filter.supportsGray() ? img.convertToFormat(QImage::Format_RGB32) : img;
+	QImage result(src.size(), filter.outputFormat(src));
+	Tracer::countAllocation(result.sizeInBytes());
+	int tileWidth = plan.tile.width() > 0 ? std::min(plan.tile.width(), src.width()) : src.width();
+	int tileHeight = plan.tile.height() > 0 ? std::min(plan.tile.height(), src.height()) : src.height();
+	int tilesX = (src.width() + tileWidth - 1) / std::max(1, tileWidth);
+	int tilesY = (src.height() + tileHeight - 1) / std::max(1, tileHeight);
+	int count = tilesX * tilesY;
+	int threads = plan.threads > 0 ? plan.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+	// Every worker writes through a view of its own, so none of them detaches the result
+	uchar* bits = result.bits();
+	std::atomic<int> next{ 0 };
+	auto work = [&]
+	{
+		QImage dst(bits, result.width(), result.height(), result.bytesPerLine(), result.format());
+		for (int i = next++; i < count; i = next++)
+		{
+			QRect rect(i % tilesX * tileWidth, i / tilesX * tileHeight, tileWidth, tileHeight);
+			filter.processRegion(src, rect.intersected(src.rect()), dst);
+		}
+	};
+	std::vector<std::thread> pool;
+	for (int t = 1; t < std::min(threads, count); t++)
+		pool.emplace_back(work);
+	work();
+	for (std::thread& thread : pool)
+		thread.join();
+	return result;
+}
+
+// Benchmarks the candidate plans of a filter on a sample image and keeps
+// the fastest in the profile. The search goes one axis at a time: the
+// algorithm with the default tiling on all cores, then the tile shape for
+// that algorithm, then the thread count.
+class AutoTuner
+{
+	TuningProfile& profile;
+	int sampleSide;
+	std::ostream* log;
+
+	static std::vector<TunedAlgorithm> algorithms(const Filter& filter, const QSize& size);
+	double measure(const std::shared_ptr<const Filter>& filter, const QImage& sample, const TuningPlan& plan) const;
+public:
+	explicit AutoTuner(TuningProfile& profile = TuningProfile::instance(), int sampleSide = 512, std::ostream* log = nullptr)
+		: profile(profile), sampleSide(sampleSide), log(log) {}
+	TuningPlan tune(const std::shared_ptr<const Filter>& filter, const QImage& sample);
+	// The stored plan, tuned on a synthetic sample and saved on first use
+	TuningPlan plan(const std::shared_ptr<const Filter>& filter);
+	QImage sample() const;
+	TuningProfile& getProfile() const { return profile; }
+};
+
+inline std::vector<TunedAlgorithm> AutoTuner::algorithms(const Filter& filter, const QSize& size)
+{
+	const GaussianFilter* fir = dynamic_cast<const GaussianFilter*>(&filter);
+	const RecursiveGaussianFilter* iir = dynamic_cast<const RecursiveGaussianFilter*>(&filter);
+	const MatrixFilter* matrix = dynamic_cast<const MatrixFilter*>(&filter);
+	if (!iir && !(matrix && matrix->isLinear()))
+		return { TunedAlgorithm::Default };
+	std::vector<TunedAlgorithm> result = { TunedAlgorithm::Spatial };
+	int kernelSize = iir ? 2 * static_cast<int>(std::ceil(3 * iir->getSigma())) + 1 : 2 * filter.margins().left() + 1;
+	if (ConvolutionCostModel::blockSize(kernelSize, size.width(), size.height()))
+		result.push_back(TunedAlgorithm::FFT);
+	// Below RecursiveGaussianMinSigma the recursive filter is visibly less accurate
+	if (iir || (fir && fir->getSigma() >= RecursiveGaussianMinSigma))
+		result.push_back(TunedAlgorithm::Separable);
+	return result;
+}
+
+inline double AutoTuner::measure(const std::shared_ptr<const Filter>& filter, const QImage& sample, const TuningPlan& plan) const
+{
+	typedef std::chrono::steady_clock Clock;
+	auto configured = configureFilter(filter, plan, profile);
+	double best = HUGE_VAL;
+	// Best of two, the first also warms caches and lazily built tables
+	for (int run = 0; run < 2; run++)
+	{
+		auto start = Clock::now();
+		runPlan(*configured, sample, plan);
+		best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+	}
+	return best;
+}
+
+inline TuningPlan AutoTuner::tune(const std::shared_ptr<const Filter>& filter, const QImage& sample)
+{
+	// Stages first, so the pipeline is timed with the plans it will run with
+	if (const Pipeline* pipeline = dynamic_cast<const Pipeline*>(filter.get()))
+		for (std::size_t i = 0; i < pipeline->size(); i++)
+			tune(pipeline->sharedStage(i), sample);
+
+	TuningPlan best;
+	double bestTime = HUGE_VAL;
+	auto consider = [&](const TuningPlan& plan)
+	{
+		double time = measure(filter, sample, plan);
+		if (time < bestTime)
+		{
+			bestTime = time;
+			best = plan;
+		}
+	};
+	for (TunedAlgorithm algorithm : algorithms(*filter, sample.size()))
+	{
+		TuningPlan plan = best;
+		plan.algorithm = algorithm;
+		consider(plan);
+	}
+	if (filter->isLocal() && !filter->producesGray())
+	{
+		static const QSize tiles[] = { QSize(0, 16), QSize(0, 256), QSize(256, 256), QSize(128, 128), QSize(64, 64) };
+		TuningPlan base = best;
+		for (const QSize& tile : tiles)
+		{
+			TuningPlan plan = base;
+			plan.tile = tile;
+			consider(plan);
+		}
+		int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		base = best;
+		for (int threads : { 1, std::max(1, cores / 2), cores })
+		{
+			TuningPlan plan = base;
+			plan.threads = threads;
+			consider(plan);
+		}
+	}
+	std::string key = tuningKey(*filter);
+	profile.set(key, best);
+	if (log)
+		*log << key << ": algorithm " << static_cast<int>(best.algorithm) << ", tile " << best.tile.width() << "x" << best.tile.height()
+			<< ", threads " << best.threads << ", " << bestTime << " ms\n";
+	return best;
+}
+
+inline QImage AutoTuner::sample() const
+{
+	QImage img(sampleSide, sampleSide, QImage::Format_RGB32);
+	for (int y = 0; y < sampleSide; y++)
+	{
+		QRgb* line = reinterpret_cast<QRgb*>(img.scanLine(y));
+		for (int x = 0; x < sampleSide; x++)
+			line[x] = qRgb(x * 255 / sampleSide, y * 255 / sampleSide, (x ^ y) & 255);
+	}
+	return img;
+}
+
+inline TuningPlan AutoTuner::plan(const std::shared_ptr<const Filter>& filter)
+{
+	TuningPlan result;
+	if (profile.find(tuningKey(*filter), result))
+		return result;
+	result = tune(filter, sample());
+	profile.save();
+	return result;
+}
+
+// Runs filter the way the profile says is fastest here, tuning it first if
+// this machine has never seen it
+inline QImage runTuned(const std::shared_ptr<const Filter>& filter, const QImage& img, AutoTuner& tuner)
+{
+	TuningPlan plan = tuner.plan(filter);
+	return runPlan(*configureFilter(filter, plan, tuner.getProfile()), img, plan);
+}
@@ -1,4 +1,13 @@
 #include "Filter.h"
+#include "Batch.h"
+#include "CostModel.h"
+#include "FilterChain.h"
+#include "Planar.h"
+#include "SelfCheck.h"
+#include "Tuner.h"
+#ifdef __linux__
+#include "Daemon.h"
+#endif
 #include <iostream>
 
 using namespace std;
@@ -308,6 +317,10 @@ void BlackHat(const QImage& source, QImage& result)
 void main(int argc, char* argv[])
 {
 	std::string s;
+	std::string tracePath;
+	std::string daemonPath, benchPath, deepPath, outPath, chain = "median:2";
+	int clients = 4, requests = 1000, batchSide = 0;
+	bool perf = false, tune = false, estimate = false, selfCheck = false;
 	QImage img;
 
 	for (int i = 0; i < argc; i++)
@@ -316,10 +329,157 @@ void main(int argc, char* argv[])
 		{
 			s = argv[i + 1];
 		}
+		if (!strcmp(argv[i], "-trace") && (i + 1 < argc))
+		{
+			tracePath = argv[i + 1];
+		}
+		if (!strcmp(argv[i], "-perf"))
+		{
+			perf = true;
+		}
+		if (!strcmp(argv[i], "-daemon") && (i + 1 < argc))
+		{
+			daemonPath = argv[i + 1];
+		}
+		if (!strcmp(argv[i], "-bench") && (i + 1 < argc))
+		{
+			benchPath = argv[i + 1];
+		}
+		if (!strcmp(argv[i], "-chain") && (i + 1 < argc))
+		{
+			chain = argv[i + 1];
+		}
+		if (!strcmp(argv[i], "-clients") && (i + 1 < argc))
+		{
+			clients = atoi(argv[i + 1]);
+		}
+		if (!strcmp(argv[i], "-requests") && (i + 1 < argc))
+		{
+			requests = atoi(argv[i + 1]);
+		}
+		if (!strcmp(argv[i], "-batch") && (i + 1 < argc))
+		{
+			batchSide = atoi(argv[i + 1]);
+		}
+		if (!strcmp(argv[i], "--tune") || !strcmp(argv[i], "-tune"))
+		{
+			tune = true;
+		}
+		if (!strcmp(argv[i], "-estimate"))
+		{
+			estimate = true;
+		}
+		if (!strcmp(argv[i], "-selfcheck"))
+		{
+			selfCheck = true;
+		}
+		if (!strcmp(argv[i], "-o") && (i + 1 < argc))
+		{
+			outPath = argv[i + 1];
+		}
+		if (!strcmp(argv[i], "-deep") && (i + 1 < argc))
+		{
+			deepPath = argv[i + 1];
+		}
 	}
+	Tracer::setEnabled(!tracePath.empty());
+	perf = perf && PerfProfiler::setEnabled(true);
+	TuningProfile::instance().load("tuning.profile");
 
-	img.load(QString(s.c_str()));
-	img.save("img/giraffe.png");
+	// --tune [-chain spec]: benchmark the usual filters and the chain on this machine, keep the winners
+	if (tune)
+	{
+		FilterCostModel::instance().calibrate();
+		AutoTuner tuner(TuningProfile::instance(), 512, &std::cout);
+		QImage sample = tuner.sample();
+		for (const char* spec : { "gauss:1", "gauss:4", "blur:3", "sobel", "median:1", "median:10", "dilate", "invert" })
+			tuner.tune(parseFilterChain(spec), sample);
+		if (auto filter = parseFilterChain(chain))
+			tuner.tune(filter, sample);
+		TuningProfile::instance().save();
+		return;
+	}
+
+#ifdef __linux__
+	// -daemon <socket>: serve filter chains until killed
+	if (!daemonPath.empty())
+	{
+		FilterDaemon daemon(daemonPath);
+		if (daemon.listen())
+			daemon.run();
+		return;
+	}
+#endif
+
+	loadImage(img, QString(s.c_str()));
+	saveImage(img, "img/giraffe.png");
+
+#ifdef __linux__
+	// -bench <socket> [-chain spec] [-clients n] [-requests n]: load a running daemon with -p image
+	if (!benchPath.empty())
+	{
+		printDaemonLoadReport(runDaemonLoad(benchPath, chain, img, clients, requests / std::max(1, clients)));
+		return;
+	}
+#endif
+	// -selfcheck: consistency checks of the filters on -p image
+	if (selfCheck)
+	{
+		runSelfCheck(img);
+		return;
+	}
+	// -estimate [-chain spec]: predicted cost of the chain on -p image
+	if (estimate)
+	{
+		if (auto filter = tunedFilter(parseFilterChain(chain)))
+		{
+			CostEstimate cost = estimateCost(*filter, img.size(), img.format());
+			std::cout << chain << ": " << cost.cpuSeconds << " CPU-s, " << cost.peakBytes << " bytes in " << cost.buffers << " buffers\n";
+		}
+		return;
+	}
+	// -deep <out> [-chain spec]: run the chain on float planes, without 8-bit steps in between
+	if (!deepPath.empty())
+	{
+		std::string error;
+		auto filter = tunedFilter(parseFilterChain(chain, &error));
+		auto planes = PlanarImage<float>::fromImage(img);
+		if (!filter || !processPlanar(*filter, planes))
+		{
+			std::cout << (filter ? "no deep path for " + chain : error) << "\n";
+			return;
+		}
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+		planes.toDeepImage().save(QString(deepPath.c_str()));
+#else
+		planes.toImage().save(QString(deepPath.c_str()));
+#endif
+		return;
+	}
+	// -o <out> [-chain spec]: run the chain the way the tuning profile says is fastest, tuning it first if needed
+	if (!outPath.empty())
+	{
+		std::string error;
+		auto filter = parseFilterChain(chain, &error);
+		if (!filter)
+		{
+			std::cout << error << "\n";
+			return;
+		}
+		AutoTuner tuner;
+		runTuned(filter, img, tuner).save(QString(outPath.c_str()));
+		return;
+	}
+	// -batch <side>: thumbnail throughput of batched against single calls
+	if (batchSide > 0)
+	{
+		QImage thumbnail = img.scaled(batchSide, batchSide);
+		printBatchThroughput(InvertFilter(), thumbnail);
+		printBatchThroughput(SepiaFilter(), thumbnail);
+		printBatchThroughput(GaussianFilter(), thumbnail);
+		printBatchThroughput(MedianFilter(1), thumbnail);
+		return;
+	}
 
 	/*GlassFilter glass;
 	glass.process(img).save("img/glass.png");
@@ -403,6 +563,16 @@ void main(int argc, char* argv[])
 	}
 	img.load(QString(s.c_str()));
 	//perfect reflection
+
+	if (!tracePath.empty())
+	{
+		Tracer::instance().writeChromeTrace(QString(tracePath.c_str()));
+		Tracer::instance().printSummary();
+	}
+	if (perf)
+	{
+		PerfProfiler::instance().printReport();
+	}
 }
 
 /* 